@@ -12,6 +12,13 @@
   to be initialized or destroyed. This file is just a collection
   general-purpose terminal-handling functions.
 
+  The functions that write escape sequences take the stream to write
+  to, which need not be stdout itself -- it could be a memory buffer
+  whose contents will be copied to stdout later. In either case, 
+  whether to write the sequences at all depends on whether stdout is a
+  terminal. This is checked only once, so these functions are safe (and
+  cheap) to call from any thread.
+
 ==========================================================================*/
 
 #define _GNU_SOURCE
@@ -21,10 +28,32 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <termios.h>
+#include <pthread.h>
 #include "defs.h" 
 #include "log.h" 
 #include "console.h" 
 
+static pthread_once_t console_once = PTHREAD_ONCE_INIT;
+static BOOL console_tty = FALSE;
+
+/*==========================================================================
+  console_check_tty 
+==========================================================================*/
+static void console_check_tty (void)
+  {
+  console_tty = isatty (STDOUT_FILENO);
+  }
+
+/*==========================================================================
+  console_is_tty 
+  Returns TRUE if stdout is a terminal
+==========================================================================*/
+BOOL console_is_tty (void)
+  {
+  pthread_once (&console_once, console_check_tty);
+  return console_tty;
+  }
+
 /*==========================================================================
   console_get_width 
 ==========================================================================*/
@@ -61,15 +90,15 @@ int console_get_width (void)
 /*==========================================================================
   console_write_attribute
 ==========================================================================*/
-void console_write_attribute (ConsoleAttr attr, BOOL force)
+void console_write_attribute (FILE *f, ConsoleAttr attr, BOOL force)
   {
 #ifdef FEATURE_ANSI_TERMINAL
   LOG_IN
-  if (force || isatty (STDOUT_FILENO))
+  if (force || console_is_tty ())
     {
     char s[20];
     sprintf (s, "\x1B[%dm", (int)attr);
-    fputs (s, stdout);
+    fputs (s, f);
     }
 #endif
   LOG_OUT
@@ -79,15 +108,15 @@ void console_write_attribute (ConsoleAttr attr, BOOL force)
 /*==========================================================================
   console_fg_colour
 ==========================================================================*/
-void console_fg_colour (ConsoleColour colour, BOOL force)
+void console_fg_colour (FILE *f, ConsoleColour colour, BOOL force)
   {
 #ifdef FEATURE_ANSI_TERMINAL
   LOG_IN
-  if (force || isatty (STDOUT_FILENO))
+  if (force || console_is_tty ())
     {
     char s[20];
     sprintf (s, "\x1B[3%dm", (int)colour);
-    fputs (s, stdout);
+    fputs (s, f);
     }
 #endif
   LOG_OUT
@@ -97,15 +126,15 @@ void console_fg_colour (ConsoleColour colour, BOOL force)
 /*==========================================================================
   console_bg_colour
 ==========================================================================*/
-void console_bg_colour (ConsoleColour colour, BOOL force)
+void console_bg_colour (FILE *f, ConsoleColour colour, BOOL force)
   {
 #ifdef FEATURE_ANSI_TERMINAL
   LOG_IN
-  if (force || isatty (STDOUT_FILENO))
+  if (force || console_is_tty ())
     {
     char s[20];
     sprintf (s, "\x1B[4%dm", (int)colour);
-    fputs (s, stdout);
+    fputs (s, f);
     }
 #endif
   LOG_OUT
@@ -117,9 +146,9 @@ void console_bg_colour (ConsoleColour colour, BOOL force)
 ==========================================================================*/
 void console_reset (void)
   {
-  console_write_attribute (CA_NORMAL, FALSE);
-  console_fg_colour (CC_DEFAULT, FALSE);
-  console_bg_colour (CC_DEFAULT, FALSE);
+  console_write_attribute (stdout, CA_NORMAL, FALSE);
+  console_fg_colour (stdout, CC_DEFAULT, FALSE);
+  console_bg_colour (stdout, CC_DEFAULT, FALSE);
   }
 
 
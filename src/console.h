@@ -10,6 +10,7 @@
 
 #pragma once
 
+#include <stdio.h>
 #include "feature.h"
 
 BEGIN_DECLS
@@ -43,9 +44,15 @@ typedef enum
 //   guarantee that stdout or stdin are a TTY -- use isatty() for that
 int console_get_width (void);
 
-void console_write_attribute (ConsoleAttr attr, BOOL force);
-void console_fg_colour (ConsoleColour colour, BOOL force);
-void console_bg_colour (ConsoleColour colour, BOOL force);
+// Returns TRUE if stdout is a terminal. The answer is worked out on the
+//   first call, and remembered
+BOOL console_is_tty (void);
+
+// These functions write an escape sequence to f, but only if stdout
+//   is a terminal, or force is set
+void console_write_attribute (FILE *f, ConsoleAttr attr, BOOL force);
+void console_fg_colour (FILE *f, ConsoleColour colour, BOOL force);
+void console_bg_colour (FILE *f, ConsoleColour colour, BOOL force);
 void console_reset (void);
 void console_read_without_echo (char *password, int len);
 
@@ -0,0 +1,1588 @@
+/*==========================================================================
+
+  kzgrep
+  dfa.c
+  Copyright (c)2020 Kevin Boone
+  Distributed under the terms of the GPL v3.0
+
+  A regular expression engine that does a fixed amount of work for each
+  byte of the subject, whatever the expression, for the expressions --
+  most of those that people actually search for -- that don't need
+  PCRE's backtracking. PCRE is fast for most expressions, but can take
+  time out of all proportion to the size of the text for some, and
+  that is hard to predict.
+
+  The expression is parsed, in the same way PCRE parses it, into a
+  Thompson NFA: a small program of instructions that either match a
+  byte from a set, or branch (to two places, one preferred to the
+  other), or test a condition like ^ or \b. The NFA is then run as a
+  DFA, whose states are built lazily, as the text needs them, and kept
+  in a cache: each state is the ordered list of NFA instructions that
+  could be running at that point. Once the cache holds the states that
+  a kind of text needs, each byte costs a table lookup. If the cache
+  fills up, it's emptied, and we start again; and if that happens so
+  often that it's not worth it, we give up, and PCRE is used instead.
+  Each thread has its own cache for each expression, so threads needn't
+  take turns.
+
+  We need to find the same match that PCRE would -- it matters to
+  highlighting, and to --only-matching. PCRE finds the leftmost match,
+  and of those, the first that its backtracking tries. So the
+  instructions are kept in PCRE's order of preference, and once a
+  state contains a match, the instructions that come after it --
+  including the one that starts new matches further on -- are dropped.
+  The last match seen when no instructions are left is the one PCRE
+  would have found, and the scan stops there. That tells us where the
+  match ends; where it starts is found by running the expression
+  backwards from there, as a second DFA, looking for the longest match.
+  This is the way Russ Cox's RE2 does it.
+
+  Conditions like ^, $ and \b depend on the bytes either side of a
+  position. A state records what kind of byte came before it --
+  newline, word character, or other, or none at all -- and the
+  conditions are tested as each byte is taken, when the byte after the
+  position is known too.
+
+  Like kzgrep's use of PCRE, this works on bytes, not UTF-8 characters,
+  so the automaton has at most 256 inputs; bytes that the expression
+  never distinguishes are grouped into classes, which keeps the tables
+  small. Expressions that use anything else -- back-references,
+  lookaround, atomic groups, and the like -- are left to PCRE.
+
+==========================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "defs.h"
+#include "log.h"
+#include "dfa.h"
+
+// The most NFA instructions an expression can compile to. Counted
+//   repeats, like [0-9a-f]{32}, make a copy of what they repeat
+#define DFA_MAX_PROGRAM 10000
+
+// The memory for each thread's cache of states for each direction of
+//   each expression
+#define DFA_CACHE_SIZE (1024 * 1024)
+
+// If the cache fills up twice in fewer than this many bytes for each
+//   state it holds, we give up on the DFA, and use PCRE
+#define DFA_MIN_BYTES_PER_STATE 10
+
+// Where a byte, or a position, is. DFA_EDGE is the start of the subject
+//   before a position, or the end after it
+#define DFA_EDGE  0
+#define DFA_NL    1
+#define DFA_WORD  2
+#define DFA_OTHER 3
+
+// Conditions
+#define DFA_BOL   0x01 // ^
+#define DFA_EOL   0x02 // $
+#define DFA_WORDB 0x04 // \b
+#define DFA_NWORDB 0x08 // \B
+#define DFA_BOT   0x10 // \A
+#define DFA_EOT   0x20 // \z
+
+// Flags in a transition: there's a match before the byte; and the scan
+//   can't just carry on in the next state, because it's the dead state,
+//   or it might be able to skip ahead
+#define DFA_MATCHED 1
+#define DFA_SPECIAL 2
+
+// What a state's accel is, if not a byte. A state that most bytes 
+//   don't leave is skipped through with a loop that doesn't need to 
+//   wait for each lookup to finish before starting the next
+#define DFA_ACCEL_NONE    -1
+#define DFA_ACCEL_UNKNOWN -2
+#define DFA_ACCEL_LOOP    -3
+
+// A state that no more than this many bytes leave gets DFA_ACCEL_LOOP.
+//   But if the bytes that leave it are common, getting in and out of the
+//   loop costs more than it saves. Each time round, the state gets the
+//   number of bytes skipped, less DFA_LOOP_COST, as credit, up to 
+//   DFA_LOOP_CREDIT; and if it runs out, the state goes back to the 
+//   ordinary way
+#define DFA_LOOP_EXITS 64
+#define DFA_LOOP_COST 16
+#define DFA_LOOP_CREDIT 1024
+
+// The set of bytes, with index 0 in every expression, that matches
+//   anything -- for the instruction that starts a new match further on
+#define DFA_ALL 0
+
+typedef enum
+  {
+  DFA_OP_BYTE, // Match a byte in set arg, then go to x
+  DFA_OP_SPLIT, // Go to x or, less preferably, y
+  DFA_OP_ASSERT, // Go to x, if condition arg holds
+  DFA_OP_MATCH
+  } DfaOp;
+
+typedef struct _DfaInst
+  {
+  DfaOp op;
+  int x, y;
+  int arg;
+  } DfaInst;
+
+typedef struct _DfaSet
+  {
+  uint32_t bits[8];
+  } DfaSet;
+
+typedef enum
+  {
+  DFA_N_EMPTY,
+  DFA_N_SET, // Set a
+  DFA_N_ASSERT, // Condition a
+  DFA_N_CAT, // a then b
+  DFA_N_ALT, // a or, less preferably, b
+  DFA_N_REPEAT // a, min to max times (max -1 for no limit)
+  } DfaNodeType;
+
+// A node in the parsed expression
+typedef struct _DfaNode
+  {
+  DfaNodeType type;
+  int a, b;
+  int min, max;
+  BOOL greedy;
+  } DfaNode;
+
+typedef struct _DfaParser
+  {
+  const char *regex;
+  int pos;
+  BOOL fail; // Found something we don't support
+  BOOL caseless;
+  BOOL asserts; // Found a condition
+  DfaNode *nodes;
+  int num_nodes;
+  DfaSet *sets;
+  int num_sets;
+  } DfaParser;
+
+typedef struct _DfaProgram
+  {
+  int id; // Identifies the program's caches
+  DfaInst *insts;
+  int num_insts;
+  int start;
+  BOOL reverse; // Runs backwards, and finds the longest match
+  BOOL asserts; // Has conditions, so states depend on the byte before
+  } DfaProgram;
+
+struct _Dfa
+  {
+  DfaSet *sets;
+  int num_sets;
+  BYTE classes[256]; // The class of each byte
+  int num_classes;
+  BYTE reps[256]; // A byte in each class
+  int class_sizes[256]; // The number of bytes in each class
+  BYTE contexts[256]; // DFA_NL, DFA_WORD or DFA_OTHER, for each byte
+  DfaProgram forward; // Finds where the match ends
+  DfaProgram backward; // Finds where it starts
+  };
+
+typedef struct _DfaState
+  {
+  int list; // The instructions, in the cache's pool
+  int n;
+  int context; // What came before, if the program has conditions
+  int credit; // How long DFA_ACCEL_LOOP can go on skipping too little
+  } DfaState;
+
+// The states that one thread has built for one program
+typedef struct _DfaCache
+  {
+  int stride; // The number of classes, and one more for the edge
+  int max_states;
+  int num_states;
+  DfaState *states;
+  int *trans; // For each state and class, the next state's row in this
+              //   table * 4, plus DFA_MATCHED and DFA_SPECIAL; or -1 
+              //   if unknown
+  int *accel; // For each state, the only byte that leaves it; or 
+              //   DFA_ACCEL_LOOP, DFA_ACCEL_NONE or DFA_ACCEL_UNKNOWN
+  int *pool; // Lists of instructions
+  int pool_used;
+  int pool_size;
+  int *table; // Hash table of states, each + 1; 0 for an empty slot
+  int table_size;
+  int starts[4]; // Start state, for each context, or -1
+  int dead; // The state with no instructions, or -1
+  unsigned *seen; // For each instruction, when last seen in a closure
+  unsigned seen_gen;
+  unsigned *added; // For each instruction, when last added to a list
+  unsigned added_gen;
+  int *stack;
+  int *closure;
+  int *next;
+  int flushes;
+  } DfaCache;
+
+// The caches a thread has, indexed by program id
+typedef struct _DfaThread
+  {
+  DfaCache **caches;
+  int size;
+  } DfaThread;
+
+static pthread_key_t dfa_thread_key;
+static pthread_once_t dfa_thread_once = PTHREAD_ONCE_INIT;
+static int dfa_next_id = 0;
+
+/*==========================================================================
+  dfa_set_add
+==========================================================================*/
+static inline void dfa_set_add (DfaSet *set, int c)
+  {
+  set->bits[c >> 5] |= 1u << (c & 31);
+  }
+
+/*==========================================================================
+  dfa_set_has
+==========================================================================*/
+static inline BOOL dfa_set_has (const DfaSet *set, int c)
+  {
+  return (set->bits[c >> 5] >> (c & 31)) & 1;
+  }
+
+/*==========================================================================
+  dfa_set_add_range
+==========================================================================*/
+static void dfa_set_add_range (DfaSet *set, int from, int to)
+  {
+  for (int c = from; c <= to; c++) dfa_set_add (set, c);
+  }
+
+/*==========================================================================
+  dfa_set_add_other
+
+  Add the bytes of another set, or the bytes that are not in it
+==========================================================================*/
+static void dfa_set_add_other (DfaSet *set, const DfaSet *other,
+    BOOL negate)
+  {
+  for (int i = 0; i < 8; i++)
+    set->bits[i] |= negate ? ~other->bits[i] : other->bits[i];
+  }
+
+/*==========================================================================
+  dfa_is_word
+
+  Returns TRUE for a byte that \w matches
+==========================================================================*/
+static inline BOOL dfa_is_word (int c)
+  {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+    (c >= '0' && c <= '9') || c == '_';
+  }
+
+/*==========================================================================
+  dfa_node
+==========================================================================*/
+static int dfa_node (DfaParser *pp, DfaNodeType type, int a, int b)
+  {
+  pp->nodes = realloc (pp->nodes, (pp->num_nodes + 1) * sizeof (DfaNode));
+  DfaNode *node = &pp->nodes[pp->num_nodes];
+  memset (node, 0, sizeof (DfaNode));
+  node->type = type;
+  node->a = a;
+  node->b = b;
+  return pp->num_nodes++;
+  }
+
+/*==========================================================================
+  dfa_set_node
+
+  Make a node that matches a byte in the set, or (with caseless) in the
+    set with the other case of each ASCII letter added
+==========================================================================*/
+static int dfa_set_node (DfaParser *pp, const DfaSet *set)
+  {
+  pp->sets = realloc (pp->sets, (pp->num_sets + 1) * sizeof (DfaSet));
+  DfaSet *s = &pp->sets[pp->num_sets];
+  *s = *set;
+  if (pp->caseless)
+    {
+    for (int c = 'a'; c <= 'z'; c++)
+      {
+      if (dfa_set_has (set, c)) dfa_set_add (s, c - 'a' + 'A');
+      if (dfa_set_has (set, c - 'a' + 'A')) dfa_set_add (s, c);
+      }
+    }
+  return dfa_node (pp, DFA_N_SET, pp->num_sets++, 0);
+  }
+
+/*==========================================================================
+  dfa_hex_value
+==========================================================================*/
+static int dfa_hex_value (char c)
+  {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+  }
+
+/*==========================================================================
+  dfa_parse_class_escape
+
+  If the escape at the current position -- just after the backslash --
+    is one for a class of characters, like \d, add the class to the set,
+    skip over it, and return TRUE
+==========================================================================*/
+static BOOL dfa_parse_class_escape (DfaParser *pp, DfaSet *set)
+  {
+  char d = pp->regex[pp->pos];
+  DfaSet s;
+  memset (&s, 0, sizeof (s));
+  switch (d)
+    {
+    case 'd': case 'D':
+      dfa_set_add_range (&s, '0', '9');
+      break;
+    case 'w': case 'W':
+      for (int c = 0; c < 256; c++)
+        if (dfa_is_word (c)) dfa_set_add (&s, c);
+      break;
+    case 's': case 'S':
+      dfa_set_add_range (&s, '\t', '\r');
+      dfa_set_add (&s, ' ');
+      break;
+    case 'h': case 'H':
+      dfa_set_add (&s, '\t');
+      dfa_set_add (&s, ' ');
+      dfa_set_add (&s, 0xA0);
+      break;
+    case 'v': case 'V':
+      dfa_set_add_range (&s, '\n', '\r');
+      dfa_set_add (&s, 0x85);
+      break;
+    default:
+      return FALSE;
+    }
+  pp->pos++;
+  dfa_set_add_other (set, &s, d >= 'A' && d <= 'Z');
+  return TRUE;
+  }
+
+/*==========================================================================
+  dfa_parse_char_escape
+
+  If the escape at the current position -- just after the backslash --
+    stands for a single byte, skip over it, and return the byte.
+    Otherwise return -1. \b is a backspace only in a class
+==========================================================================*/
+static int dfa_parse_char_escape (DfaParser *pp, BOOL in_class)
+  {
+  const char *r = pp->regex;
+  char d = r[pp->pos];
+  int c = -1;
+  switch (d)
+    {
+    case 't': c = '\t'; break;
+    case 'n': c = '\n'; break;
+    case 'r': c = '\r'; break;
+    case 'f': c = '\f'; break;
+    case 'e': c = 0x1B; break;
+    case 'a': c = 0x07; break;
+    case 'b': if (in_class) c = 0x08; break;
+    case 'x':
+      {
+      // \xhh, with up to two digits, or \x{hh...}
+      int i = pp->pos + 1;
+      int value = 0;
+      if (r[i] == '{')
+        {
+        int digits = 0;
+        for (i++; dfa_hex_value (r[i]) >= 0; i++, digits++)
+          {
+          value = value * 16 + dfa_hex_value (r[i]);
+          if (value > 0xFF) return -1;
+          }
+        if (r[i] != '}' || digits == 0) return -1;
+        i++;
+        }
+      else
+        {
+        for (int k = 0; k < 2 && dfa_hex_value (r[i]) >= 0; k++, i++)
+          value = value * 16 + dfa_hex_value (r[i]);
+        }
+      pp->pos = i;
+      return value;
+      }
+    default:
+      // Any other escaped punctuation is itself
+      if (d && !(d >= 'a' && d <= 'z') && !(d >= 'A' && d <= 'Z') &&
+          !(d >= '0' && d <= '9') && !((unsigned char)d & 0x80))
+        c = (unsigned char)d;
+    }
+  if (c >= 0) pp->pos++;
+  return c;
+  }
+
+/*==========================================================================
+  dfa_parse_posix
+
+  Add a class like [:alpha:], at the current position, to the set
+==========================================================================*/
+static void dfa_parse_posix (DfaParser *pp, DfaSet *set)
+  {
+  const char *r = pp->regex + pp->pos + 2;
+  BOOL negate = FALSE;
+  if (*r == '^')
+    {
+    negate = TRUE;
+    r++;
+    }
+  const char *end = strstr (r, ":]");
+  if (!end)
+    {
+    pp->fail = TRUE;
+    return;
+    }
+  int n = end - r;
+  DfaSet s;
+  memset (&s, 0, sizeof (s));
+  for (int c = 0; c < 128; c++)
+    {
+    BOOL in;
+    if (n == 5 && strncmp (r, "alpha", n) == 0)
+      in = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    else if (n == 5 && strncmp (r, "digit", n) == 0)
+      in = c >= '0' && c <= '9';
+    else if (n == 5 && strncmp (r, "alnum", n) == 0)
+      in = dfa_is_word (c) && c != '_';
+    else if (n == 4 && strncmp (r, "word", n) == 0)
+      in = dfa_is_word (c);
+    else if (n == 5 && strncmp (r, "space", n) == 0)
+      in = (c >= '\t' && c <= '\r') || c == ' ';
+    else if (n == 5 && strncmp (r, "blank", n) == 0)
+      in = c == '\t' || c == ' ';
+    else if (n == 5 && strncmp (r, "punct", n) == 0)
+      in = c > ' ' && c < 0x7F && !dfa_is_word (c);
+    else if (n == 5 && strncmp (r, "print", n) == 0)
+      in = c >= ' ' && c < 0x7F;
+    else if (n == 5 && strncmp (r, "graph", n) == 0)
+      in = c > ' ' && c < 0x7F;
+    else if (n == 5 && strncmp (r, "cntrl", n) == 0)
+      in = c < ' ' || c == 0x7F;
+    else if (n == 6 && strncmp (r, "xdigit", n) == 0)
+      in = dfa_hex_value (c) >= 0;
+    else if (n == 5 && strncmp (r, "ascii", n) == 0)
+      in = TRUE;
+    else if (n == 5 && strncmp (r, "upper", n) == 0 && !pp->caseless)
+      in = c >= 'A' && c <= 'Z';
+    else if (n == 5 && strncmp (r, "lower", n) == 0 && !pp->caseless)
+      in = c >= 'a' && c <= 'z';
+    else
+      {
+      // Caseless [:upper:] and [:lower:] are not what they seem, so we
+      //   leave them to PCRE
+      pp->fail = TRUE;
+      return;
+      }
+    if (in) dfa_set_add (&s, c);
+    }
+  dfa_set_add_other (set, &s, negate);
+  pp->pos = end - pp->regex + 2;
+  }
+
+/*==========================================================================
+  dfa_parse_class
+
+  Parse a character class, starting at the [
+==========================================================================*/
+static int dfa_parse_class (DfaParser *pp)
+  {
+  const char *r = pp->regex;
+  DfaSet set;
+  memset (&set, 0, sizeof (set));
+  pp->pos++;
+  BOOL negate = FALSE;
+  if (r[pp->pos] == '^')
+    {
+    negate = TRUE;
+    pp->pos++;
+    }
+  BOOL first = TRUE; // A ] at the start is literal
+  while (!pp->fail)
+    {
+    char c = r[pp->pos];
+    if (c == 0)
+      {
+      pp->fail = TRUE;
+      break;
+      }
+    if (c == ']' && !first) break;
+    first = FALSE;
+
+    int lo;
+    if (c == '[' && r[pp->pos + 1] == ':')
+      {
+      dfa_parse_posix (pp, &set);
+      if (r[pp->pos] == '-' && r[pp->pos + 1] != ']') pp->fail = TRUE;
+      continue;
+      }
+    else if (c == '[' && (r[pp->pos + 1] == '.' || r[pp->pos + 1] == '='))
+      {
+      pp->fail = TRUE;
+      break;
+      }
+    else if (c == '\\')
+      {
+      pp->pos++;
+      if (dfa_parse_class_escape (pp, &set))
+        {
+        // PCRE takes a - after \d as a literal; we don't bother
+        if (r[pp->pos] == '-' && r[pp->pos + 1] != ']') pp->fail = TRUE;
+        continue;
+        }
+      lo = dfa_parse_char_escape (pp, TRUE);
+      if (lo < 0)
+        {
+        pp->fail = TRUE;
+        break;
+        }
+      }
+    else
+      {
+      lo = (unsigned char)c;
+      pp->pos++;
+      }
+
+    int hi = lo;
+    if (r[pp->pos] == '-' && r[pp->pos + 1] && r[pp->pos + 1] != ']')
+      {
+      pp->pos++;
+      if (r[pp->pos] == '\\')
+        {
+        pp->pos++;
+        hi = dfa_parse_char_escape (pp, TRUE);
+        }
+      else if (r[pp->pos] == '[')
+        hi = -1;
+      else
+        hi = (unsigned char)r[pp->pos++];
+      if (hi < lo)
+        {
+        pp->fail = TRUE;
+        break;
+        }
+      }
+    dfa_set_add_range (&set, lo, hi);
+    }
+  if (pp->fail) return 0;
+  pp->pos++; // The ]
+
+  // The other case has to be added before the class is negated
+  int node = dfa_set_node (pp, &set);
+  if (negate)
+    {
+    DfaSet *s = &pp->sets[pp->nodes[node].a];
+    for (int i = 0; i < 8; i++) s->bits[i] = ~s->bits[i];
+    }
+  return node;
+  }
+
+/*==========================================================================
+  dfa_parse_quantifier
+
+  If there is a quantifier at the current position, skip over it, set
+    *min and *max (-1 for no limit), and return TRUE
+==========================================================================*/
+static BOOL dfa_parse_quantifier (DfaParser *pp, int *min, int *max)
+  {
+  const char *r = pp->regex;
+  switch (r[pp->pos])
+    {
+    case '?': *min = 0; *max = 1; pp->pos++; return TRUE;
+    case '*': *min = 0; *max = -1; pp->pos++; return TRUE;
+    case '+': *min = 1; *max = -1; pp->pos++; return TRUE;
+    case '{':
+      {
+      // {n}, {n,}, or {n,m} -- anything else is not a quantifier
+      int i = pp->pos + 1;
+      int n = 0, m = 0;
+      BOOL digits = FALSE, comma = FALSE, digits2 = FALSE;
+      while (r[i] >= '0' && r[i] <= '9')
+        {
+        if (n < 100000) n = n * 10 + r[i] - '0';
+        i++;
+        digits = TRUE;
+        }
+      if (digits && r[i] == ',')
+        {
+        comma = TRUE;
+        i++;
+        while (r[i] >= '0' && r[i] <= '9')
+          {
+          if (m < 100000) m = m * 10 + r[i] - '0';
+          i++;
+          digits2 = TRUE;
+          }
+        }
+      if (digits && r[i] == '}')
+        {
+        *min = n;
+        *max = !comma ? n : digits2 ? m : -1;
+        pp->pos = i + 1;
+        return TRUE;
+        }
+      }
+    }
+  return FALSE;
+  }
+
+/*==========================================================================
+  dfa_nullable
+
+  Returns TRUE if the node can match an empty string
+==========================================================================*/
+static BOOL dfa_nullable (const DfaNode *nodes, int n)
+  {
+  const DfaNode *node = &nodes[n];
+  switch (node->type)
+    {
+    case DFA_N_EMPTY: case DFA_N_ASSERT:
+      return TRUE;
+    case DFA_N_SET:
+      return FALSE;
+    case DFA_N_CAT:
+      return dfa_nullable (nodes, node->a) && dfa_nullable (nodes, node->b);
+    case DFA_N_ALT:
+      return dfa_nullable (nodes, node->a) || dfa_nullable (nodes, node->b);
+    case DFA_N_REPEAT:
+      return node->min == 0 || dfa_nullable (nodes, node->a);
+    }
+  return TRUE;
+  }
+
+static int dfa_parse_alternatives (DfaParser *pp);
+
+/*==========================================================================
+  dfa_parse_group
+
+  Parse a group, starting at the (
+==========================================================================*/
+static int dfa_parse_group (DfaParser *pp)
+  {
+  const char *r = pp->regex;
+  pp->pos++;
+  if (r[pp->pos] == '?')
+    {
+    // Only groups that capture, or don't, and branch resets are allowed;
+    //   we don't report what they capture, so they're all the same
+    char d = r[pp->pos + 1];
+    char e = d ? r[pp->pos + 2] : 0;
+    const char *end = NULL;
+    if (d == ':' || d == '|')
+      pp->pos += 2;
+    else if (d == '<' && e != '=' && e != '!')
+      end = strchr (r + pp->pos, '>');
+    else if (d == 'P' && e == '<')
+      end = strchr (r + pp->pos, '>');
+    else if (d == '\'')
+      end = strchr (r + pp->pos + 2, '\'');
+    else
+      pp->fail = TRUE;
+    if (end)
+      pp->pos = end - r + 1;
+    else if (d != ':' && d != '|')
+      pp->fail = TRUE;
+    }
+  else if (r[pp->pos] == '*')
+    pp->fail = TRUE; // Verbs like (*UTF8)
+  if (pp->fail) return 0;
+
+  int node = dfa_parse_alternatives (pp);
+  if (r[pp->pos] != ')')
+    pp->fail = TRUE;
+  else
+    pp->pos++;
+  return node;
+  }
+
+/*==========================================================================
+  dfa_parse_escape
+
+  Parse an escape outside a class, starting at the backslash
+==========================================================================*/
+static int dfa_parse_escape (DfaParser *pp)
+  {
+  pp->pos++;
+  char d = pp->regex[pp->pos];
+  int condition = 0;
+  switch (d)
+    {
+    case 'b': condition = DFA_WORDB; break;
+    case 'B': condition = DFA_NWORDB; break;
+    case 'A': condition = DFA_BOT; break;
+    case 'z': condition = DFA_EOT; break;
+    }
+  if (condition)
+    {
+    pp->pos++;
+    pp->asserts = TRUE;
+    return dfa_node (pp, DFA_N_ASSERT, condition, 0);
+    }
+
+  DfaSet set;
+  memset (&set, 0, sizeof (set));
+  if (d == 'N')
+    {
+    pp->pos++;
+    dfa_set_add_range (&set, 0, 255);
+    set.bits['\n' >> 5] &= ~(1u << ('\n' & 31));
+    return dfa_set_node (pp, &set);
+    }
+  if (dfa_parse_class_escape (pp, &set))
+    return dfa_set_node (pp, &set);
+  int c = dfa_parse_char_escape (pp, FALSE);
+  if (c < 0)
+    {
+    // Back-references, \Q...\E, \p{...}, \G, \K, \R, and so on
+    pp->fail = TRUE;
+    return 0;
+    }
+  dfa_set_add (&set, c);
+  return dfa_set_node (pp, &set);
+  }
+
+/*==========================================================================
+  dfa_parse_sequence
+
+  Parse a sequence of items, each maybe with a quantifier, up to a | or
+    a ) or the end of the expression
+==========================================================================*/
+static int dfa_parse_sequence (DfaParser *pp)
+  {
+  const char *r = pp->regex;
+  int seq = dfa_node (pp, DFA_N_EMPTY, 0, 0);
+  while (r[pp->pos] && r[pp->pos] != '|' && r[pp->pos] != ')' &&
+      !pp->fail)
+    {
+    char c = r[pp->pos];
+    int item;
+    BOOL condition = FALSE;
+    DfaSet set;
+    memset (&set, 0, sizeof (set));
+    switch (c)
+      {
+      case '(':
+        item = dfa_parse_group (pp);
+        break;
+      case '[':
+        item = dfa_parse_class (pp);
+        break;
+      case '.':
+        pp->pos++;
+        dfa_set_add_range (&set, 0, 255);
+        set.bits['\n' >> 5] &= ~(1u << ('\n' & 31));
+        item = dfa_set_node (pp, &set);
+        break;
+      case '^': case '$':
+        pp->pos++;
+        pp->asserts = TRUE;
+        item = dfa_node (pp, DFA_N_ASSERT, c == '^' ? DFA_BOL : DFA_EOL, 0);
+        break;
+      case '\\':
+        item = dfa_parse_escape (pp);
+        break;
+      case '*': case '+': case '?':
+        // Nothing to repeat -- PCRE should have rejected this
+        pp->fail = TRUE;
+        item = 0;
+        break;
+      default:
+        pp->pos++;
+        dfa_set_add (&set, (unsigned char)c);
+        item = dfa_set_node (pp, &set);
+      }
+    if (pp->fail) break;
+    condition = pp->nodes[item].type == DFA_N_ASSERT;
+
+    int min, max;
+    if (dfa_parse_quantifier (pp, &min, &max))
+      {
+      BOOL greedy = TRUE;
+      if (r[pp->pos] == '?')
+        {
+        greedy = FALSE;
+        pp->pos++;
+        }
+      else if (r[pp->pos] == '+')
+        pp->fail = TRUE; // Possessive
+      int min2, max2;
+      int pos = pp->pos;
+      if (condition || dfa_parse_quantifier (pp, &min2, &max2))
+        pp->fail = TRUE;
+      pp->pos = pos;
+      if (pp->fail) break;
+      // PCRE stops repeating a group when it matches an empty string,
+      //   which an automaton can't easily imitate
+      if (max != 1 && dfa_nullable (pp->nodes, item))
+        {
+        pp->fail = TRUE;
+        break;
+        }
+      item = dfa_node (pp, DFA_N_REPEAT, item, 0);
+      pp->nodes[item].min = min;
+      pp->nodes[item].max = max;
+      pp->nodes[item].greedy = greedy;
+      }
+    seq = dfa_node (pp, DFA_N_CAT, seq, item);
+    }
+  return seq;
+  }
+
+/*==========================================================================
+  dfa_parse_alternatives
+==========================================================================*/
+static int dfa_parse_alternatives (DfaParser *pp)
+  {
+  int node = dfa_parse_sequence (pp);
+  while (pp->regex[pp->pos] == '|' && !pp->fail)
+    {
+    pp->pos++;
+    int other = dfa_parse_sequence (pp);
+    node = dfa_node (pp, DFA_N_ALT, node, other);
+    }
+  return node;
+  }
+
+/*==========================================================================
+  dfa_emit
+==========================================================================*/
+static int dfa_emit (DfaProgram *prog, DfaOp op, int x, int y, int arg)
+  {
+  if (prog->num_insts >= DFA_MAX_PROGRAM) return -1;
+  if (prog->num_insts % 256 == 0)
+    prog->insts = realloc (prog->insts,
+      (prog->num_insts + 256) * sizeof (DfaInst));
+  DfaInst *inst = &prog->insts[prog->num_insts];
+  inst->op = op;
+  inst->x = x;
+  inst->y = y;
+  inst->arg = arg;
+  return prog->num_insts++;
+  }
+
+/*==========================================================================
+  dfa_compile_node
+
+  Compile a node so that, when it has matched, the program goes on to
+    next. Returns where the node's instructions start, or -1 if the
+    program is too big. Sequences are compiled backwards, for the
+    program that runs backwards
+==========================================================================*/
+static int dfa_compile_node (DfaProgram *prog, const DfaNode *nodes,
+    int n, int next)
+  {
+  if (next < 0) return -1;
+  const DfaNode *node = &nodes[n];
+  switch (node->type)
+    {
+    case DFA_N_EMPTY:
+      return next;
+    case DFA_N_SET:
+      return dfa_emit (prog, DFA_OP_BYTE, next, 0, node->a);
+    case DFA_N_ASSERT:
+      return dfa_emit (prog, DFA_OP_ASSERT, next, 0, node->a);
+    case DFA_N_CAT:
+      if (prog->reverse)
+        return dfa_compile_node (prog, nodes, node->b,
+          dfa_compile_node (prog, nodes, node->a, next));
+      return dfa_compile_node (prog, nodes, node->a,
+        dfa_compile_node (prog, nodes, node->b, next));
+    case DFA_N_ALT:
+      {
+      int a = dfa_compile_node (prog, nodes, node->a, next);
+      int b = dfa_compile_node (prog, nodes, node->b, next);
+      if (a < 0 || b < 0) return -1;
+      return dfa_emit (prog, DFA_OP_SPLIT, a, b, 0);
+      }
+    case DFA_N_REPEAT:
+      {
+      int entry = next;
+      if (node->max < 0)
+        {
+        // A loop, that goes round the item again, or on to next
+        int loop = dfa_emit (prog, DFA_OP_SPLIT, 0, 0, 0);
+        if (loop < 0) return -1;
+        int body = dfa_compile_node (prog, nodes, node->a, loop);
+        if (body < 0) return -1;
+        prog->insts[loop].x = node->greedy ? body : next;
+        prog->insts[loop].y = node->greedy ? next : body;
+        entry = loop;
+        }
+      else
+        {
+        // Optional copies of the item, each inside the one before
+        for (int i = node->min; i < node->max && entry >= 0; i++)
+          {
+          int body = dfa_compile_node (prog, nodes, node->a, entry);
+          if (body < 0) return -1;
+          entry = node->greedy ? dfa_emit (prog, DFA_OP_SPLIT, body, next, 0)
+            : dfa_emit (prog, DFA_OP_SPLIT, next, body, 0);
+          }
+        }
+      for (int i = 0; i < node->min && entry >= 0; i++)
+        entry = dfa_compile_node (prog, nodes, node->a, entry);
+      return entry;
+      }
+    }
+  return -1;
+  }
+
+/*==========================================================================
+  dfa_compile
+
+  Compile the parsed expression into a program. The program that runs
+    forwards starts with a loop that, at each byte, starts a new match,
+    in preference to going on to the next byte
+==========================================================================*/
+static BOOL dfa_compile (DfaProgram *prog, const DfaParser *pp, int root,
+    BOOL reverse)
+  {
+  prog->reverse = reverse;
+  prog->asserts = pp->asserts;
+  prog->id = __atomic_fetch_add (&dfa_next_id, 1, __ATOMIC_RELAXED);
+  int match = dfa_emit (prog, DFA_OP_MATCH, 0, 0, 0);
+  int entry = dfa_compile_node (prog, pp->nodes, root, match);
+  if (entry >= 0 && !reverse)
+    {
+    int loop = dfa_emit (prog, DFA_OP_SPLIT, entry, 0, 0);
+    int any = dfa_emit (prog, DFA_OP_BYTE, loop, 0, DFA_ALL);
+    if (any >= 0) prog->insts[loop].y = any;
+    entry = any >= 0 ? loop : -1;
+    }
+  prog->start = entry;
+  return entry >= 0;
+  }
+
+/*==========================================================================
+  dfa_refine
+
+  Split each class of bytes according to a key, between 0 and 3, for
+    each byte
+==========================================================================*/
+static void dfa_refine (Dfa *self, const BYTE *key)
+  {
+  int split[256][4];
+  memset (split, 0xFF, sizeof (split));
+  int n = 0;
+  for (int c = 0; c < 256; c++)
+    {
+    int *k = &split[self->classes[c]][key[c]];
+    if (*k < 0) *k = n++;
+    self->classes[c] = *k;
+    }
+  self->num_classes = n;
+  }
+
+/*==========================================================================
+  dfa_make_classes
+
+  Divide the bytes into classes, such that the bytes in a class are in
+    all the same sets, and have the same context
+==========================================================================*/
+static void dfa_make_classes (Dfa *self)
+  {
+  for (int c = 0; c < 256; c++)
+    self->contexts[c] = c == '\n' ? DFA_NL :
+      dfa_is_word (c) ? DFA_WORD : DFA_OTHER;
+
+  memset (self->classes, 0, sizeof (self->classes));
+  dfa_refine (self, self->contexts);
+  for (int i = 0; i < self->num_sets; i++)
+    {
+    BYTE key[256];
+    for (int c = 0; c < 256; c++)
+      key[c] = dfa_set_has (&self->sets[i], c);
+    dfa_refine (self, key);
+    }
+
+  memset (self->class_sizes, 0, sizeof (self->class_sizes));
+  for (int c = 255; c >= 0; c--)
+    {
+    self->reps[self->classes[c]] = c;
+    self->class_sizes[self->classes[c]]++;
+    }
+  }
+
+/*==========================================================================
+  dfa_create
+==========================================================================*/
+Dfa *dfa_create (const char *regex, BOOL caseless)
+  {
+  LOG_IN
+  DfaParser pp;
+  memset (&pp, 0, sizeof (pp));
+  pp.regex = regex;
+  pp.caseless = caseless;
+
+  DfaSet all;
+  memset (&all, 0xFF, sizeof (all));
+  pp.sets = malloc (sizeof (DfaSet));
+  pp.sets[DFA_ALL] = all;
+  pp.num_sets = 1;
+
+  int root = dfa_parse_alternatives (&pp);
+  if (regex[pp.pos] != 0) pp.fail = TRUE; // An unmatched )
+
+  Dfa *self = malloc (sizeof (Dfa));
+  memset (self, 0, sizeof (Dfa));
+  self->sets = pp.sets;
+  self->num_sets = pp.num_sets;
+  if (pp.fail)
+    log_debug ("Can't use DFA for '%s': not supported", regex);
+  else if (!dfa_compile (&self->forward, &pp, root, FALSE) ||
+      !dfa_compile (&self->backward, &pp, root, TRUE))
+    {
+    log_debug ("Can't use DFA for '%s': too big", regex);
+    pp.fail = TRUE;
+    }
+  free (pp.nodes);
+
+  if (pp.fail)
+    {
+    dfa_destroy (self);
+    self = NULL;
+    }
+  else
+    {
+    dfa_make_classes (self);
+    log_debug ("Using DFA for '%s': %d instructions, %d byte classes",
+      regex, self->forward.num_insts, self->num_classes);
+    }
+  LOG_OUT
+  return self;
+  }
+
+/*==========================================================================
+  dfa_cache_destroy
+==========================================================================*/
+static void dfa_cache_destroy (DfaCache *c)
+  {
+  if (c)
+    {
+    free (c->states);
+    free (c->trans);
+    free (c->accel);
+    free (c->pool);
+    free (c->table);
+    free (c->seen);
+    free (c->added);
+    free (c->stack);
+    free (c->closure);
+    free (c->next);
+    free (c);
+    }
+  }
+
+/*==========================================================================
+  dfa_thread_destroy
+
+  Called when a thread that has used a DFA exits
+==========================================================================*/
+static void dfa_thread_destroy (void *data)
+  {
+  DfaThread *thread = data;
+  for (int i = 0; i < thread->size; i++)
+    dfa_cache_destroy (thread->caches[i]);
+  free (thread->caches);
+  free (thread);
+  }
+
+/*==========================================================================
+  dfa_thread_init
+==========================================================================*/
+static void dfa_thread_init (void)
+  {
+  pthread_key_create (&dfa_thread_key, dfa_thread_destroy);
+  }
+
+/*==========================================================================
+  dfa_destroy
+
+  The caches that other threads have for this DFA are freed when the
+    threads exit; this thread's, now
+==========================================================================*/
+void dfa_destroy (Dfa *self)
+  {
+  LOG_IN
+  if (self)
+    {
+    pthread_once (&dfa_thread_once, dfa_thread_init);
+    DfaThread *thread = pthread_getspecific (dfa_thread_key);
+    const DfaProgram *progs[2] = { &self->forward, &self->backward };
+    for (int i = 0; i < 2; i++)
+      {
+      if (thread && progs[i]->insts && progs[i]->id < thread->size)
+        {
+        dfa_cache_destroy (thread->caches[progs[i]->id]);
+        thread->caches[progs[i]->id] = NULL;
+        }
+      free (progs[i]->insts);
+      }
+    free (self->sets);
+    free (self);
+    }
+  LOG_OUT
+  }
+
+/*==========================================================================
+  dfa_flush
+
+  Empty the cache
+==========================================================================*/
+static void dfa_flush (DfaCache *c)
+  {
+  c->num_states = 0;
+  c->pool_used = 0;
+  memset (c->table, 0, c->table_size * sizeof (int));
+  for (int i = 0; i < 4; i++) c->starts[i] = -1;
+  c->dead = -1;
+  c->flushes++;
+  }
+
+/*==========================================================================
+  dfa_cache_create
+==========================================================================*/
+static DfaCache *dfa_cache_create (const Dfa *dfa, const DfaProgram *prog)
+  {
+  DfaCache *c = malloc (sizeof (DfaCache));
+  memset (c, 0, sizeof (DfaCache));
+  c->stride = dfa->num_classes + 1;
+  // Half the memory for the states and their transitions, and half for
+  //   their lists of instructions
+  int row = c->stride * sizeof (int) + sizeof (DfaState) + sizeof (int);
+  c->max_states = (DFA_CACHE_SIZE / 2) / row;
+  c->pool_size = (DFA_CACHE_SIZE / 2) / sizeof (int);
+  if (c->pool_size < 4 * prog->num_insts) c->pool_size = 4 * prog->num_insts;
+  c->table_size = 1;
+  while (c->table_size < 2 * c->max_states) c->table_size *= 2;
+
+  c->states = malloc (c->max_states * sizeof (DfaState));
+  c->trans = malloc ((size_t)c->max_states * c->stride * sizeof (int));
+  c->accel = malloc (c->max_states * sizeof (int));
+  c->pool = malloc (c->pool_size * sizeof (int));
+  c->table = malloc (c->table_size * sizeof (int));
+  c->seen = calloc (prog->num_insts, sizeof (unsigned));
+  c->added = calloc (prog->num_insts, sizeof (unsigned));
+  c->stack = malloc ((3 * prog->num_insts + 1) * sizeof (int));
+  c->closure = malloc (prog->num_insts * sizeof (int));
+  c->next = malloc (prog->num_insts * sizeof (int));
+  dfa_flush (c);
+  c->flushes = 0;
+  return c;
+  }
+
+/*==========================================================================
+  dfa_get_cache
+
+  Returns this thread's cache for the program, creating it if need be
+==========================================================================*/
+static DfaCache *dfa_get_cache (const Dfa *dfa, const DfaProgram *prog)
+  {
+  pthread_once (&dfa_thread_once, dfa_thread_init);
+  DfaThread *thread = pthread_getspecific (dfa_thread_key);
+  if (!thread)
+    {
+    thread = malloc (sizeof (DfaThread));
+    memset (thread, 0, sizeof (DfaThread));
+    pthread_setspecific (dfa_thread_key, thread);
+    }
+  if (prog->id >= thread->size)
+    {
+    int size = prog->id + 16;
+    thread->caches = realloc (thread->caches, size * sizeof (DfaCache *));
+    memset (thread->caches + thread->size, 0, 
+      (size - thread->size) * sizeof (DfaCache *));
+    thread->size = size;
+    }
+  if (!thread->caches[prog->id])
+    thread->caches[prog->id] = dfa_cache_create (dfa, prog);
+  return thread->caches[prog->id];
+  }
+
+/*==========================================================================
+  dfa_intern
+
+  Returns the state with the list of instructions and the context,
+    adding it to the cache if it's not there. Returns -1 if the cache 
+    is full
+==========================================================================*/
+static int dfa_intern (DfaCache *c, const int *list, int n, int context)
+  {
+  if (n == 0) context = 0;
+  unsigned h = 2166136261u ^ (unsigned)context;
+  for (int i = 0; i < n; i++)
+    h = (h ^ (unsigned)list[i]) * 16777619u;
+  int slot = h & (c->table_size - 1);
+  while (c->table[slot])
+    {
+    int s = c->table[slot] - 1;
+    const DfaState *state = &c->states[s];
+    if (state->n == n && state->context == context &&
+        memcmp (c->pool + state->list, list, n * sizeof (int)) == 0)
+      return s;
+    slot = (slot + 1) & (c->table_size - 1);
+    }
+
+  if (c->num_states == c->max_states || c->pool_used + n > c->pool_size)
+    return -1;
+  int s = c->num_states++;
+  DfaState *state = &c->states[s];
+  state->list = c->pool_used;
+  state->n = n;
+  state->context = context;
+  state->credit = DFA_LOOP_CREDIT / 4;
+  memcpy (c->pool + c->pool_used, list, n * sizeof (int));
+  c->pool_used += n;
+  memset (c->trans + (size_t)s * c->stride, 0xFF, c->stride * sizeof (int));
+  c->accel[s] = DFA_ACCEL_UNKNOWN;
+  c->table[slot] = s + 1;
+  if (n == 0) c->dead = s;
+  return s;
+  }
+
+/*==========================================================================
+  dfa_holds
+
+  Returns TRUE if a condition holds at a position, given what comes 
+    before it and after it
+==========================================================================*/
+static BOOL dfa_holds (int condition, int before, int after)
+  {
+  switch (condition)
+    {
+    case DFA_BOL:
+      // PCRE's ^ doesn't match after a newline at the very end
+      return before == DFA_EDGE || (before == DFA_NL && after != DFA_EDGE);
+    case DFA_EOL:
+      return after == DFA_EDGE || after == DFA_NL;
+    case DFA_WORDB:
+      return (before == DFA_WORD) != (after == DFA_WORD);
+    case DFA_NWORDB:
+      return (before == DFA_WORD) == (after == DFA_WORD);
+    case DFA_BOT:
+      return before == DFA_EDGE;
+    case DFA_EOT:
+      return after == DFA_EDGE;
+    }
+  return FALSE;
+  }
+
+/*==========================================================================
+  dfa_compute
+
+  Work out the transition from state s on class k (or, if k is the 
+    number of classes, at the edge of the subject), store it in the
+    cache, and return it. If the cache fills up, it's emptied, and s 
+    is no longer valid
+==========================================================================*/
+static int dfa_compute (const Dfa *dfa, const DfaProgram *prog, 
+    DfaCache *c, int s, int k)
+  {
+  const DfaState *state = &c->states[s];
+  BOOL edge = k == dfa->num_classes;
+  int upcoming = edge ? DFA_EDGE : dfa->contexts[dfa->reps[k]];
+  int before = prog->reverse ? upcoming : state->context;
+  int after = prog->reverse ? state->context : upcoming;
+
+  // Follow the branches and conditions, in order of preference, to
+  //   find the instructions that match a byte, or the whole expression
+  if (++c->seen_gen == 0)
+    {
+    memset (c->seen, 0, prog->num_insts * sizeof (unsigned));
+    c->seen_gen = 1;
+    }
+  int sp = 0, m = 0;
+  const int *list = c->pool + state->list;
+  for (int i = state->n - 1; i >= 0; i--) c->stack[sp++] = list[i];
+  while (sp > 0)
+    {
+    int pc = c->stack[--sp];
+    if (c->seen[pc] == c->seen_gen) continue;
+    c->seen[pc] = c->seen_gen;
+    const DfaInst *inst = &prog->insts[pc];
+    if (inst->op == DFA_OP_SPLIT)
+      {
+      c->stack[sp++] = inst->y;
+      c->stack[sp++] = inst->x;
+      }
+    else if (inst->op == DFA_OP_ASSERT)
+      {
+      if (dfa_holds (inst->arg, before, after)) c->stack[sp++] = inst->x;
+      }
+    else
+      c->closure[m++] = pc;
+    }
+
+  // Take the byte. Going forwards, anything less preferred than a 
+  //   match is dropped
+  if (++c->added_gen == 0)
+    {
+    memset (c->added, 0, prog->num_insts * sizeof (unsigned));
+    c->added_gen = 1;
+    }
+  BOOL matched = FALSE;
+  int n = 0;
+  for (int i = 0; i < m; i++)
+    {
+    const DfaInst *inst = &prog->insts[c->closure[i]];
+    if (inst->op == DFA_OP_MATCH)
+      {
+      matched = TRUE;
+      if (!prog->reverse) break;
+      }
+    else if (!edge && dfa_set_has (&dfa->sets[inst->arg], dfa->reps[k]) &&
+        c->added[inst->x] != c->added_gen)
+      {
+      c->added[inst->x] = c->added_gen;
+      c->next[n++] = inst->x;
+      }
+    }
+
+  int t = dfa_intern (c, c->next, n, prog->asserts ? upcoming : 0);
+  BOOL flushed = t < 0;
+  if (flushed)
+    {
+    dfa_flush (c);
+    t = dfa_intern (c, c->next, n, prog->asserts ? upcoming : 0);
+    }
+  BOOL special = n == 0 || (!prog->reverse && c->accel[t] != DFA_ACCEL_NONE);
+  int entry = ((t * c->stride) << 2) | (matched ? DFA_MATCHED : 0) | 
+    (special ? DFA_SPECIAL : 0);
+  if (!flushed) c->trans[s * c->stride + k] = entry;
+  return entry;
+  }
+
+/*==========================================================================
+  dfa_start
+
+  Returns the start state, for a position with the specified context
+    before it (after it, going backwards)
+==========================================================================*/
+static int dfa_start (const DfaProgram *prog, DfaCache *c, int context)
+  {
+  if (!prog->asserts) context = 0;
+  if (c->starts[context] < 0)
+    {
+    int s = dfa_intern (c, &prog->start, 1, context);
+    if (s < 0)
+      {
+      dfa_flush (c);
+      s = dfa_intern (c, &prog->start, 1, context);
+      }
+    c->starts[context] = s;
+    }
+  return c->starts[context];
+  }
+
+/*==========================================================================
+  dfa_accelerate
+
+  Work out whether there is only one byte that takes the scan out of
+    state s, so the scan can skip to it with memchr(); or only a few, so
+    it can skip to one of them with DFA_ACCEL_LOOP. That takes a 
+    transition for every class, so it's only done if the cache has
+    room for them
+==========================================================================*/
+static void dfa_accelerate (const Dfa *dfa, const DfaProgram *prog, 
+    DfaCache *c, int s)
+  {
+  // Transitions back into s, that are worked out here, are left special
+  if (c->num_states + dfa->num_classes > c->max_states ||
+      c->pool_used + dfa->num_classes * prog->num_insts > c->pool_size)
+    {
+    c->accel[s] = DFA_ACCEL_NONE;
+    return;
+    }
+  int row = s * c->stride;
+  int bytes = 0, exit = -1;
+  for (int k = 0; k < dfa->num_classes && bytes <= DFA_LOOP_EXITS; k++)
+    {
+    int t = c->trans[row + k];
+    if (t < 0) t = dfa_compute (dfa, prog, c, s, k);
+    if ((t >> 2) != row || (t & DFA_MATCHED))
+      {
+      bytes += dfa->class_sizes[k];
+      exit = k;
+      }
+    }
+  c->accel[s] = DFA_ACCEL_NONE;
+  if (bytes == 1) 
+    c->accel[s] = dfa->reps[exit];
+  else if (bytes <= DFA_LOOP_EXITS) 
+    c->accel[s] = DFA_ACCEL_LOOP;
+  }
+
+/*==========================================================================
+  dfa_exec
+
+  Most of the time is spent in the two inner loops, which just follow 
+    transitions that are already in the cache, and don't need any 
+    attention
+==========================================================================*/
+int dfa_exec (const Dfa *self, const char *subject, int length, int start, 
+      int *ovector, int ovecsize)
+  {
+  if (start < 0 || start > length) return -1;
+  const BYTE *b = (const BYTE *)subject;
+  const BYTE *classes = self->classes;
+
+  // Forwards, to find where the match ends
+  const DfaProgram *prog = &self->forward;
+  DfaCache *c = dfa_get_cache (self, prog);
+  int s = dfa_start (prog, c, start > 0 ? self->contexts[b[start - 1]] 
+    : DFA_EDGE);
+  int flushes = c->flushes, flushed_at = -1;
+  int match_end = -1;
+  int p = start;
+  BOOL special = TRUE; // s might let us skip ahead
+  int *entry = NULL; // The transition that led to s, if it's cached
+  for (;;)
+    {
+    if (special)
+      {
+      if (c->accel[s] == DFA_ACCEL_UNKNOWN) 
+        dfa_accelerate (self, prog, c, s);
+      int a = c->accel[s];
+      if (a >= 0)
+        {
+        const BYTE *q = memchr (b + p, a, length - p);
+        p = q ? q - b : length;
+        }
+      else if (a == DFA_ACCEL_LOOP)
+        {
+        // Every transition back into a state like this is special
+        const int *row = c->trans + s * c->stride;
+        int stay = ((s * c->stride) << 2) | DFA_SPECIAL;
+        int from = p;
+        while (p < length && row[classes[b[p]]] == stay) p++;
+        DfaState *state = &c->states[s];
+        state->credit += p - from - DFA_LOOP_COST;
+        if (state->credit > DFA_LOOP_CREDIT) 
+          state->credit = DFA_LOOP_CREDIT;
+        else if (state->credit <= 0)
+          c->accel[s] = DFA_ACCEL_NONE;
+        }
+      else if (entry)
+        *entry &= ~DFA_SPECIAL; // No need to stop here next time
+      }
+
+    const int *trans = c->trans;
+    int row = s * c->stride;
+    int t = 0;
+    while (p < length && 
+        ((t = trans[row + classes[b[p]]]) & 
+          (DFA_MATCHED | DFA_SPECIAL)) == 0)
+      {
+      row = t >> 2;
+      p++;
+      }
+    s = row / c->stride;
+    if (p == length) break;
+
+    int k = classes[b[p]];
+    entry = &c->trans[row + k];
+    if (t < 0)
+      {
+      t = dfa_compute (self, prog, c, s, k);
+      if (c->flushes != flushes)
+        {
+        if (flushed_at >= 0 && 
+            p - flushed_at < DFA_MIN_BYTES_PER_STATE * c->max_states)
+          return DFA_GAVE_UP;
+        flushes = c->flushes;
+        flushed_at = p;
+        entry = NULL;
+        }
+      }
+    if (t & DFA_MATCHED) match_end = p;
+    s = (t >> 2) / c->stride;
+    p++;
+    if (s == c->dead) break;
+    special = (t & DFA_SPECIAL) != 0;
+    }
+  if (p == length && s != c->dead)
+    {
+    int t = c->trans[s * c->stride + self->num_classes];
+    if (t < 0) t = dfa_compute (self, prog, c, s, self->num_classes);
+    if (t & DFA_MATCHED) match_end = length;
+    }
+  if (match_end < 0) return -1;
+
+  // Backwards from there, to find where it starts
+  prog = &self->backward;
+  c = dfa_get_cache (self, prog);
+  s = dfa_start (prog, c, match_end < length ? 
+    self->contexts[b[match_end]] : DFA_EDGE);
+  flushes = c->flushes;
+  flushed_at = -1;
+  int match_start = -1;
+  p = match_end;
+  for (;;)
+    {
+    const int *trans = c->trans;
+    int row = s * c->stride;
+    int t = 0;
+    while (p > start && 
+        ((t = trans[row + classes[b[p - 1]]]) & 
+          (DFA_MATCHED | DFA_SPECIAL)) == 0)
+      {
+      row = t >> 2;
+      p--;
+      }
+    s = row / c->stride;
+    if (p == start) break;
+
+    int k = classes[b[p - 1]];
+    if (t < 0)
+      {
+      t = dfa_compute (self, prog, c, s, k);
+      if (c->flushes != flushes)
+        {
+        if (flushed_at >= 0 && 
+            flushed_at - p < DFA_MIN_BYTES_PER_STATE * c->max_states)
+          return DFA_GAVE_UP;
+        flushes = c->flushes;
+        flushed_at = p;
+        }
+      }
+    if (t & DFA_MATCHED) match_start = p;
+    s = (t >> 2) / c->stride;
+    p--;
+    if (s == c->dead) break;
+    }
+  if (p == start && s != c->dead)
+    {
+    // Whether the match can start here depends on the byte before, 
+    //   but that is not part of the subject to be searched
+    int k = start > 0 ? classes[b[start - 1]] : self->num_classes;
+    int t = c->trans[s * c->stride + k];
+    if (t < 0) t = dfa_compute (self, prog, c, s, k);
+    if (t & DFA_MATCHED) match_start = start;
+    }
+  // Can't happen, if the two programs agree
+  if (match_start < 0) return DFA_GAVE_UP;
+
+  if (ovecsize >= 2)
+    {
+    ovector[0] = match_start;
+    ovector[1] = match_end;
+    }
+  return 1;
+  }
+
@@ -0,0 +1,47 @@
+/*==========================================================================
+
+  kzgrep
+  dfa.h
+  Copyright (c)2020 Kevin Boone
+  Distributed under the terms of the GPL v3.0
+
+==========================================================================*/
+
+#pragma once
+
+#include "defs.h"
+
+// Returned by dfa_exec() if it can't complete a search in reasonable
+//   space, so the caller should use PCRE instead
+#define DFA_GAVE_UP (-2)
+
+struct _Dfa;
+typedef struct _Dfa Dfa;
+
+BEGIN_DECLS
+
+// Prepare to search for a regular expression, compiled as PCRE would
+//   compile it with PCRE_MULTILINE (and PCRE_CASELESS, if caseless is
+//   TRUE), but not in UTF-8 mode. Returns NULL if the expression uses
+//   anything this engine does not support -- back-references,
+//   lookaround, atomic groups and possessive quantifiers, option
+//   settings and verbs, and some rarer escapes -- or would make an
+//   automaton that is too big. The expression must already have been
+//   accepted by PCRE: an invalid one is not necessarily rejected
+Dfa     *dfa_create (const char *regex, BOOL caseless);
+
+void     dfa_destroy (Dfa *self);
+
+// Search subject, of the specified length, from offset start, for the
+//   same match that pcre_exec() would find: the leftmost, and of those
+//   the one that PCRE would try first. Returns -1 if there is no match;
+//   otherwise 1, and ovector[0] and ovector[1] are set to the offsets of
+//   the start and end of the match, if ovecsize is at least 2. Captured
+//   substrings are not reported. Returns DFA_GAVE_UP if the expression
+//   needs more states than a thread's cache can hold. Any number of
+//   threads may call this function on the same Dfa at the same time
+int      dfa_exec (const Dfa *self, const char *subject, int length,
+           int start, int *ovector, int ovecsize);
+
+END_DECLS
+
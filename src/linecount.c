@@ -0,0 +1,134 @@
+/*==========================================================================
+
+  kzgrep
+  linecount.c
+  Copyright (c)2020 Kevin Boone
+  Distributed under the terms of the GPL v3.0
+
+  Count the newlines in a buffer. Line numbers are worked out only when
+  a line is shown, by counting the newlines between it and the last line
+  shown, so with -n every byte of a text entry that has a match near its
+  end is counted here.
+
+  On x86, the data is compared with '\n' a block of 16 (SSE2) or 32
+  (AVX2) bytes at a time. Each comparison gives 0xFF for a newline and 0
+  otherwise, which is subtracted from a vector of byte-sized counters,
+  so each counter goes up by one for every newline in its lane. Before
+  a counter can overflow -- after 255 blocks -- the counters are summed
+  with a single 'sum of absolute differences' instruction, and cleared.
+  That is about three instructions a block, and no branches that depend
+  on the data. AVX2 is used if the CPU has it, which is checked at run
+  time, and elsewhere we use memchr().
+
+==========================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "defs.h"
+#include "linecount.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#include <immintrin.h>
+#define LINECOUNT_X86 1
+#endif
+
+#ifdef LINECOUNT_X86
+static BOOL linecount_avx2 = FALSE;
+static pthread_once_t linecount_once = PTHREAD_ONCE_INIT;
+#endif
+
+/*==========================================================================
+  linecount_simple
+==========================================================================*/
+static size_t linecount_simple (const BYTE *s, size_t n)
+  {
+  size_t lines = 0;
+  const BYTE *end = s + n;
+  while (s < end && (s = memchr (s, '\n', end - s)) != NULL)
+    {
+    lines++;
+    s++;
+    }
+  return lines;
+  }
+
+#ifdef LINECOUNT_X86
+/*==========================================================================
+  linecount_init
+==========================================================================*/
+static void linecount_init (void)
+  {
+  __builtin_cpu_init ();
+  linecount_avx2 = __builtin_cpu_supports ("avx2");
+  }
+
+/*==========================================================================
+  linecount_sse2
+==========================================================================*/
+static size_t linecount_sse2 (const BYTE *s, size_t n)
+  {
+  const __m128i nl = _mm_set1_epi8 ('\n');
+  const __m128i zero = _mm_setzero_si128 ();
+  size_t lines = 0;
+  size_t i = 0;
+  while (i + 16 <= n)
+    {
+    __m128i counts = zero;
+    for (int k = 0; k < 255 && i + 16 <= n; k++, i += 16)
+      {
+      __m128i v = _mm_loadu_si128 ((const __m128i *)(s + i));
+      counts = _mm_sub_epi8 (counts, _mm_cmpeq_epi8 (v, nl));
+      }
+    __m128i sums = _mm_sad_epu8 (counts, zero);
+    lines += (size_t)_mm_cvtsi128_si32 (sums) 
+      + (size_t)_mm_cvtsi128_si32 (_mm_srli_si128 (sums, 8));
+    }
+  return lines + linecount_simple (s + i, n - i);
+  }
+
+/*==========================================================================
+  linecount_avx2_count
+==========================================================================*/
+__attribute__((target("avx2")))
+static size_t linecount_avx2_count (const BYTE *s, size_t n)
+  {
+  const __m256i nl = _mm256_set1_epi8 ('\n');
+  const __m256i zero = _mm256_setzero_si256 ();
+  size_t lines = 0;
+  size_t i = 0;
+  while (i + 32 <= n)
+    {
+    __m256i counts = zero;
+    for (int k = 0; k < 255 && i + 32 <= n; k++, i += 32)
+      {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *)(s + i));
+      counts = _mm256_sub_epi8 (counts, _mm256_cmpeq_epi8 (v, nl));
+      }
+    __m256i sums256 = _mm256_sad_epu8 (counts, zero);
+    __m128i sums = _mm_add_epi64 (_mm256_castsi256_si128 (sums256),
+      _mm256_extracti128_si256 (sums256, 1));
+    lines += (size_t)_mm_cvtsi128_si32 (sums) 
+      + (size_t)_mm_cvtsi128_si32 (_mm_srli_si128 (sums, 8));
+    }
+  return lines + linecount_sse2 (s + i, n - i);
+  }
+#endif
+
+/*==========================================================================
+  linecount_count
+==========================================================================*/
+size_t linecount_count (const BYTE *s, size_t n)
+  {
+#ifdef LINECOUNT_X86
+  pthread_once (&linecount_once, linecount_init);
+  if (linecount_avx2) return linecount_avx2_count (s, n);
+  return linecount_sse2 (s, n);
+#else
+  return linecount_simple (s, n);
+#endif
+  }
+
@@ -0,0 +1,22 @@
+/*==========================================================================
+
+  kzgrep
+  linecount.h
+  Copyright (c)2020 Kevin Boone
+  Distributed under the terms of the GPL v3.0
+
+==========================================================================*/
+
+#pragma once
+
+#include <stddef.h>
+#include "defs.h"
+
+BEGIN_DECLS
+
+// Returns the number of newlines in n bytes. Any number of threads may
+//   call this function at the same time
+size_t linecount_count (const BYTE *s, size_t n);
+
+END_DECLS
+
@@ -369,7 +369,10 @@ void list_sort (List *self, ListSortFn fn, void *user_data)
   LOG_IN
   pthread_mutex_lock (&self->mutex);
 
-  int length = list_length (self);
+  // Don't call list_length() here -- we already hold the lock
+  int length = 0;
+  for (ListItem *l = self->head; l != NULL; l = l->next)
+    length++;
   
   void **temp = malloc (length * sizeof (void *));
   ListItem *l = self->head;
@@ -10,6 +10,12 @@
   define a function that will actually output the log messages to a
   specific place.
 
+  Logging functions may be called from any thread. Messages are 
+  serialized, so that the handler only deals with one message at a time,
+  and lines from different threads are never mixed up. A thread can
+  also have its messages written to a stream of its own, using 
+  log_set_thread_stream.
+
 ==========================================================================*/
 
 #define _GNU_SOURCE
@@ -19,11 +25,14 @@
 #include <string.h>
 #include <getopt.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include "defs.h" 
 #include "log.h" 
 
 int log_level = LOG_INFO;
 static LogHandler log_handler = NULL;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread FILE *log_thread_stream = NULL;
 
 /*==========================================================================
   log_set_level
@@ -42,10 +51,12 @@ static void log_v (int level, const char *fmt, va_list ap)
   if (level > log_level) return;
   char *s;
   vasprintf (&s, fmt, ap);
+  pthread_mutex_lock (&log_mutex);
   if (log_handler)
     log_handler (level, s);
   else
-    fprintf (stderr, "%s\n", s);
+    fprintf (log_thread_stream ? log_thread_stream : stderr, "%s\n", s);
+  pthread_mutex_unlock (&log_mutex);
   free (s);
   }
 
@@ -118,3 +129,21 @@ void log_set_handler (LogHandler handler)
 
 
 
+
+
+/*===========================================================================
+log_set_thread_stream
+============================================================================*/
+void log_set_thread_stream (FILE *f)
+  {
+  log_thread_stream = f;
+  }
+
+
+/*===========================================================================
+log_get_thread_stream
+============================================================================*/
+FILE *log_get_thread_stream (void)
+  {
+  return log_thread_stream;
+  }
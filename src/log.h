@@ -7,6 +7,8 @@ Distributed under the terms of the GPL v3.0
 
 #pragma once
 
+#include <stdio.h>
+
 #define LOG_ERROR 0
 #define LOG_WARNING 1
 #define LOG_INFO 2
@@ -44,6 +46,16 @@ void log_set_level (int level);
 /** Set the application-specific log handler */
 void log_set_handler (LogHandler logHandler);
 
+/** Set the stream that messages logged by the calling thread should be
+    written to, or NULL to use the default. This allows a thread whose
+    output is being collected in memory to collect its log messages 
+    along with it. It's up to the handler to call log_get_thread_stream
+    and honour the setting */
+void log_set_thread_stream (FILE *f);
+
+/** Get the stream set by log_set_thread_stream, if any */
+FILE *log_get_thread_stream (void);
+
 END_DECLS
 
 
@@ -35,7 +35,10 @@ void log_handler (int level, const char *message)
     case LOG_DEBUG: s_level = "DEBUG"; break;
     case LOG_TRACE: s_level = "TRACE"; break;
     }
-  printf (NAME " %s: %s\n", s_level , message);
+  // If this thread's output is being collected, its messages go with it
+  FILE *f = log_get_thread_stream ();
+  if (!f) f = stdout;
+  fprintf (f, NAME " %s: %s\n", s_level , message);
   }
 
 
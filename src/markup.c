@@ -0,0 +1,472 @@
+/*==========================================================================
+
+  kzgrep
+  markup.c
+  Copyright (c)2020 Kevin Boone
+  Distributed under the terms of the GPL v3.0
+
+  Extract the text from (X)HTML and XML documents -- the entries of EPUB
+  and ODF files, for example -- as it is decompressed, so that it can be
+  searched without the markup getting in the way. A phrase like
+  "the <em>very</em> end" is then found by searching for "the very end".
+
+  The document is fed through a simple state machine, a piece at a time,
+  so the pieces can be split anywhere, even in the middle of a tag or
+  an entity. This is not an XML parser, and doesn't need to be -- it
+  only has to know where tags, comments, entities, and CDATA sections
+  start and end. Quotes are followed inside tags, so a '>' in an
+  attribute value doesn't end the tag.
+
+  Newlines are always kept, even those inside tags and comments, so that
+  each line of text is the same line in the document, and line numbers
+  don't need any translation. Byte offsets do, so the places where the
+  text stops being an exact copy of the document are recorded as
+  'anchors', each giving the offset of a byte of text and the offset
+  in the document that it came from. The offset of any byte can be
+  worked out from the nearest anchor before it.
+
+==========================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "defs.h"
+#include "log.h"
+#include "markup.h"
+
+// Longest tag name that is recorded; any more of it is ignored
+#define MARKUP_MAX_NAME 31
+
+// Longest entity, not counting the '&' and ';', that will be decoded
+#define MARKUP_MAX_ENTITY 32
+
+typedef enum
+  {
+  MARKUP_TEXT = 0,
+  MARKUP_TAG,
+  MARKUP_COMMENT,
+  MARKUP_CDATA,
+  MARKUP_ENTITY
+  } MarkupState;
+
+typedef struct _MarkupAnchor
+  {
+  uint64_t text;
+  uint64_t source;
+  } MarkupAnchor;
+
+struct _Markup
+  {
+  MarkupState state;
+  uint64_t in_offset; // Of the next byte of the document
+  uint64_t out_offset; // Of the next byte of text
+  int64_t delta; // Source offset less text offset, at the last anchor
+  BYTE last; // The last byte of text written
+  // In a tag
+  char name[MARKUP_MAX_NAME + 1];
+  int name_length;
+  BOOL name_done;
+  char quote; // The quote that an attribute value started with, or 0
+  uint64_t tag_source; // Where the tag starts
+  BOOL tag_newline; // A newline has been written for this tag
+  // In a comment, the number of '-' just seen; in a CDATA section, the
+  //   number of ']' that are held back, in case they end the section
+  int tail;
+  uint64_t tail_source;
+  // In an entity
+  char entity[MARKUP_MAX_ENTITY + 1];
+  int entity_length;
+  uint64_t entity_source;
+  MarkupAnchor *anchors;
+  int num_anchors;
+  int max_anchors;
+  };
+
+// Tags that separate blocks of text, by their local names
+static const char *markup_blocks[] =
+  {
+  "address", "article", "aside", "blockquote", "body", "br", "caption",
+  "dd", "div", "dl", "dt", "figcaption", "figure", "footer", "h", "h1",
+  "h2", "h3", "h4", "h5", "h6", "head", "header", "hr", "li",
+  "line-break", "list-item", "nav", "ol", "p", "pre", "section", "tab",
+  "table", "table-cell", "td", "th", "title", "tr", "ul", NULL
+  };
+
+// Named entities that are decoded. XHTML only has the first five,
+//   unless the document declares more, but these others turn up often
+//   enough in EPUB files
+static const char *markup_entities[][2] =
+  {
+  {"amp", "&"}, {"lt", "<"}, {"gt", ">"}, {"quot", "\""}, {"apos", "'"},
+  {"nbsp", " "}, {"ndash", "\xe2\x80\x93"}, {"mdash", "\xe2\x80\x94"},
+  {"hellip", "\xe2\x80\xa6"}, {"lsquo", "\xe2\x80\x98"},
+  {"rsquo", "\xe2\x80\x99"}, {"ldquo", "\xe2\x80\x9c"},
+  {"rdquo", "\xe2\x80\x9d"}, {NULL, NULL}
+  };
+
+/*==========================================================================
+  markup_create
+==========================================================================*/
+Markup *markup_create (void)
+  {
+  LOG_IN
+  Markup *self = malloc (sizeof (Markup));
+  memset (self, 0, sizeof (Markup));
+  self->max_anchors = 64;
+  self->anchors = malloc (self->max_anchors * sizeof (MarkupAnchor));
+  LOG_OUT
+  return self;
+  }
+
+/*==========================================================================
+  markup_destroy
+==========================================================================*/
+void markup_destroy (Markup *self)
+  {
+  LOG_IN
+  if (self)
+    {
+    free (self->anchors);
+    free (self);
+    }
+  LOG_OUT
+  }
+
+/*==========================================================================
+  markup_emit
+
+  Write a byte of text, which came from offset source in the document,
+    adding an anchor if it is not where the last anchor says it should be
+==========================================================================*/
+static inline void markup_emit (Markup *self, BYTE *out, size_t *k,
+    BYTE c, uint64_t source)
+  {
+  int64_t delta = (int64_t)source - (int64_t)self->out_offset;
+  if (delta != self->delta || self->num_anchors == 0)
+    {
+    if (self->num_anchors == self->max_anchors)
+      {
+      self->max_anchors *= 2;
+      self->anchors = realloc (self->anchors,
+        self->max_anchors * sizeof (MarkupAnchor));
+      }
+    MarkupAnchor *anchor = &self->anchors[self->num_anchors++];
+    anchor->text = self->out_offset;
+    anchor->source = source;
+    self->delta = delta;
+    }
+  out[(*k)++] = c;
+  self->out_offset++;
+  self->last = c;
+  }
+
+/*==========================================================================
+  markup_is_space
+==========================================================================*/
+static inline BOOL markup_is_space (BYTE c)
+  {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+  }
+
+/*==========================================================================
+  markup_is_block
+
+  Returns TRUE if the tag just read separates blocks of text. Only the
+    local part of the name counts, so <text:p> in ODF is a paragraph,
+    just as <p> is in XHTML. ODF's <text:s>, which stands for spaces,
+    counts as well
+==========================================================================*/
+static BOOL markup_is_block (Markup *self)
+  {
+  self->name[self->name_length] = 0;
+  if (strcmp (self->name, "text:s") == 0) return TRUE;
+  const char *local = strrchr (self->name, ':');
+  local = local ? local + 1 : self->name;
+  for (int i = 0; markup_blocks[i]; i++)
+    if (strcasecmp (local, markup_blocks[i]) == 0) return TRUE;
+  return FALSE;
+  }
+
+/*==========================================================================
+  markup_decode_entity
+
+  Decode the entity that has just been read, into at most four bytes of
+    UTF-8. Returns the number of bytes, or -1 if the entity is not one
+    we know. A character reference to a newline becomes a space, so
+    that the lines of text stay the same as those of the document
+==========================================================================*/
+static int markup_decode_entity (Markup *self, BYTE *utf8)
+  {
+  const char *e = self->entity;
+  self->entity[self->entity_length] = 0;
+  if (e[0] != '#')
+    {
+    for (int i = 0; markup_entities[i][0]; i++)
+      {
+      if (strcmp (e, markup_entities[i][0]) == 0)
+        {
+        int n = strlen (markup_entities[i][1]);
+        memcpy (utf8, markup_entities[i][1], n);
+        return n;
+        }
+      }
+    return -1;
+    }
+
+  BOOL hex = e[1] == 'x' || e[1] == 'X';
+  const char *digits = e + (hex ? 2 : 1);
+  if (*digits == 0) return -1;
+  char *end;
+  unsigned long v = strtoul (digits, &end, hex ? 16 : 10);
+  if (*end || v == 0 || v > 0x10FFFF || (v >= 0xD800 && v <= 0xDFFF))
+    return -1;
+  if (v == '\n' || v == '\r') v = ' ';
+
+  if (v < 0x80)
+    {
+    utf8[0] = v;
+    return 1;
+    }
+  if (v < 0x800)
+    {
+    utf8[0] = 0xC0 | (v >> 6);
+    utf8[1] = 0x80 | (v & 0x3F);
+    return 2;
+    }
+  if (v < 0x10000)
+    {
+    utf8[0] = 0xE0 | (v >> 12);
+    utf8[1] = 0x80 | ((v >> 6) & 0x3F);
+    utf8[2] = 0x80 | (v & 0x3F);
+    return 3;
+    }
+  utf8[0] = 0xF0 | (v >> 18);
+  utf8[1] = 0x80 | ((v >> 12) & 0x3F);
+  utf8[2] = 0x80 | ((v >> 6) & 0x3F);
+  utf8[3] = 0x80 | (v & 0x3F);
+  return 4;
+  }
+
+/*==========================================================================
+  markup_flush_entity
+
+  Write an entity that could not be decoded just as it was
+==========================================================================*/
+static void markup_flush_entity (Markup *self, BYTE *out, size_t *k)
+  {
+  markup_emit (self, out, k, '&', self->entity_source);
+  for (int i = 0; i < self->entity_length; i++)
+    markup_emit (self, out, k, self->entity[i], self->entity_source + 1 + i);
+  self->state = MARKUP_TEXT;
+  }
+
+/*==========================================================================
+  markup_flush_tail
+
+  Write the ']' characters held back in a CDATA section, which turned
+    out not to end it
+==========================================================================*/
+static void markup_flush_tail (Markup *self, BYTE *out, size_t *k)
+  {
+  for (int i = 0; i < self->tail; i++)
+    markup_emit (self, out, k, ']', self->tail_source + i);
+  self->tail = 0;
+  }
+
+/*==========================================================================
+  markup_strip
+==========================================================================*/
+size_t markup_strip (Markup *self, const BYTE *in, size_t n, BYTE *out,
+         BOOL eof)
+  {
+  size_t k = 0;
+  for (size_t i = 0; i < n; i++)
+    {
+    BYTE c = in[i];
+    uint64_t source = self->in_offset + i;
+    switch (self->state)
+      {
+      case MARKUP_TEXT:
+        if (c == '<')
+          {
+          self->state = MARKUP_TAG;
+          self->name_length = 0;
+          self->name_done = FALSE;
+          self->quote = 0;
+          self->tag_source = source;
+          self->tag_newline = FALSE;
+          }
+        else if (c == '&')
+          {
+          self->state = MARKUP_ENTITY;
+          self->entity_length = 0;
+          self->entity_source = source;
+          }
+        else
+          markup_emit (self, out, &k, c, source);
+        break;
+
+      case MARKUP_ENTITY:
+        if (c == ';')
+          {
+          BYTE utf8[4];
+          int len = markup_decode_entity (self, utf8);
+          if (len < 0)
+            {
+            markup_flush_entity (self, out, &k);
+            markup_emit (self, out, &k, c, source);
+            }
+          else
+            {
+            for (int j = 0; j < len; j++)
+              markup_emit (self, out, &k, utf8[j], self->entity_source + j);
+            self->state = MARKUP_TEXT;
+            }
+          }
+        else if ((c == '#' || (c >= '0' && c <= '9') ||
+             (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) &&
+             self->entity_length < MARKUP_MAX_ENTITY)
+          self->entity[self->entity_length++] = c;
+        else
+          {
+          // Not an entity after all, so this byte is just text, or the
+          //   start of a tag or another entity
+          markup_flush_entity (self, out, &k);
+          i--;
+          }
+        break;
+
+      case MARKUP_TAG:
+        if (c == '\n')
+          {
+          markup_emit (self, out, &k, c, source);
+          self->tag_newline = TRUE;
+          }
+        if (self->quote)
+          {
+          if (c == self->quote) self->quote = 0;
+          }
+        else if (c == '>')
+          {
+          if (!self->tag_newline && self->out_offset > 0 &&
+              !markup_is_space (self->last) && markup_is_block (self))
+            markup_emit (self, out, &k, ' ', self->tag_source);
+          self->state = MARKUP_TEXT;
+          }
+        else if (c == '"' || c == '\'')
+          {
+          self->quote = c;
+          self->name_done = TRUE;
+          }
+        else if (!self->name_done)
+          {
+          if (c == '/' && self->name_length == 0)
+            ; // An end tag, which counts just like a start tag
+          else if (c == '/' || markup_is_space (c))
+            self->name_done = TRUE;
+          else if (self->name_length < MARKUP_MAX_NAME)
+            {
+            self->name[self->name_length++] = c;
+            if (self->name_length == 3 && memcmp (self->name, "!--", 3) == 0)
+              {
+              self->state = MARKUP_COMMENT;
+              self->tail = 0;
+              }
+            else if (self->name_length == 8 &&
+                memcmp (self->name, "![CDATA[", 8) == 0)
+              {
+              self->state = MARKUP_CDATA;
+              self->tail = 0;
+              }
+            }
+          }
+        break;
+
+      case MARKUP_COMMENT:
+        if (c == '\n')
+          markup_emit (self, out, &k, c, source);
+        if (c == '>' && self->tail >= 2)
+          self->state = MARKUP_TEXT;
+        else
+          self->tail = c == '-' ? self->tail + 1 : 0;
+        break;
+
+      case MARKUP_CDATA:
+        if (c == ']')
+          {
+          if (self->tail == 2)
+            {
+            markup_emit (self, out, &k, c, self->tail_source);
+            self->tail_source++;
+            }
+          else
+            {
+            if (self->tail == 0) self->tail_source = source;
+            self->tail++;
+            }
+          }
+        else if (c == '>' && self->tail == 2)
+          {
+          self->tail = 0;
+          self->state = MARKUP_TEXT;
+          }
+        else
+          {
+          markup_flush_tail (self, out, &k);
+          markup_emit (self, out, &k, c, source);
+          }
+        break;
+      }
+    }
+  self->in_offset += n;
+
+  if (eof)
+    {
+    if (self->state == MARKUP_ENTITY)
+      markup_flush_entity (self, out, &k);
+    else if (self->state == MARKUP_CDATA)
+      markup_flush_tail (self, out, &k);
+    }
+  return k;
+  }
+
+/*==========================================================================
+  markup_source_offset
+==========================================================================*/
+uint64_t markup_source_offset (const Markup *self, uint64_t offset)
+  {
+  // Find the last anchor at or before the offset
+  int lo = 0, hi = self->num_anchors;
+  while (lo < hi)
+    {
+    int mid = (lo + hi) / 2;
+    if (self->anchors[mid].text <= offset) lo = mid + 1; else hi = mid;
+    }
+  if (lo == 0) return offset;
+  const MarkupAnchor *anchor = &self->anchors[lo - 1];
+  return anchor->source + (offset - anchor->text);
+  }
+
+/*==========================================================================
+  markup_forget
+==========================================================================*/
+void markup_forget (Markup *self, uint64_t offset)
+  {
+  int lo = 0, hi = self->num_anchors;
+  while (lo < hi)
+    {
+    int mid = (lo + hi) / 2;
+    if (self->anchors[mid].text <= offset) lo = mid + 1; else hi = mid;
+    }
+  // Keep the anchor that covers the offset itself
+  int drop = lo - 1;
+  if (drop > 0)
+    {
+    memmove (self->anchors, self->anchors + drop,
+      (self->num_anchors - drop) * sizeof (MarkupAnchor));
+    self->num_anchors -= drop;
+    }
+  }
+
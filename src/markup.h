@@ -0,0 +1,55 @@
+/*==========================================================================
+
+  kzgrep
+  markup.h
+  Copyright (c)2020 Kevin Boone
+  Distributed under the terms of the GPL v3.0
+
+==========================================================================*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "defs.h"
+
+// The most that markup_strip() can write, beyond the size of its input:
+//   the part of an entity, or of the end of a CDATA section, that was
+//   held back from an earlier call
+#define MARKUP_MAX_PENDING 64
+
+struct _Markup;
+typedef struct _Markup Markup;
+
+BEGIN_DECLS
+
+// Create a stripper for a single document, which is then passed to
+//   markup_strip() in pieces, in order
+Markup  *markup_create (void);
+
+void     markup_destroy (Markup *self);
+
+// Take n more bytes of (X)HTML or XML, and write the text in them to out,
+//   which must have room for n + MARKUP_MAX_PENDING bytes. Tags and
+//   comments are removed, entities are decoded, and CDATA sections are
+//   copied as they are. Every newline in the input, even in a tag, is
+//   kept, so the text has the same lines as the document. Tags that
+//   separate blocks of text -- paragraphs, for example -- become a
+//   space, so the words on either side don't run together. If eof is
+//   TRUE, this is the end of the document, and anything held back is
+//   written. Returns the number of bytes written
+size_t   markup_strip (Markup *self, const BYTE *in, size_t n, BYTE *out,
+           BOOL eof);
+
+// Returns the offset in the document of the byte of text at offset
+//   offset, which must not be before the offset passed to
+//   markup_forget(). A byte that was decoded from an entity maps to
+//   a byte of the entity, and a space that stands for a tag, to the
+//   start of the tag
+uint64_t markup_source_offset (const Markup *self, uint64_t offset);
+
+// Discard what is needed to map offsets of text before offset
+void     markup_forget (Markup *self, uint64_t offset);
+
+END_DECLS
+
@@ -0,0 +1,384 @@
+/*==========================================================================
+
+  kzgrep
+  multistring.c
+  Copyright (c)2020 Kevin Boone
+  Distributed under the terms of the GPL v3.0
+
+  Search for any of a set of strings at once, with an Aho-Corasick
+  automaton. This is used when there are many patterns (from --file,
+  for example) that are plain strings -- searching for each in turn
+  would mean scanning the text once for every string.
+
+  The strings are stored in a trie, in which each node stands for the
+  prefix of some string that leads to it. Each node also has a 'fail'
+  link, to the node for the longest proper suffix of its own prefix
+  that is also in the trie. So, when the next byte of the subject does
+  not continue the current prefix, we just follow fail links until one
+  does, or we are back at the root. Each node's 'out' link leads to the
+  nearest node along the chain of fail links that ends a string, so we
+  can find every string that ends at a given place without walking the
+  whole chain. The subject is scanned once, however many strings there
+  are, and no byte of it is looked at more than once.
+
+  Transitions are stored as a sorted array for each node, which keeps
+  the automaton small for thousands of strings. But most of the time,
+  the search is at the root or a node near it, because most text soon
+  stops matching any string. So the nodes nearest the root -- as many
+  as MULTISTRING_DENSE_ROWS -- also get a full table, with an entry for
+  every byte, in which the fail links have already been followed. 
+  While we are at the root, bytes that can't start any string are 
+  skipped in a tight loop.
+
+  Case is ignored by folding ASCII letters to lower case, both in the
+  strings and in the subject, just as substring.c does.
+
+==========================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defs.h"
+#include "log.h"
+#include "multistring.h"
+
+// The number of nodes, nearest the root, that have a full table of 
+//   transitions. Each table takes 1kB
+#define MULTISTRING_DENSE_ROWS 1024
+
+typedef struct _MultiStringEdge
+  {
+  BYTE c;
+  int target;
+  int next; // While building, the next edge from the same node, or -1
+  } MultiStringEdge;
+
+typedef struct _MultiStringNode
+  {
+  int first_edge; // Index in the edges array; -1 if there are none
+  int num_edges;
+  int fail;
+  int out; // Nearest node along the fail links that ends a string; 0=none
+  int id; // The string that ends here, or -1
+  int depth; // Length of the prefix that leads here
+  int dense; // Row in the table of full transitions, or -1
+  } MultiStringNode;
+
+struct _MultiString
+  {
+  MultiStringNode *nodes; // The root is nodes[0]
+  int num_nodes;
+  int max_nodes;
+  MultiStringEdge *edges;
+  int num_edges;
+  int max_edges;
+  int *dense; // Full transitions for some nodes, 256 to a row
+  int root_next[256]; // Transitions from the root, for every byte
+  BYTE fold[256];
+  int empty_id; // The id of the empty string, if it was added; else -1
+  int max_length;
+  };
+
+/*==========================================================================
+  multistring_new_node
+==========================================================================*/
+static int multistring_new_node (MultiString *self, int depth)
+  {
+  if (self->num_nodes == self->max_nodes)
+    {
+    self->max_nodes *= 2;
+    self->nodes = realloc (self->nodes,
+      self->max_nodes * sizeof (MultiStringNode));
+    }
+  MultiStringNode *node = &self->nodes[self->num_nodes];
+  node->first_edge = -1;
+  node->num_edges = 0;
+  node->fail = 0;
+  node->out = 0;
+  node->id = -1;
+  node->depth = depth;
+  node->dense = -1;
+  return self->num_nodes++;
+  }
+
+/*==========================================================================
+  multistring_new_edge
+==========================================================================*/
+static int multistring_new_edge (MultiString *self, BYTE c, int target,
+    int next)
+  {
+  if (self->num_edges == self->max_edges)
+    {
+    self->max_edges *= 2;
+    self->edges = realloc (self->edges,
+      self->max_edges * sizeof (MultiStringEdge));
+    }
+  MultiStringEdge *edge = &self->edges[self->num_edges];
+  edge->c = c;
+  edge->target = target;
+  edge->next = next;
+  return self->num_edges++;
+  }
+
+/*==========================================================================
+  multistring_create
+==========================================================================*/
+MultiString *multistring_create (BOOL caseless)
+  {
+  LOG_IN
+  MultiString *self = malloc (sizeof (MultiString));
+  memset (self, 0, sizeof (MultiString));
+  self->max_nodes = 256;
+  self->nodes = malloc (self->max_nodes * sizeof (MultiStringNode));
+  self->max_edges = 256;
+  self->edges = malloc (self->max_edges * sizeof (MultiStringEdge));
+  self->empty_id = -1;
+  for (int c = 0; c < 256; c++)
+    {
+    BOOL upper = c >= 'A' && c <= 'Z';
+    self->fold[c] = (caseless && upper) ? c + ('a' - 'A') : c;
+    }
+  multistring_new_node (self, 0);
+  LOG_OUT
+  return self;
+  }
+
+/*==========================================================================
+  multistring_destroy
+==========================================================================*/
+void multistring_destroy (MultiString *self)
+  {
+  LOG_IN
+  if (self)
+    {
+    free (self->nodes);
+    free (self->edges);
+    free (self->dense);
+    free (self);
+    }
+  LOG_OUT
+  }
+
+/*==========================================================================
+  multistring_add
+==========================================================================*/
+void multistring_add (MultiString *self, const char *s, int n, int id)
+  {
+  if (n == 0)
+    {
+    if (self->empty_id < 0) self->empty_id = id;
+    return;
+    }
+
+  int node = 0;
+  for (int i = 0; i < n; i++)
+    {
+    BYTE c = self->fold[(BYTE)s[i]];
+    int e = self->nodes[node].first_edge;
+    while (e >= 0 && self->edges[e].c != c)
+      e = self->edges[e].next;
+    if (e < 0)
+      {
+      int child = multistring_new_node (self,
+        self->nodes[node].depth + 1);
+      e = multistring_new_edge (self, c, child,
+        self->nodes[node].first_edge);
+      self->nodes[node].first_edge = e;
+      self->nodes[node].num_edges++;
+      }
+    node = self->edges[e].target;
+    }
+  if (self->nodes[node].id < 0) self->nodes[node].id = id;
+  if (n > self->max_length) self->max_length = n;
+  }
+
+/*==========================================================================
+  multistring_compare_edges
+==========================================================================*/
+static int multistring_compare_edges (const void *e1, const void *e2)
+  {
+  return ((const MultiStringEdge *)e1)->c - ((const MultiStringEdge *)e2)->c;
+  }
+
+/*==========================================================================
+  multistring_child
+
+  Returns the node reached from node by byte c, or -1 if there is none.
+    Only works after the edges have been sorted
+==========================================================================*/
+static inline int multistring_child (const MultiString *self, int node,
+    BYTE c)
+  {
+  const MultiStringNode *n = &self->nodes[node];
+  const MultiStringEdge *e = self->edges + n->first_edge;
+  int lo = 0, hi = n->num_edges;
+  while (lo < hi)
+    {
+    int mid = (lo + hi) / 2;
+    if (e[mid].c < c) lo = mid + 1; else hi = mid;
+    }
+  if (lo < n->num_edges && e[lo].c == c) return e[lo].target;
+  return -1;
+  }
+
+/*==========================================================================
+  multistring_compile
+
+  Gather the edges of each node into a sorted array, then work out the
+    fail and out links, breadth first, because a node's fail link always
+    leads to a node nearer the root. For the same reason, the full tables
+    can be filled in from those of the nodes that the fail links lead to
+==========================================================================*/
+void multistring_compile (MultiString *self)
+  {
+  LOG_IN
+  MultiStringEdge *edges = malloc ((self->num_edges + 1) *
+    sizeof (MultiStringEdge));
+  int k = 0;
+  for (int i = 0; i < self->num_nodes; i++)
+    {
+    MultiStringNode *node = &self->nodes[i];
+    int first = k;
+    for (int e = node->first_edge; e >= 0; e = self->edges[e].next)
+      edges[k++] = self->edges[e];
+    qsort (edges + first, k - first, sizeof (MultiStringEdge),
+      multistring_compare_edges);
+    node->first_edge = first;
+    }
+  free (self->edges);
+  self->edges = edges;
+
+  int *queue = malloc (self->num_nodes * sizeof (int));
+  int head = 0, tail = 0;
+  queue[tail++] = 0;
+  while (head < tail)
+    {
+    int u = queue[head++];
+    const MultiStringNode *node = &self->nodes[u];
+    for (int i = 0; i < node->num_edges; i++)
+      {
+      const MultiStringEdge *edge = &self->edges[node->first_edge + i];
+      int v = edge->target;
+      int fail = 0;
+      if (u != 0)
+        {
+        int f = node->fail;
+        int t;
+        while ((t = multistring_child (self, f, edge->c)) < 0 && f != 0)
+          f = self->nodes[f].fail;
+        if (t >= 0) fail = t;
+        }
+      self->nodes[v].fail = fail;
+      self->nodes[v].out = self->nodes[fail].id >= 0 ?
+        fail : self->nodes[fail].out;
+      queue[tail++] = v;
+      }
+    }
+
+  int rows = self->num_nodes < MULTISTRING_DENSE_ROWS ? 
+    self->num_nodes : MULTISTRING_DENSE_ROWS;
+  self->dense = malloc (rows * 256 * sizeof (int));
+  for (int i = 0; i < rows; i++)
+    {
+    int u = queue[i];
+    int *row = self->dense + i * 256;
+    const int *fail_row = self->dense + 
+      self->nodes[self->nodes[u].fail].dense * 256;
+    for (int c = 0; c < 256; c++)
+      {
+      int t = multistring_child (self, u, c);
+      if (t < 0) t = u == 0 ? 0 : fail_row[c];
+      row[c] = t;
+      }
+    self->nodes[u].dense = i;
+    }
+  free (queue);
+
+  // Index the root's table by the byte as it is in the subject, folded
+  //   or not, so the search can skip bytes without folding them
+  for (int c = 0; c < 256; c++)
+    self->root_next[c] = self->dense[self->fold[c]];
+
+  log_debug ("String automaton has %d nodes, longest string %d",
+    self->num_nodes, self->max_length);
+  LOG_OUT
+  }
+
+/*==========================================================================
+  multistring_next
+
+  The node reached from state by (folded) byte c
+==========================================================================*/
+static inline int multistring_next (const MultiString *self, int state,
+    BYTE c)
+  {
+  for (;;)
+    {
+    const MultiStringNode *node = &self->nodes[state];
+    if (node->dense >= 0) return self->dense[node->dense * 256 + c];
+    int t = multistring_child (self, state, c);
+    if (t >= 0) return t;
+    state = node->fail;
+    }
+  }
+
+/*==========================================================================
+  multistring_find
+
+  Once something has been found, we carry on until we're past the point
+    where any string that started at or before it would have ended, in
+    case there is one that starts further to the left, or is longer
+==========================================================================*/
+BOOL multistring_find (const MultiString *self, const char *subject,
+       int length, int start, MultiStringAcceptFn accept,
+       int *match_start, int *match_end, int *id)
+  {
+  int best_start = -1, best_end = 0, best_id = -1;
+
+  if (self->empty_id >= 0)
+    {
+    for (int p = start; p <= length && best_start < 0; p++)
+      {
+      if (!accept || accept (subject, length, p, p))
+        {
+        best_start = best_end = p;
+        best_id = self->empty_id;
+        }
+      }
+    }
+
+  const BYTE *s = (const BYTE *)subject;
+  int state = 0;
+  for (int i = start; i < length; i++)
+    {
+    if (state == 0)
+      {
+      while (i < length && !self->root_next[s[i]]) i++;
+      if (i == length) break;
+      }
+    if (best_start >= 0 && i >= best_start + self->max_length) break;
+
+    state = multistring_next (self, state, self->fold[s[i]]);
+    int o = self->nodes[state].id >= 0 ? state : self->nodes[state].out;
+    // Along the out links, the strings get shorter, so start later
+    for (; o; o = self->nodes[o].out)
+      {
+      int ms = i + 1 - self->nodes[o].depth;
+      if (best_start >= 0 && ms > best_start) break;
+      if (best_start >= 0 && ms == best_start && i + 1 <= best_end)
+        continue;
+      if (accept && !accept (subject, length, ms, i + 1)) continue;
+      best_start = ms;
+      best_end = i + 1;
+      best_id = self->nodes[o].id;
+      }
+    }
+
+  if (best_start < 0) return FALSE;
+  *match_start = best_start;
+  *match_end = best_end;
+  *id = best_id;
+  return TRUE;
+  }
+
@@ -0,0 +1,52 @@
+/*==========================================================================
+
+  kzgrep
+  multistring.h
+  Copyright (c)2020 Kevin Boone
+  Distributed under the terms of the GPL v3.0
+
+==========================================================================*/
+
+#pragma once
+
+#include "defs.h"
+
+struct _MultiString;
+typedef struct _MultiString MultiString;
+
+// Decides whether a string that has been found, from start up to (but
+//   not including) end, is to count as a match
+typedef BOOL (*MultiStringAcceptFn) (const char *subject, int length,
+          int start, int end);
+
+BEGIN_DECLS
+
+// Create an empty set of strings. If caseless is TRUE, the case of
+//   ASCII letters is ignored, both in the strings and in the subject
+MultiString *multistring_create (BOOL caseless);
+
+void         multistring_destroy (MultiString *self);
+
+// Add a string, of length n, to the set. id is what multistring_find()
+//   reports when the string is found. If the same string is added more
+//   than once, the first id is reported. Strings can't be added after
+//   multistring_compile() has been called
+void         multistring_add (MultiString *self, const char *s, int n,
+               int id);
+
+// Build the automaton. Must be called after all the strings have been
+//   added, and before searching
+void         multistring_compile (MultiString *self);
+
+// Find the leftmost occurrence of any string in the subject, at or after
+//   start, preferring the longest where several start at the same place.
+//   If accept is not NULL, only occurrences that it accepts are
+//   considered. Returns FALSE if there is none; otherwise sets *match_start,
+//   *match_end, and *id. Any number of threads may call this function on
+//   the same MultiString at the same time
+BOOL         multistring_find (const MultiString *self, const char *subject,
+               int length, int start, MultiStringAcceptFn accept,
+               int *match_start, int *match_end, int *id);
+
+END_DECLS
+
@@ -0,0 +1,1025 @@
+/*==========================================================================
+
+  kzgrep
+  pattern.c
+  Copyright (c)2020 Kevin Boone
+  Distributed under the terms of the GPL v3.0
+
+  The regular expression that we are searching for. This is a thin 
+  layer over PCRE, which exists mostly to keep the details of studying
+  and JIT-compiling the expression in one place. 
+
+  When the expression is compiled, we also look for a literal string
+  that any match must contain -- "Main-Class" in "^Main-Class: *(.*)", 
+  for example. Then pattern_prefilter() can skip, with memmem(), over 
+  text that can't possibly match, and the regex engine need only look
+  at the lines that contain the literal. The analysis is deliberately
+  simple-minded: it only has to understand the commonest constructs, 
+  and gives up -- so there is no prefilter -- if it finds anything it
+  does not understand. It must never find a literal that is not really
+  required, because that would lose matches.
+
+  With PT_FIXED, the pattern is a plain string, and PCRE isn't used at
+  all. The string is found by the vector search in substring.c, and 
+  with PT_WORD we just check the characters either side of it, in the
+  same way that \b does.
+
+  A set of patterns (from --file, or several --regexp options) is 
+  searched for all at once, and pattern_exec() reports the leftmost 
+  match of any of them, and which one it was. The patterns that are
+  plain strings -- all of them, with PT_FIXED -- go into an Aho-Corasick
+  automaton (multistring.c), which finds any of them in one pass over 
+  the text. The rest are combined into one big alternation, so PCRE 
+  too makes a single pass. Each alternative is tagged with (*MARK), 
+  which tells us which expression matched, and is wrapped in a group 
+  that resets the capture numbers, so each expression's back-references
+  still refer to its own captures. PCRE limits the size of an 
+  expression, so a long list is split into several groups; and if a 
+  group won't compile, it's split again until the expression that 
+  caused the problem is found. 
+
+  A single regular expression that doesn't need backtracking -- no
+  back-references or lookaround, for example -- is searched for by the
+  lazily-built DFA in dfa.c, which does a fixed amount of work for each
+  byte of text, however the expression is written. PCRE still compiles
+  it, so that errors are reported in the usual way, and is used instead
+  if the DFA gives up. Sets of expressions are always left to PCRE.
+
+  The expression is studied when it is compiled and, if PCRE supports
+  it, JIT-compiled to machine code, which is many times faster than 
+  PCRE's interpreter. If not, we fall back to the interpreter, with
+  whatever benefit the study data gives it.
+
+  JIT-compiled code needs a stack of its own, and a stack can only be
+  used by one thread at a time. So each thread that searches is given
+  its own, when it first needs it, and the stack is freed when the 
+  thread exits. The default stack that PCRE uses, when none is assigned,
+  is too small for some expressions that work fine in the interpreter.
+
+  Some expressions take PCRE time out of all proportion to the text, 
+  by backtracking -- (a+)+b on a long line of a's, for example. PCRE
+  counts the work it does, and gives up when the count reaches a limit;
+  pattern_set_limits() sets the limits, which are stored in the study
+  data, and pattern_exec() reports that it gave up, rather than 
+  reporting no match, so the caller can say so.
+
+  The caller runs the expression over a whole buffer of lines, not a 
+  line at a time, which is only the same thing so long as the expression
+  can't tell the difference. With PCRE_MULTILINE, ^ and $ can't; but 
+  \A, \z, \Z and \G refer to the ends of the subject, and lookaround 
+  can see past the end of the line. pattern_needs_lines() says when an
+  expression has any of these, and then each line must be a subject of
+  its own. Again, the check is simple-minded, but errs on the safe side.
+
+==========================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <pcre.h>
+#include "defs.h" 
+#include "log.h" 
+#include "pattern.h" 
+#include "substring.h" 
+#include "multistring.h" 
+#include "dfa.h" 
+
+// A required literal shorter than this is not worth prefiltering for; 
+//   PCRE already looks for the first character of a match efficiently 
+#define PATTERN_MIN_LITERAL 2
+
+// Regular expressions in a set are combined into groups of about
+//   this size, which PCRE can comfortably compile as one expression
+#define PATTERN_GROUP_SIZE (8 * 1024)
+
+// Initial and maximum size of each thread's JIT stack
+#define PATTERN_JIT_STACK_START (32 * 1024)
+#define PATTERN_JIT_STACK_MAX (1024 * 1024)
+
+// Some of the regular expressions in a set, combined into one 
+typedef struct _PatternGroup
+  {
+  pcre *re;
+  pcre_extra *extra;
+  int index; // The expression, if there is only one; else -1
+  } PatternGroup;
+
+struct _Pattern
+  {
+  char *fixed; // The string to find, with PT_FIXED; NULL for a regex
+  int fixed_length;
+  BOOL word; // For strings that are not found by PCRE, whole words only
+  pcre *re;
+  pcre_extra *extra; // Study data, and the JIT code if there is any 
+  Dfa *dfa; // Used in preference to PCRE, if not NULL
+  char *literal; // Required in any match; NULL if none was found
+  BOOL lines; // Must be run on one line at a time
+  int literal_length;
+  BOOL caseless;
+  int count; // Number of patterns
+  char **texts; // The patterns, as given
+  BOOL set; // Created by pattern_create_set(), with more than one pattern
+  MultiString *strings; // The plain strings in a set, or NULL
+  PatternGroup *groups; // The regular expressions in a set
+  int num_groups;
+  };
+
+// State of the search for a required literal in an expression 
+typedef struct _PatternParser
+  {
+  const char *regex;
+  int pos;
+  BOOL fail; // Found something we don't understand
+  } PatternParser;
+
+// A literal string, being built up by the parser
+typedef struct _PatternLiteral
+  {
+  char *s;
+  int length;
+  } PatternLiteral;
+
+static pthread_key_t pattern_stack_key;
+static pthread_once_t pattern_stack_once = PTHREAD_ONCE_INIT;
+
+/*==========================================================================
+  pattern_stack_destroy
+
+  Called when a thread that has used a JIT stack exits
+==========================================================================*/
+static void pattern_stack_destroy (void *data)
+  {
+  pcre_jit_stack_free (data);
+  }
+
+/*==========================================================================
+  pattern_stack_init
+==========================================================================*/
+static void pattern_stack_init (void)
+  {
+  pthread_key_create (&pattern_stack_key, pattern_stack_destroy);
+  }
+
+/*==========================================================================
+  pattern_get_stack
+
+  Called by PCRE, when it runs JIT code, to get the stack for the 
+    thread that is running it
+==========================================================================*/
+static pcre_jit_stack *pattern_get_stack (void *data)
+  {
+  pthread_once (&pattern_stack_once, pattern_stack_init);
+  pcre_jit_stack *stack = pthread_getspecific (pattern_stack_key);
+  if (!stack)
+    {
+    stack = pcre_jit_stack_alloc (PATTERN_JIT_STACK_START, 
+      PATTERN_JIT_STACK_MAX);
+    // If this fails, PCRE uses a small stack on the machine stack
+    if (stack) pthread_setspecific (pattern_stack_key, stack);
+    }
+  return stack;
+  }
+
+/*==========================================================================
+  pattern_keep_longer
+
+  Copy the candidate literal to best, if it is longer
+==========================================================================*/
+static void pattern_keep_longer (PatternLiteral *best, 
+    const PatternLiteral *candidate)
+  {
+  if (candidate->length > best->length)
+    {
+    memcpy (best->s, candidate->s, candidate->length);
+    best->length = candidate->length;
+    }
+  }
+
+/*==========================================================================
+  pattern_parse_quantifier
+
+  If there is a quantifier at the current position, skip over it, and
+    return the minimum number of repeats. Otherwise return -1
+==========================================================================*/
+static int pattern_parse_quantifier (PatternParser *pp)
+  {
+  const char *r = pp->regex;
+  int min = -1;
+  switch (r[pp->pos])
+    {
+    case '?': case '*': min = 0; pp->pos++; break;
+    case '+': min = 1; pp->pos++; break;
+    case '{':
+      {
+      // {n}, {n,}, or {n,m} -- anything else is not a quantifier
+      int i = pp->pos + 1;
+      int n = 0;
+      BOOL digits = FALSE;
+      while (r[i] >= '0' && r[i] <= '9') 
+        { 
+        if (n < 100000) n = n * 10 + r[i] - '0'; 
+        i++; 
+        digits = TRUE; 
+        }
+      if (digits && r[i] == ',') 
+        {
+        i++;
+        while (r[i] >= '0' && r[i] <= '9') i++;
+        }
+      if (digits && r[i] == '}')
+        {
+        min = n;
+        pp->pos = i + 1;
+        }
+      }
+    }
+  // Lazy or possessive
+  if (min >= 0 && (r[pp->pos] == '?' || r[pp->pos] == '+')) pp->pos++;
+  return min;
+  }
+
+/*==========================================================================
+  pattern_skip_class
+
+  Skip over a character class, starting at the [
+==========================================================================*/
+static void pattern_skip_class (PatternParser *pp)
+  {
+  const char *r = pp->regex;
+  int i = pp->pos + 1;
+  if (r[i] == '^') i++;
+  if (r[i] == ']') i++; // A ] at the start is literal
+  while (r[i] && r[i] != ']')
+    {
+    if (r[i] == '\\' && r[i + 1])
+      i += 2;
+    else if (r[i] == '[' && r[i + 1] == ':')
+      {
+      const char *end = strstr (r + i + 2, ":]");
+      if (!end) break;
+      i = end - r + 2;
+      }
+    else
+      i++;
+    }
+  if (r[i] == ']') 
+    pp->pos = i + 1;
+  else
+    pp->fail = TRUE;
+  }
+
+/*==========================================================================
+  pattern_skip_name
+
+  Skip over a group name, up to and including the terminator
+==========================================================================*/
+static void pattern_skip_name (PatternParser *pp, char terminator)
+  {
+  const char *end = strchr (pp->regex + pp->pos, terminator);
+  if (end) 
+    pp->pos = end - pp->regex + 1;
+  else
+    pp->fail = TRUE;
+  }
+
+/*==========================================================================
+  pattern_parse_sequence
+
+  Find the longest literal that any match of the sequence of alternatives
+    at the current position must contain, and store it in best. Parsing 
+    stops at the ) that ends the enclosing group, or the end of the
+    expression. A sequence with alternatives has no required literal -- 
+    we could do better, but it's not worth the complexity.
+
+  A run of literal characters is broken by anything that isn't one, 
+    including a group. This is often less than ideal, but at least it's
+    always correct.
+==========================================================================*/
+static void pattern_parse_sequence (PatternParser *pp, PatternLiteral *best)
+  {
+  const char *r = pp->regex;
+  int size = strlen (r) + 1;
+  PatternLiteral run = { malloc (size), 0 };
+  PatternLiteral inner = { malloc (size), 0 };
+  BOOL alternatives = FALSE;
+  best->length = 0;
+
+  while (r[pp->pos] && r[pp->pos] != ')' && !pp->fail)
+    {
+    char c = r[pp->pos];
+    BOOL literal = FALSE;
+    if (c == '|')
+      {
+      alternatives = TRUE;
+      pp->pos++;
+      pattern_keep_longer (best, &run);
+      run.length = 0;
+      continue;
+      }
+    else if (c == '(')
+      {
+      pattern_keep_longer (best, &run);
+      run.length = 0;
+      BOOL lookaround = FALSE;
+      pp->pos++;
+      if (r[pp->pos] == '?')
+        {
+        char d = r[pp->pos + 1];
+        char e = d ? r[pp->pos + 2] : 0;
+        if (d == ':' || d == '>')
+          pp->pos += 2;
+        else if (d == '=' || d == '!')
+          {
+          lookaround = TRUE;
+          pp->pos += 2;
+          }
+        else if (d == '<' && (e == '=' || e == '!'))
+          {
+          lookaround = TRUE;
+          pp->pos += 3;
+          }
+        else if (d == '<')
+          pattern_skip_name (pp, '>');
+        else if (d == 'P' && e == '<')
+          pattern_skip_name (pp, '>');
+        else if (d == '\'')
+          {
+          pp->pos += 2;
+          pattern_skip_name (pp, '\'');
+          }
+        else
+          pp->fail = TRUE; // Options, conditions, recursion, comments...
+        }
+      else if (r[pp->pos] == '*')
+        pp->fail = TRUE; // Verbs like (*UTF8)
+      if (pp->fail) break;
+      pattern_parse_sequence (pp, &inner);
+      if (r[pp->pos] != ')') 
+        {
+        pp->fail = TRUE;
+        break;
+        }
+      pp->pos++;
+      if (pattern_parse_quantifier (pp) != 0 && !lookaround)
+        pattern_keep_longer (best, &inner);
+      continue;
+      }
+    else if (c == '[')
+      pattern_skip_class (pp);
+    else if (c == '\\')
+      {
+      char d = r[pp->pos + 1];
+      if (d == 0)
+        pp->fail = TRUE;
+      else if (d == '\n' || strchr ("dDwWsSbBAzZGhHvVRXKntrfeaC", d))
+        pp->pos += 2; // Not a literal, but we know how long it is
+      else if (isalnum ((unsigned char)d))
+        pp->fail = TRUE; // Back-references, \x41, \p{L}, \Q..\E, etc
+      else
+        {
+        run.s[run.length] = d;
+        literal = TRUE;
+        pp->pos += 2;
+        }
+      }
+    else if (strchr (".^${\n", c))
+      pp->pos++;
+    else
+      {
+      run.s[run.length] = c;
+      literal = TRUE;
+      pp->pos++;
+      }
+
+    if (pp->fail) break;
+
+    int min = pattern_parse_quantifier (pp);
+    if (literal)
+      {
+      if (min != 0) run.length++;
+      if (min >= 0) 
+        {
+        // A repeated character is required, but what follows need not
+        //   come straight after it
+        pattern_keep_longer (best, &run);
+        run.length = 0;
+        }
+      }
+    else
+      {
+      pattern_keep_longer (best, &run);
+      run.length = 0;
+      }
+    }
+
+  pattern_keep_longer (best, &run);
+  if (alternatives || pp->fail) best->length = 0;
+  free (run.s);
+  free (inner.s);
+  }
+
+/*==========================================================================
+  pattern_find_literal
+
+  Look for a literal that every match of the expression must contain, and
+    store it in the Pattern if there is one
+==========================================================================*/
+static void pattern_find_literal (Pattern *self, const char *regex)
+  {
+  PatternParser pp = { regex, 0, FALSE };
+  PatternLiteral best = { malloc (strlen (regex) + 1), 0 };
+  pattern_parse_sequence (&pp, &best);
+  if (!pp.fail && regex[pp.pos] == 0 && 
+        best.length >= PATTERN_MIN_LITERAL)
+    {
+    self->literal = best.s;
+    self->literal_length = best.length;
+    log_debug ("Prefiltering for literal '%.*s'", best.length, best.s);
+    }
+  else
+    free (best.s);
+  }
+
+/*==========================================================================
+  pattern_is_line_bound
+
+  Returns TRUE if the expression has anything that might match 
+    differently when a line is searched as part of a larger subject:
+    the assertions about the ends of the subject, and lookaround. Text
+    that only looks like one of these -- in \Q..\E, for example -- is
+    taken to be one, which costs some speed, but no matches
+==========================================================================*/
+static BOOL pattern_is_line_bound (const char *regex)
+  {
+  for (int i = 0; regex[i]; i++)
+    {
+    if (regex[i] == '\\' && regex[i + 1])
+      {
+      if (strchr ("AzZG", regex[i + 1])) return TRUE;
+      i++;
+      }
+    else if (regex[i] == '[')
+      {
+      PatternParser pp = { regex, i, FALSE };
+      pattern_skip_class (&pp);
+      if (pp.fail) return TRUE;
+      i = pp.pos - 1;
+      }
+    else if (strncmp (regex + i, "(?=", 3) == 0 || 
+        strncmp (regex + i, "(?!", 3) == 0 ||
+        strncmp (regex + i, "(?<=", 4) == 0 || 
+        strncmp (regex + i, "(?<!", 4) == 0)
+      return TRUE;
+    }
+  return FALSE;
+  }
+
+/*==========================================================================
+  pattern_compile
+
+  Compile a regular expression, and study it, JIT-compiling it if PCRE
+    can. Returns NULL, and sets *error and *error_pos, if it won't 
+    compile
+==========================================================================*/
+static pcre *pattern_compile (const char *regex, int options, 
+    pcre_extra **extra, const char **error, int *error_pos)
+  {
+  pcre *re = pcre_compile (regex, options, error, error_pos, NULL);
+  if (re)
+    {
+    const char *study_error = NULL;
+    *extra = pcre_study (re, 
+      PCRE_STUDY_JIT_COMPILE | PCRE_STUDY_EXTRA_NEEDED, &study_error);
+    int jit = 0;
+    if (*extra)
+      pcre_fullinfo (re, *extra, PCRE_INFO_JIT, &jit);
+    if (jit)
+      {
+      pcre_assign_jit_stack (*extra, pattern_get_stack, NULL);
+      log_debug ("Using PCRE JIT for '%s'", regex);
+      }
+    else if (study_error)
+      log_debug ("Can't study '%s': %s; using PCRE interpreter", 
+        regex, study_error);
+    else
+      log_debug ("JIT not available for '%s'; using PCRE interpreter", 
+        regex);
+    }
+  return re;
+  }
+
+/*==========================================================================
+  pattern_create
+==========================================================================*/
+Pattern *pattern_create (const char *pattern, int flags, 
+           const char **error, int *error_pos)
+  {
+  LOG_IN
+  Pattern *self = NULL;
+
+  if (flags & PT_FIXED)
+    {
+    self = malloc (sizeof (Pattern));
+    memset (self, 0, sizeof (Pattern));
+    self->fixed = strdup (pattern);
+    self->fixed_length = strlen (pattern);
+    self->word = (flags & PT_WORD) != 0;
+    self->caseless = (flags & PT_CASELESS) != 0;
+    self->count = 1;
+    self->texts = malloc (sizeof (char *));
+    self->texts[0] = strdup (pattern);
+    log_debug ("Searching for fixed string '%s'", pattern);
+    LOG_OUT
+    return self;
+    }
+
+  int options = PCRE_MULTILINE;
+  if (flags & PT_CASELESS) options |= PCRE_CASELESS;
+
+  char *regex;
+  if (flags & PT_WORD)
+    asprintf (&regex, "\\b(%s)\\b", pattern);
+  else
+    regex = strdup (pattern);
+
+  pcre_extra *extra = NULL;
+  pcre *re = pattern_compile (regex, options, &extra, error, error_pos);
+  if (re)
+    {
+    self = malloc (sizeof (Pattern));
+    memset (self, 0, sizeof (Pattern));
+    self->re = re;
+    self->extra = extra;
+    self->caseless = (flags & PT_CASELESS) != 0;
+    self->count = 1;
+    self->texts = malloc (sizeof (char *));
+    self->texts[0] = strdup (pattern);
+    self->dfa = dfa_create (regex, self->caseless);
+    self->lines = pattern_is_line_bound (regex);
+    pattern_find_literal (self, regex);
+    }
+  free (regex);
+
+  LOG_OUT
+  return self;
+  }
+
+/*==========================================================================
+  pattern_is_literal
+
+  Returns TRUE if a regular expression has nothing in it that isn't a
+    literal character. We're cautious -- a { or ] on its own is literal 
+    to PCRE, but not to us
+==========================================================================*/
+static BOOL pattern_is_literal (const char *regex)
+  {
+  return regex[strcspn (regex, "\\^$.|?*+()[]{}")] == 0;
+  }
+
+/*==========================================================================
+  pattern_combine
+
+  Combine the regular expressions with the specified indexes into 
+    a single alternation, marking each alternative with its index
+==========================================================================*/
+static char *pattern_combine (const char * const *patterns, 
+    const int *indexes, int n, BOOL word)
+  {
+  size_t size = 8;
+  for (int i = 0; i < n; i++)
+    size += strlen (patterns[indexes[i]]) + 40;
+  char *regex = malloc (size);
+  char *r = regex;
+  const char *b = word ? "\\b" : "";
+  r += sprintf (r, "(?|");
+  for (int i = 0; i < n; i++)
+    r += sprintf (r, "%s%s(?:%s)%s(*MARK:%d)", i ? "|" : "", b,
+      patterns[indexes[i]], b, indexes[i]);
+  strcpy (r, ")");
+  return regex;
+  }
+
+/*==========================================================================
+  pattern_add_groups
+
+  Compile the regular expressions with the specified indexes as a group,
+    and add it to the set. If that fails, split them in two, and try 
+    each half. An expression that won't compile even on its own, 
+    outside the group, is an error, and *error_index is set to its index
+==========================================================================*/
+static BOOL pattern_add_groups (Pattern *self, const char * const *patterns,
+    const int *indexes, int n, int options, const char **error, 
+    int *error_pos, int *error_index)
+  {
+  char *regex = pattern_combine (patterns, indexes, n, self->word);
+  pcre_extra *extra = NULL;
+  pcre *re = pattern_compile (regex, options, &extra, error, error_pos);
+  free (regex);
+  int index = -1;
+
+  if (!re && n > 1)
+    {
+    int half = n / 2;
+    return pattern_add_groups (self, patterns, indexes, half, options,
+        error, error_pos, error_index) &&
+      pattern_add_groups (self, patterns, indexes + half, n - half, 
+        options, error, error_pos, error_index);
+    }
+
+  if (!re)
+    {
+    // Some things, like (*UTF8), only work at the very start
+    index = indexes[0];
+    if (self->word)
+      asprintf (&regex, "\\b(%s)\\b", patterns[index]);
+    else
+      regex = strdup (patterns[index]);
+    re = pattern_compile (regex, options, &extra, error, error_pos);
+    free (regex);
+    if (!re)
+      {
+      *error_index = index;
+      return FALSE;
+      }
+    }
+
+  self->groups = realloc (self->groups, 
+    (self->num_groups + 1) * sizeof (PatternGroup));
+  PatternGroup *group = &self->groups[self->num_groups++];
+  group->re = re;
+  group->extra = extra;
+  group->index = index;
+  return TRUE;
+  }
+
+/*==========================================================================
+  pattern_create_set
+==========================================================================*/
+Pattern *pattern_create_set (const char * const *patterns, int count, 
+           int flags, const char **error, int *error_pos, int *error_index)
+  {
+  LOG_IN
+  if (count == 1)
+    {
+    *error_index = 0;
+    Pattern *self = pattern_create (patterns[0], flags, error, error_pos);
+    LOG_OUT
+    return self;
+    }
+
+  Pattern *self = malloc (sizeof (Pattern));
+  memset (self, 0, sizeof (Pattern));
+  self->set = TRUE;
+  self->word = (flags & PT_WORD) != 0;
+  self->caseless = (flags & PT_CASELESS) != 0;
+  self->count = count;
+  self->texts = malloc (count * sizeof (char *));
+
+  int *regexes = malloc (count * sizeof (int));
+  int num_regexes = 0;
+  for (int i = 0; i < count; i++)
+    {
+    self->texts[i] = strdup (patterns[i]);
+    if ((flags & PT_FIXED) || pattern_is_literal (patterns[i]))
+      {
+      if (!self->strings) self->strings = multistring_create (self->caseless);
+      multistring_add (self->strings, patterns[i], strlen (patterns[i]), i);
+      }
+    else
+      {
+      regexes[num_regexes++] = i;
+      if (pattern_is_line_bound (patterns[i])) self->lines = TRUE;
+      }
+    }
+  if (self->strings) multistring_compile (self->strings);
+
+  int options = PCRE_MULTILINE;
+  if (flags & PT_CASELESS) options |= PCRE_CASELESS;
+
+  BOOL ok = TRUE;
+  int first = 0;
+  while (first < num_regexes && ok)
+    {
+    int end = first;
+    size_t size = 0;
+    while (end < num_regexes && (end == first || 
+         size + strlen (patterns[regexes[end]]) <= PATTERN_GROUP_SIZE))
+      size += strlen (patterns[regexes[end++]]);
+    ok = pattern_add_groups (self, patterns, regexes + first, end - first,
+      options, error, error_pos, error_index);
+    first = end;
+    }
+
+  if (ok)
+    log_debug ("Searching for %d strings, and %d regular expressions "
+      "in %d groups", count - num_regexes, num_regexes, self->num_groups);
+  else
+    {
+    pattern_destroy (self);
+    self = NULL;
+    }
+  free (regexes);
+
+  LOG_OUT
+  return self;
+  }
+
+/*==========================================================================
+  pattern_destroy
+==========================================================================*/
+void pattern_destroy (Pattern *self)
+  {
+  LOG_IN
+  if (self)
+    {
+    if (self->extra) pcre_free_study (self->extra);
+    if (self->re) pcre_free (self->re);
+    dfa_destroy (self->dfa);
+    for (int i = 0; i < self->num_groups; i++)
+      {
+      if (self->groups[i].extra) pcre_free_study (self->groups[i].extra);
+      pcre_free (self->groups[i].re);
+      }
+    free (self->groups);
+    multistring_destroy (self->strings);
+    for (int i = 0; i < self->count; i++)
+      free (self->texts[i]);
+    free (self->texts);
+    free (self->fixed);
+    free (self->literal);
+    free (self);
+    }
+  LOG_OUT
+  }
+
+/*==========================================================================
+  pattern_find
+
+  Find a string in the subject, respecting the pattern's case sensitivity
+==========================================================================*/
+static inline const char *pattern_find (const Pattern *self, 
+    const char *subject, int length, const char *s, int n)
+  {
+  if (self->caseless)
+    return substring_find_caseless (subject, length, s, n);
+  return substring_find (subject, length, s, n);
+  }
+
+/*==========================================================================
+  pattern_is_word
+==========================================================================*/
+static inline BOOL pattern_is_word (char c)
+  {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || 
+    (c >= '0' && c <= '9') || c == '_';
+  }
+
+/*==========================================================================
+  pattern_is_boundary
+
+  Returns TRUE if there is a word boundary at the offset in the subject,
+    as PCRE's \b would see it. The ends of the subject count as non-word
+    characters
+==========================================================================*/
+static BOOL pattern_is_boundary (const char *subject, int length, 
+    int offset)
+  {
+  BOOL before = offset > 0 && pattern_is_word (subject[offset - 1]);
+  BOOL after = offset < length && pattern_is_word (subject[offset]);
+  return before != after;
+  }
+
+/*==========================================================================
+  pattern_is_whole_word
+
+  Returns TRUE if the text from start to end is bounded as \b(...)\b 
+    would require
+==========================================================================*/
+static BOOL pattern_is_whole_word (const char *subject, int length, 
+    int start, int end)
+  {
+  return pattern_is_boundary (subject, length, start) && 
+    pattern_is_boundary (subject, length, end);
+  }
+
+/*==========================================================================
+  pattern_exec_fixed
+==========================================================================*/
+static int pattern_exec_fixed (const Pattern *self, const char *subject, 
+           int length, int start, int *ovector, int ovecsize)
+  {
+  int n = self->fixed_length;
+  while (start <= length)
+    {
+    const char *found = pattern_find (self, subject + start, 
+      length - start, self->fixed, n);
+    if (!found) break;
+    int offset = found - subject;
+    if (!self->word || 
+         pattern_is_whole_word (subject, length, offset, offset + n))
+      {
+      if (ovecsize >= 3)
+        {
+        ovector[0] = offset;
+        ovector[1] = offset + n;
+        }
+      return 1;
+      }
+    start = offset + 1;
+    }
+  return -1;
+  }
+
+/*==========================================================================
+  pattern_is_limit
+
+  Returns TRUE if pcre_exec() returned rc because it gave up, rather 
+    than because there was no match. Running out of JIT stack counts, 
+    as that is the same problem
+==========================================================================*/
+static BOOL pattern_is_limit (int rc)
+  {
+  return rc == PCRE_ERROR_MATCHLIMIT || rc == PCRE_ERROR_RECURSIONLIMIT ||
+    rc == PCRE_ERROR_JIT_STACKLIMIT;
+  }
+
+/*==========================================================================
+  pattern_exec_set
+
+  Find the leftmost match of any pattern in the set -- the longest, if 
+    several start at the same place. Once one of the plain strings has
+    been found, the regular expressions need only be tried as far as 
+    the end of the line it's in. A match that starts later would be no 
+    use, and it can't matter to the caller if one that starts earlier is
+    missed because it runs past that point. Without this, text that has 
+    many matches of the strings would be scanned by PCRE over and over. 
+==========================================================================*/
+static int pattern_exec_set (const Pattern *self, const char *subject, 
+           int length, int start, int options, int *ovector, int ovecsize, 
+           int *which)
+  {
+  int best = -1, best_start = 0, best_end = 0;
+  int limit = length;
+
+  if (self->strings && multistring_find (self->strings, subject, length, 
+        start, self->word ? pattern_is_whole_word : NULL, 
+        &best_start, &best_end, &best))
+    {
+    const char *nl = memchr (subject + best_start, '\n', 
+      length - best_start);
+    if (nl) limit = nl - subject + 1;
+    if (ovecsize >= 3)
+      {
+      ovector[0] = best_start;
+      ovector[1] = best_end;
+      }
+    }
+
+  for (int i = 0; i < self->num_groups; i++)
+    {
+    const PatternGroup *group = &self->groups[i];
+    pcre_extra extra;
+    if (group->extra) 
+      extra = *group->extra;
+    else
+      memset (&extra, 0, sizeof (extra));
+    // The copy is ours, so setting the mark won't upset other threads 
+    unsigned char *mark = NULL;
+    extra.flags |= PCRE_EXTRA_MARK;
+    extra.mark = &mark;
+    int pmatch[30];
+    int rc = pcre_exec (group->re, &extra, subject, limit, start, options, 
+      pmatch, 30);
+    if (pattern_is_limit (rc)) return PT_ERROR_LIMIT;
+    if (rc < 0) continue;
+    if (best >= 0 && (pmatch[0] > best_start || 
+         (pmatch[0] == best_start && pmatch[1] <= best_end)))
+      continue;
+    int index = group->index >= 0 ? group->index : 
+      mark ? atoi ((const char *)mark) : -1;
+    if (index < 0) continue;
+    best = index;
+    best_start = pmatch[0];
+    best_end = pmatch[1];
+    memcpy (ovector, pmatch, (ovecsize < 30 ? ovecsize : 30) * sizeof (int));
+    }
+
+  if (best < 0) return -1;
+  if (which) *which = best;
+  return 1;
+  }
+
+/*==========================================================================
+  pattern_exec
+==========================================================================*/
+int pattern_exec (const Pattern *self, const char *subject, 
+           int length, int start, int flags, int *ovector, int ovecsize, 
+           int *which)
+  {
+  int options = (flags & PT_EXEC_VALID_UTF8) ? PCRE_NO_UTF8_CHECK : 0;
+  if (self->set)
+    return pattern_exec_set (self, subject, length, start, options, 
+      ovector, ovecsize, which);
+  if (which) *which = 0;
+  if (self->fixed)
+    return pattern_exec_fixed (self, subject, length, start, ovector, 
+      ovecsize);
+  if (self->dfa)
+    {
+    int rc = dfa_exec (self->dfa, subject, length, start, ovector, 
+      ovecsize);
+    if (rc != DFA_GAVE_UP) return rc;
+    }
+  int rc = pcre_exec (self->re, self->extra, subject, length, start, 
+    options, ovector, ovecsize);
+  return pattern_is_limit (rc) ? PT_ERROR_LIMIT : rc;
+  }
+
+/*==========================================================================
+  pattern_limit_extra
+
+  Set the limits in the study data of one expression
+==========================================================================*/
+static void pattern_limit_extra (pcre_extra *extra, 
+    unsigned long match_limit, unsigned long recursion_limit)
+  {
+  if (!extra) return;
+  if (match_limit > 0)
+    {
+    extra->flags |= PCRE_EXTRA_MATCH_LIMIT;
+    extra->match_limit = match_limit;
+    }
+  if (recursion_limit > 0)
+    {
+    extra->flags |= PCRE_EXTRA_MATCH_LIMIT_RECURSION;
+    extra->match_limit_recursion = recursion_limit;
+    }
+  }
+
+/*==========================================================================
+  pattern_set_limits
+==========================================================================*/
+void pattern_set_limits (Pattern *self, unsigned long match_limit, 
+       unsigned long recursion_limit)
+  {
+  LOG_IN
+  pattern_limit_extra (self->extra, match_limit, recursion_limit);
+  for (int i = 0; i < self->num_groups; i++)
+    pattern_limit_extra (self->groups[i].extra, match_limit, 
+      recursion_limit);
+  LOG_OUT
+  }
+
+/*==========================================================================
+  pattern_get_count
+==========================================================================*/
+int pattern_get_count (const Pattern *self)
+  {
+  return self->count;
+  }
+
+/*==========================================================================
+  pattern_get_text
+==========================================================================*/
+const char *pattern_get_text (const Pattern *self, int n)
+  {
+  return self->texts[n];
+  }
+
+/*==========================================================================
+  pattern_has_prefilter
+==========================================================================*/
+BOOL pattern_has_prefilter (const Pattern *self)
+  {
+  return self->literal != NULL;
+  }
+
+/*==========================================================================
+  pattern_needs_lines
+==========================================================================*/
+BOOL pattern_needs_lines (const Pattern *self)
+  {
+  return self->lines;
+  }
+
+/*==========================================================================
+  pattern_prefilter
+
+  Returns the offset of the first place, at or after start, where the 
+    pattern's required literal appears in the subject, or -1 if it 
+    doesn't. Any match must include that literal so, if there is a match,
+    the line it's in must contain the offset returned. If the pattern has 
+    no required literal, returns start.
+==========================================================================*/
+int pattern_prefilter (const Pattern *self, const char *subject, 
+           int length, int start)
+  {
+  if (!self->literal) return start;
+  const char *found = pattern_find (self, subject + start, length - start,
+    self->literal, self->literal_length);
+  return found ? found - subject : -1;
+  }
+
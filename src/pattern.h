@@ -0,0 +1,103 @@
+/*==========================================================================
+
+  kzgrep
+  pattern.h
+  Copyright (c)2020 Kevin Boone
+  Distributed under the terms of the GPL v3.0
+
+==========================================================================*/
+
+#pragma once
+
+#include "defs.h"
+
+// Flags for pattern_create()
+#define PT_DEFAULT            0x0000
+#define PT_CASELESS           0x0001
+// Match whole words only
+#define PT_WORD               0x0002
+// The pattern is a plain string, not a regular expression
+#define PT_FIXED              0x0004
+
+// Flags for pattern_exec()
+#define PT_EXEC_DEFAULT       0x0000
+// The subject is known to be valid UTF-8, so a pattern in UTF-8 mode,
+//   like (*UTF8)..., needn't check it again on every call
+#define PT_EXEC_VALID_UTF8    0x0001
+
+// Returned by pattern_exec() if PCRE gave up, because the search needed
+//   more work than the limits set by pattern_set_limits() allow. PCRE's
+//   own error codes, which are passed on otherwise, are all above this
+#define PT_ERROR_LIMIT        (-100)
+
+struct _Pattern;
+typedef struct _Pattern Pattern;
+
+BEGIN_DECLS
+
+// Compile a regular expression or, with PT_FIXED, prepare to search for
+//   a plain string. In a regular expression, ^ and $ match at the start 
+//   and end of each line in the subject, as well as the start and end of 
+//   the subject. On failure, returns NULL, and sets *error to a message 
+//   (which must not be freed) and *error_pos to the offset in the 
+//   expression where the problem was found
+Pattern *pattern_create (const char *pattern, int flags, 
+           const char **error, int *error_pos);
+
+// Prepare to search for any of count patterns at once. The flags apply
+//   to all of them. If a regular expression won't compile, returns NULL,
+//   and sets *error_index to its index, as well as *error and *error_pos 
+//   as pattern_create() does
+Pattern *pattern_create_set (const char * const *patterns, int count, 
+           int flags, const char **error, int *error_pos, int *error_index);
+
+void     pattern_destroy (Pattern *self);
+
+// Search subject, of the specified length, from offset start, which 
+//   must be at the start of a character. flags are PT_EXEC_xxx values. 
+//   Returns a negative number if there is no match -- PT_ERROR_LIMIT if
+//   PCRE gave up before it could tell; otherwise ovector[0] and 
+//   ovector[1] are set to the offsets of the start and end of the 
+//   match, and further pairs of ovector to those of the captured 
+//   substrings, so far as ovecsize allows. ovecsize must be a multiple
+//   of 3, as for pcre_exec(). If which is not NULL, it is set to the
+//   index of the pattern that matched, in a set. Any number of threads 
+//   may call this function on the same Pattern at the same time
+int      pattern_exec (const Pattern *self, const char *subject, 
+           int length, int start, int flags, int *ovector, int ovecsize, 
+           int *which);
+
+// Limit the work PCRE does in any one call to pattern_exec(): the number
+//   of times its internal match() function is called, and how deeply it 
+//   recurses (which the JIT ignores). A limit of 0 leaves PCRE's default.
+//   Expressions matched without PCRE -- plain strings, and those the DFA
+//   handles -- never reach a limit
+void     pattern_set_limits (Pattern *self, unsigned long match_limit,
+           unsigned long recursion_limit);
+
+// The number of patterns, and the text of each, as it was given
+int      pattern_get_count (const Pattern *self);
+const char *pattern_get_text (const Pattern *self, int n);
+
+// Returns TRUE if the pattern has a literal that every match must 
+//   contain, so that pattern_prefilter() can be used to skip text that
+//   can't match
+BOOL     pattern_has_prefilter (const Pattern *self);
+
+// Returns TRUE if the pattern can only be searched for a line at a time,
+//   because it refers to the start or end of the subject, or looks 
+//   around the match. Otherwise a buffer of lines can be searched in one
+//   go, and the pattern matches in it only where it matches in a line, 
+//   unless the match runs on into the next line
+BOOL     pattern_needs_lines (const Pattern *self);
+
+// Returns the offset of the next place in the subject, at or after start,
+//   where the pattern's required literal appears, or -1 if there is none.
+//   If the pattern has no required literal, returns start. The literal 
+//   never contains a newline, so only lines that contain the offset
+//   returned can match
+int      pattern_prefilter (const Pattern *self, const char *subject, 
+           int length, int start);
+
+END_DECLS
+
@@ -0,0 +1,390 @@
+/*==========================================================================
+
+  kzgrep
+  prefetch.c
+  Copyright (c)2020 Kevin Boone
+  Distributed under the terms of the GPL v3.0
+
+  Decompress zipfile entries in a thread of their own, ahead of the
+  thread that is searching them. Searching an entry and inflating the
+  next one then happen at the same time, which helps even when there
+  are too few CPUs to make a full pool of worker threads worthwhile.
+
+  The decompressed data is passed to the reader as a queue of chunks. The
+  number of bytes in the queue is limited by a budget, so the thread
+  waits when it gets too far ahead. When the reader gives up on an entry
+  before the end -- because the outcome is already known -- whatever was
+  decompressed from it is thrown away, and the thread moves on. So at
+  most a budget's worth of inflation is wasted.
+
+  Messages logged while opening an entry are collected, and passed on
+  to the reader, so they appear in the same place as they would without
+  prefetching.
+
+==========================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "defs.h"
+#include "log.h"
+#include "zipfile.h"
+#include "prefetch.h"
+
+typedef struct _PrefetchChunk
+  {
+  struct _PrefetchChunk *next;
+  int entry;
+  BYTE *data;
+  uint64_t length;
+  uint64_t used; // Bytes already taken by the reader
+  BOOL last; // No more data for this entry after this chunk
+  BOOL open_failed; // The entry could not be opened, and there is no data
+  ZipError error;
+  char *messages; // Logged while opening the entry; NULL if none
+  } PrefetchChunk;
+
+struct _Prefetch
+  {
+  const ZipFile *z;
+  int *entries;
+  int num_entries;
+  uint64_t budget;
+  uint64_t first_chunk;
+  uint64_t chunk;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  PrefetchChunk *head;
+  PrefetchChunk *tail;
+  uint64_t held; // Bytes in the queue
+  // The entry the reader has open, or will open next. Entries before
+  //   this one are no longer wanted
+  int current;
+  BOOL ended; // The reader has had all the data for the current entry
+  BOOL finished; // The thread has nothing more to add to the queue
+  BOOL closing;
+  };
+
+/*==========================================================================
+  prefetch_chunk_free
+==========================================================================*/
+static void prefetch_chunk_free (PrefetchChunk *chunk)
+  {
+  free (chunk->data);
+  free (chunk->messages);
+  free (chunk);
+  }
+
+/*==========================================================================
+  prefetch_drop_head
+
+  Remove the first chunk from the queue. The caller must hold the lock
+==========================================================================*/
+static void prefetch_drop_head (Prefetch *self)
+  {
+  PrefetchChunk *chunk = self->head;
+  self->head = chunk->next;
+  if (!self->head) self->tail = NULL;
+  self->held -= chunk->length;
+  prefetch_chunk_free (chunk);
+  // The thread might be waiting for space
+  pthread_cond_broadcast (&self->cond);
+  }
+
+/*==========================================================================
+  prefetch_drop_before
+
+  Remove chunks for entries before entry n from the front of the queue.
+    The caller must hold the lock
+==========================================================================*/
+static void prefetch_drop_before (Prefetch *self, int n)
+  {
+  while (self->head && self->head->entry < n)
+    prefetch_drop_head (self);
+  }
+
+/*==========================================================================
+  prefetch_push
+
+  Add a chunk to the end of the queue, unless the reader has already
+    moved past its entry
+==========================================================================*/
+static void prefetch_push (Prefetch *self, PrefetchChunk *chunk)
+  {
+  pthread_mutex_lock (&self->mutex);
+  if (chunk->entry < self->current)
+    prefetch_chunk_free (chunk);
+  else
+    {
+    chunk->next = NULL;
+    if (self->tail) self->tail->next = chunk; else self->head = chunk;
+    self->tail = chunk;
+    self->held += chunk->length;
+    pthread_cond_broadcast (&self->cond);
+    }
+  pthread_mutex_unlock (&self->mutex);
+  }
+
+/*==========================================================================
+  prefetch_wanted
+
+  Returns TRUE if the thread should carry on with entry n. If it would
+    take more than the budget to add size bytes to the queue, wait until
+    the reader has taken some. There is always room for one chunk,
+    however big, or the reader and this thread could wait for each other
+==========================================================================*/
+static BOOL prefetch_wanted (Prefetch *self, int n, uint64_t size)
+  {
+  pthread_mutex_lock (&self->mutex);
+  while (!self->closing && self->current <= n && self->held > 0
+        && self->held + size > self->budget)
+    pthread_cond_wait (&self->cond, &self->mutex);
+  BOOL ret = !self->closing && self->current <= n;
+  pthread_mutex_unlock (&self->mutex);
+  return ret;
+  }
+
+/*==========================================================================
+  prefetch_thread
+
+  Decompress each entry in turn, adding the data to the queue a chunk
+    at a time
+==========================================================================*/
+static void *prefetch_thread (void *arg)
+  {
+  Prefetch *self = arg;
+
+  for (int i = 0; i < self->num_entries; i++)
+    {
+    int n = self->entries[i];
+    pthread_mutex_lock (&self->mutex);
+    BOOL closing = self->closing;
+    BOOL skip = self->current > n;
+    pthread_mutex_unlock (&self->mutex);
+    if (closing) break;
+    if (skip) continue;
+
+    char *messages = NULL;
+    size_t messages_length = 0;
+    FILE *log = open_memstream (&messages, &messages_length);
+    log_set_thread_stream (log);
+    ZipStream *stream = NULL;
+    ZipError error = zipfile_stream_open (self->z, n, &stream);
+    log_set_thread_stream (NULL);
+    fclose (log);
+    if (messages_length == 0)
+      {
+      free (messages);
+      messages = NULL;
+      }
+
+    if (error)
+      {
+      PrefetchChunk *chunk = malloc (sizeof (PrefetchChunk));
+      memset (chunk, 0, sizeof (PrefetchChunk));
+      chunk->entry = n;
+      chunk->last = TRUE;
+      chunk->open_failed = TRUE;
+      chunk->error = error;
+      chunk->messages = messages;
+      prefetch_push (self, chunk);
+      }
+    else
+      {
+      uint64_t size = self->first_chunk;
+      BOOL last = FALSE;
+      while (!last && prefetch_wanted (self, n, size))
+        {
+        PrefetchChunk *chunk = malloc (sizeof (PrefetchChunk));
+        memset (chunk, 0, sizeof (PrefetchChunk));
+        chunk->entry = n;
+        chunk->data = malloc (size);
+        chunk->error = zipfile_stream_read (stream, chunk->data, size,
+          &chunk->length);
+        last = chunk->error || chunk->length < size;
+        chunk->last = last;
+        chunk->messages = messages;
+        messages = NULL;
+        prefetch_push (self, chunk);
+        if (size < self->chunk) size *= 2;
+        }
+      free (messages);
+      zipfile_stream_close (stream);
+      }
+    }
+
+  pthread_mutex_lock (&self->mutex);
+  self->finished = TRUE;
+  pthread_cond_broadcast (&self->cond);
+  pthread_mutex_unlock (&self->mutex);
+  return NULL;
+  }
+
+/*==========================================================================
+  prefetch_create
+==========================================================================*/
+Prefetch *prefetch_create (const ZipFile *z, const int *entries,
+            int num_entries, uint64_t budget, uint64_t first_chunk,
+            uint64_t chunk)
+  {
+  LOG_IN
+  Prefetch *self = malloc (sizeof (Prefetch));
+  memset (self, 0, sizeof (Prefetch));
+  self->z = z;
+  self->entries = malloc (num_entries * sizeof (int));
+  memcpy (self->entries, entries, num_entries * sizeof (int));
+  self->num_entries = num_entries;
+  self->budget = budget;
+  self->first_chunk = first_chunk;
+  self->chunk = chunk;
+  self->current = -1;
+  pthread_mutex_init (&self->mutex, NULL);
+  pthread_cond_init (&self->cond, NULL);
+
+  int error = pthread_create (&self->thread, NULL, prefetch_thread, self);
+  if (error)
+    {
+    log_debug ("Can't start prefetch thread: %s", strerror (error));
+    pthread_cond_destroy (&self->cond);
+    pthread_mutex_destroy (&self->mutex);
+    free (self->entries);
+    free (self);
+    self = NULL;
+    }
+  LOG_OUT
+  return self;
+  }
+
+/*==========================================================================
+  prefetch_destroy
+==========================================================================*/
+void prefetch_destroy (Prefetch *self)
+  {
+  LOG_IN
+  if (self)
+    {
+    pthread_mutex_lock (&self->mutex);
+    self->closing = TRUE;
+    pthread_cond_broadcast (&self->cond);
+    pthread_mutex_unlock (&self->mutex);
+    pthread_join (self->thread, NULL);
+
+    while (self->head)
+      prefetch_drop_head (self);
+    pthread_cond_destroy (&self->cond);
+    pthread_mutex_destroy (&self->mutex);
+    free (self->entries);
+    free (self);
+    }
+  LOG_OUT
+  }
+
+/*==========================================================================
+  prefetch_open
+
+  Start reading entry n. If it could not be opened, returns the error
+    that zipfile_stream_open() gave, and the entry need not be closed.
+==========================================================================*/
+ZipError prefetch_open (Prefetch *self, int n)
+  {
+  LOG_IN
+  ZipError ret = ZE_OK;
+  pthread_mutex_lock (&self->mutex);
+  self->current = n;
+  self->ended = FALSE;
+  prefetch_drop_before (self, n);
+  while (!self->head && !self->finished)
+    pthread_cond_wait (&self->cond, &self->mutex);
+
+  PrefetchChunk *chunk = self->head;
+  if (chunk && chunk->entry == n)
+    {
+    if (chunk->messages)
+      {
+      FILE *f = log_get_thread_stream ();
+      fputs (chunk->messages, f ? f : stdout);
+      free (chunk->messages);
+      chunk->messages = NULL;
+      }
+    if (chunk->open_failed)
+      {
+      ret = chunk->error;
+      prefetch_drop_head (self);
+      self->current = n + 1;
+      }
+    }
+  else
+    {
+    // The entry was not in the list
+    ret = ZE_INTERNAL;
+    self->current = n + 1;
+    }
+  pthread_mutex_unlock (&self->mutex);
+  LOG_OUT
+  return ret;
+  }
+
+/*==========================================================================
+  prefetch_read
+
+  Copy up to size bytes of the current entry into buff, waiting for the
+    thread to decompress them if necessary. As with zipfile_stream_read(),
+    *got is only less than size at the end of the entry
+==========================================================================*/
+ZipError prefetch_read (Prefetch *self, BYTE *buff, uint64_t size,
+            uint64_t *got)
+  {
+  LOG_IN
+  ZipError ret = ZE_OK;
+  uint64_t done = 0;
+  pthread_mutex_lock (&self->mutex);
+  while (ret == ZE_OK && done < size && !self->ended)
+    {
+    PrefetchChunk *chunk = self->head;
+    if (chunk && chunk->entry < self->current)
+      prefetch_drop_head (self);
+    else if (chunk && chunk->entry == self->current)
+      {
+      uint64_t n = chunk->length - chunk->used;
+      if (n > size - done) n = size - done;
+      memcpy (buff + done, chunk->data + chunk->used, n);
+      chunk->used += n;
+      done += n;
+      if (chunk->used == chunk->length)
+        {
+        ret = chunk->error;
+        if (chunk->last) self->ended = TRUE;
+        prefetch_drop_head (self);
+        }
+      }
+    else if (!chunk && !self->finished)
+      pthread_cond_wait (&self->cond, &self->mutex);
+    else
+      self->ended = TRUE;
+    }
+  pthread_mutex_unlock (&self->mutex);
+  *got = done;
+  LOG_OUT
+  return ret;
+  }
+
+/*==========================================================================
+  prefetch_close
+
+  Finish with the current entry. Anything that has not been read from it
+    is discarded
+==========================================================================*/
+void prefetch_close (Prefetch *self)
+  {
+  LOG_IN
+  pthread_mutex_lock (&self->mutex);
+  self->current++;
+  prefetch_drop_before (self, self->current);
+  pthread_cond_broadcast (&self->cond);
+  pthread_mutex_unlock (&self->mutex);
+  LOG_OUT
+  }
+
@@ -0,0 +1,45 @@
+/*==========================================================================
+
+  kzgrep
+  prefetch.h
+  Copyright (c)2020 Kevin Boone
+  Distributed under the terms of the GPL v3.0
+
+==========================================================================*/
+
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+#include "zipfile.h"
+
+struct _Prefetch;
+typedef struct _Prefetch Prefetch;
+
+BEGIN_DECLS
+
+// Start a thread that decompresses the listed entries of a zipfile, in
+//   order, ahead of the caller. The entries array is copied. No more than
+//   budget bytes are held at once. Each entry is decompressed in pieces
+//   that start at first_chunk bytes, and double up to chunk bytes.
+//   Returns NULL if the thread can't be started -- the caller should
+//   then read the entries itself
+Prefetch *prefetch_create (const ZipFile *z, const int *entries,
+            int num_entries, uint64_t budget, uint64_t first_chunk,
+            uint64_t chunk);
+
+// Stop the thread, and discard anything it has decompressed that has not
+//   been read
+void     prefetch_destroy (Prefetch *self);
+
+// These work like zipfile_stream_open(), _read(), and _close(), but
+//   take the data that the thread has decompressed. Only one entry can
+//   be open at a time, and entries must be opened in the order they were
+//   listed, although any of them can be skipped
+ZipError prefetch_open (Prefetch *self, int n);
+ZipError prefetch_read (Prefetch *self, BYTE *buff, uint64_t size,
+            uint64_t *got);
+void     prefetch_close (Prefetch *self);
+
+END_DECLS
+
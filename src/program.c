@@ -24,7 +24,7 @@
 #include <wchar.h>
 #include <errno.h>
 #include <regex.h>
-#include <pcre.h>
+#include <pthread.h>
 #include "feature.h" 
 #include "program_context.h" 
 #include "program.h" 
@@ -36,10 +36,202 @@
 #include "numberformat.h" 
 #include "console.h" 
 #include "wstring.h" 
+#include "threadpool.h" 
+#include "prefetch.h" 
+#include "pattern.h" 
+#include "utf8.h" 
+#include "markup.h"
+#include "utf16.h" 
+#include "linecount.h"  
+
+// Entries are decompressed and searched in chunks of this size 
+#define PROGRAM_CHUNK_SIZE (256 * 1024)
+
+// When one match decides the outcome for an entry (--first, --quiet,
+//   --files-with-matches), the first chunk is this size, and chunks 
+//   double from there up to PROGRAM_CHUNK_SIZE. Most such matches are
+//   found near the start of an entry, and there's no point inflating 
+//   data we'll never look at
+#define PROGRAM_FIRST_CHUNK (4 * 1024)
+
+// Lines longer than this are searched in pieces 
+#define PROGRAM_MAX_LINE (16 * 1024 * 1024)
+
+// With -B, up to this much of the end of one window is kept, to provide
+//   leading context for a match at the start of the next
+#define PROGRAM_MAX_CONTEXT (256 * 1024)
+
+// With --multiline, or in a binary entry, the longest match that is 
+//   certain to be found, unless --max-match says otherwise
+#define PROGRAM_MAX_MATCH (64 * 1024)
+
+// In a binary entry, this much of what has been searched is kept at the
+//   start of the next window, for lookbehind, \b and ^ to look at
+#define PROGRAM_LOOKBEHIND 256
+
+// The most work PCRE may do on one search, unless --match-limit says
+//   otherwise. PCRE's own default, ten times this, lets a pathological 
+//   expression take minutes on a single long line
+#define PROGRAM_MATCH_LIMIT 1000000
+
+// With --threads, the number of zipfiles that may be searched, or 
+//   waiting to have their results written, for each thread 
+#define PROGRAM_JOBS_PER_THREAD 4
+
+// With --threads, a zipfile whose entries add up to more than this 
+//   (uncompressed) is split into units of roughly this size, which 
+//   several threads can search at once
+#define PROGRAM_UNIT_SIZE (8 * 1024 * 1024)
+
+// A search for one set of patterns, with its own options. Normally there 
+//   is just one, whose options are those on the command line; in batch 
+//   mode, there is one for each line of the batch file.
+typedef struct _ProgramQuery
+  {
+  ProgramContext *context;
+  Pattern *pattern;
+  FILE *sink; // Where the output ends up: stdout, or the --output file
+  BOOL first; // One match decides the outcome for a zipfile (--first, -q)
+  BOOL quiet;
+  BOOL decided; // With --quiet, a match has been found
+  int limited; // Entries not searched to the end, because PCRE gave up
+  } ProgramQuery;
+
+// The state of the search of a text entry, for one query, that is 
+//   carried from one window to the next. Offsets are in the entry.
+typedef struct _ProgramLines
+  {
+  int number; // The number of lines before 'counted'
+  uint64_t counted; // Always the start of a line, or the end of a window
+  uint64_t shown; // The end of the last line shown, including its newline
+  int after; // Lines of trailing context still to be shown
+  BOOL any; // Some line has been shown
+  uint64_t next; // With --multiline, the end of the last match's lines
+  BOOL limited; // PCRE gave up, so the rest of the entry is skipped
+  } ProgramLines;
+
+// Output collected in memory, to be written later. There is a stream
+//   for each query and, if messages are kept apart from the output, 
+//   one more for them. Otherwise the messages share the output stream, 
+//   so they appear in the right place among the matches.
+typedef struct _ProgramOutput
+  {
+  int num_streams;
+  FILE **streams;
+  char **texts;
+  size_t *lengths;
+  FILE **outs; // The stream for each query's matches
+  } ProgramOutput;
+
+// The search of a single zipfile, which might be carried out by a
+//   worker thread. In that case the output is collected in memory, 
+//   so it can be written in the order the zipfiles were found. A job 
+//   with no path is just a marker, that holds messages logged by the
+//   main thread and, if arg is not -1, marks the end of a command-line
+//   argument. 
+typedef struct _ProgramJob
+  {
+  struct _ProgramJob *next;
+  struct _ProgramRun *run;
+  Path *path;
+  int arg; // Index of the command-line argument that led to this file 
+  int *matches; // For each query
+  BOOL did_something;
+  ProgramOutput output;
+  char *messages; // For a marker, the messages it holds
+  size_t messages_length;
+  BOOL done;
+  } ProgramJob;
+
+// The state of the whole search. The list of jobs holds those that
+//   have been started, but whose results have not yet been collected,
+//   in the order they were started. 
+typedef struct _ProgramRun
+  {
+  const ProgramContext *context;
+  ProgramQuery *queries;
+  int num_queries;
+  FILE **sinks; // The sink of each query
+  BOOL batch;
+  BOOL separate_log; // Messages are not collected with the output
+  ThreadPool *pool; // NULL if all searching is done in the main thread
+  BOOL unordered;
+  int max_pending;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  ProgramJob *head;
+  ProgramJob *tail;
+  int pending; // Jobs in the list, not counting end-of-argument markers
+  int matches;
+  BOOL *did_something; // One for each command-line argument
+  // Messages logged by the main thread while looking for files, which 
+  //   have to be written in order with the output of the jobs
+  FILE *log;
+  char *log_output;
+  size_t log_length;
+  } ProgramRun;
+
+// A run of consecutive entries from a zipfile, that is searched as 
+//   a unit. The output is collected in memory, to be written in entry 
+//   order when all the units are finished.
+typedef struct _ProgramUnit
+  {
+  int first_entry;
+  int end_entry; // One past the last entry
+  int *matches; // For each query
+  BOOL did_something;
+  ProgramOutput output;
+  } ProgramUnit;
+
+// The search of a zipfile that has been split into units. Each thread 
+//   that takes part starts the next unit that has not been started, until
+//   there are none left. The thread that is searching the zipfile takes
+//   part, along with whatever helpers the thread pool can spare. A helper 
+//   might not start until all the work is done, so this structure is 
+//   freed by whichever thread finishes with it last. 
+typedef struct _ProgramSplit
+  {
+  ProgramRun *run;
+  const ZipFile *z;
+  ProgramUnit *units;
+  int num_units;
+  int next_unit;
+  int finished_units;
+  int *first_match; // For each query, with --first, the first unit 
+                    //   that matched 
+  int refs;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  } ProgramSplit;
+
+// A list of strings, such as the patterns to search for. A pattern file
+//   might have many thousands of lines, which is too many for a List, 
+//   because it is searched from the start every time it is appended to 
+typedef struct _ProgramStrings
+  {
+  char **texts;
+  int count;
+  int size; // Space allocated in texts
+  } ProgramStrings;
 
 // Forward declaration
-int program_do_file_or_dir (const ProgramContext *context, 
-       const pcre *, const char *arg, BOOL *did_something);
+void program_do_file_or_dir (ProgramRun *run, const char *arg, int n);
+
+/*==========================================================================
+  program_is_decided
+
+  Returns TRUE if there is no point in searching any more files at all. 
+    With --quiet, the only output is the exit status, and that is
+    decided by the first match. In batch mode, that has to be true of 
+    every query.
+==========================================================================*/
+BOOL program_is_decided (ProgramRun *run)
+  {
+  for (int q = 0; q < run->num_queries; q++)
+    if (!__atomic_load_n (&run->queries[q].decided, __ATOMIC_RELAXED))
+      return FALSE;
+  return TRUE;
+  }
 
 /*==========================================================================
   program_do_dir
@@ -47,14 +239,11 @@ int program_do_file_or_dir (const ProgramContext *context,
   Expands the specified path, which must have been determined previously
     to be a directory. Process all files in the directory that match
     the inclusion criteria.
- 
-  Returns the total number of matches in all files.
 ==========================================================================*/
-int program_do_dir (const ProgramContext *context, const pcre *preg,
-    const Path *path, BOOL *did_something)
+void program_do_dir (ProgramRun *run, const Path *path, int n)
   {
   LOG_IN
-  int matches = 0;
+  const ProgramContext *context = run->context;
 
   BOOL all = program_context_get_boolean (context, "all", FALSE);
 
@@ -65,13 +254,12 @@ int program_do_dir (const ProgramContext *context, const pcre *preg,
   if (path_expand_directory (path, flags, &list))
     {
     int l = list_length (list);
-    for (int i = 0; i < l; i++)
+    for (int i = 0; i < l && !program_is_decided (run); i++)
       {
       const String *s = list_get (list, i);
       Path *newpath = path_create (string_cstr(s));
       char *s_newpath = (char *)path_to_utf8 (newpath);
-      matches += program_do_file_or_dir (context, preg, s_newpath, 
-        did_something);
+      program_do_file_or_dir (run, s_newpath, n);
       free (s_newpath);
       path_destroy (newpath);
       }
@@ -85,7 +273,6 @@ int program_do_dir (const ProgramContext *context, const pcre *preg,
   if (list) list_destroy (list);
 
   LOG_OUT
-  return matches;
   } 
 
 /*==========================================================================
@@ -114,58 +301,83 @@ const char *program_zip_strerror (ZipError error)
 
 
 /*==========================================================================
-  program_is_utf8
-  Attempt to determine whether a block of data _could_ be UTF-8. The
-    length is constrained, to avoid reading vast files. However, the
-    shorter the length, the likelier it is that a non-UTF8 file will 
-    sneak through.
+  program_colour
+
+  Set the colour of the text that follows, unless the output of the
+    query is going to a file, rather than the console
 ==========================================================================*/
-BOOL program_is_utf8 (BYTE *data, int length)
+void program_colour (const ProgramContext *context, FILE *out, 
+       ConsoleColour colour)
   {
-  LOG_IN
-  if (length > 200) // We may need to tweak this later
-    length=200;
-  int bytes = 1;
-  BYTE c;
-  for (int i = 0; i < length; i++)
-    {
-    c = data[i];
-    if (bytes == 1)
-      {
-      if (c >= 0x80)
-        {
-        while (((c <<= 1) & 0x80) != 0)
-          {
-          bytes++;
-          }
-        if (bytes == 1 || bytes > 6)
-          {
-          return FALSE;
-          }
-        }
-      }
-    else
-      {
-      if ((c & 0xC0) != 0x80)
-        {
-        return FALSE;
-        }
-      bytes--;
-      }
-    }
-  if (bytes > 1)
-    {
-    return FALSE; 
-    }
-  LOG_OUT
-  return TRUE;
+  if (!program_context_get (context, "output"))
+    console_fg_colour (out, colour, FALSE);
+  }
+
+/*==========================================================================
+  program_attribute
+
+  As program_colour, but for a text attribute
+==========================================================================*/
+void program_attribute (const ProgramContext *context, FILE *out, 
+       ConsoleAttr attribute)
+  {
+  if (!program_context_get (context, "output"))
+    console_write_attribute (out, attribute, FALSE);
+  }
+
+/*==========================================================================
+  program_shows_lines
+
+  Returns TRUE if the query whose options are in context shows each 
+    match. It doesn't with --quiet, nor with --count, 
+    --files-with-matches or --files-without-match, which report on
+    each entry or zipfile as a whole, once it has been searched
+==========================================================================*/
+BOOL program_shows_lines (const ProgramContext *context)
+  {
+  return !program_context_get_boolean (context, "quiet", FALSE) 
+    && !program_context_get_boolean (context, "count", FALSE) 
+    && !program_context_get_boolean (context, "files-with-matches", FALSE) 
+    && !program_context_get_boolean (context, "files-without-match", FALSE);
+  }
+
+/*==========================================================================
+  program_context_lines
+
+  Returns the number of lines of context -- "before-context" or 
+    "after-context", according to name -- that the query whose options
+    are in context shows around each match. As in grep, -A and -B 
+    override -C, whichever order they are given in
+==========================================================================*/
+int program_context_lines (const ProgramContext *context, const char *name)
+  {
+  if (!program_shows_lines (context)) return 0;
+  int n = program_context_get_integer (context, name, -1);
+  if (n < 0) n = program_context_get_integer (context, "context", 0);
+  return n > 0 ? n : 0;
+  }
+
+/*==========================================================================
+  program_stops_at_first
+
+  Returns TRUE if a single match decides the outcome for a zipfile: with
+    --first, and also with --quiet, --files-with-matches and 
+    --files-without-match, where all that matters is whether the zipfile
+    matches at all
+==========================================================================*/
+BOOL program_stops_at_first (const ProgramContext *context)
+  {
+  return program_context_get_boolean (context, "first", FALSE) 
+    || program_context_get_boolean (context, "quiet", FALSE) 
+    || program_context_get_boolean (context, "files-with-matches", FALSE) 
+    || program_context_get_boolean (context, "files-without-match", FALSE);
   }
- 
 
 /*==========================================================================
   program_truncate_and_print_line
 
-  Fit a line of text to the width specified in the context, and
+  Fit a line of text, which need not be null-terminated, to the width
+    specified in the context, and
     (if output is to a console) highlight the text between the 
     specified start and end points.
 
@@ -175,25 +387,25 @@ BOOL program_is_utf8 (BYTE *data, int length)
     later.
 ==========================================================================*/
 void program_truncate_and_print_line (const ProgramContext *context, 
-      const UTF8 *line, int hi_start, int hi_end) 
+      FILE *out, const UTF8 *line, int line_length, int hi_start, 
+      int hi_end) 
     {
     LOG_IN
    
-    log_debug ("%s: %S", __PRETTY_FUNCTION__, line);
+    log_debug ("%s: %.*s", __PRETTY_FUNCTION__, line_length, line);
 
     int width = program_context_get_integer (context, "width", 0);
 
-    int line_length = strlen ((char *)line); 
     if (line_length < width || width == 0)
       {
       for (int i = 0; i < line_length; i++)
         {
-        if (i == hi_start) console_fg_colour (CC_RED, FALSE);
+        if (i == hi_start) program_colour (context, out, CC_RED);
         char c = line[i];
-        if (i == hi_end) console_fg_colour (CC_DEFAULT, FALSE);
-        putchar (c);
+        if (i == hi_end) program_colour (context, out, CC_DEFAULT);
+        putc (c, out);
         }
-      printf ("\n");
+      fputc ('\n', out);
       }
     else
       {
@@ -201,10 +413,10 @@ void program_truncate_and_print_line (const ProgramContext *context,
         {
         for (int i = 0; i < width; i++)
           {
-          if (i == hi_start) console_fg_colour (CC_RED, FALSE);
+          if (i == hi_start) program_colour (context, out, CC_RED);
           char c = line[i];
-          if (i == hi_end) console_fg_colour (CC_DEFAULT, FALSE);
-          putchar (c);
+          if (i == hi_end) program_colour (context, out, CC_DEFAULT);
+          putc (c, out);
           }
         }
       else if (hi_start > line_length - width / 2)
@@ -212,10 +424,10 @@ void program_truncate_and_print_line (const ProgramContext *context,
         for (int i = 0; i < width; i++)
           {
           int ps = line_length - width;
-          if (i == hi_start - ps) console_fg_colour (CC_RED, FALSE);
+          if (i == hi_start - ps) program_colour (context, out, CC_RED);
           char c = line[i + ps];
-          if (i == hi_end - ps) console_fg_colour (CC_DEFAULT, FALSE);
-          putchar (c);
+          if (i == hi_end - ps) program_colour (context, out, CC_DEFAULT);
+          putc (c, out);
           }
         }
       else 
@@ -223,167 +435,572 @@ void program_truncate_and_print_line (const ProgramContext *context,
         for (int i = 0; i < width; i++)
           {
           int ps = hi_start - width / 2;
-          if (i == hi_start - ps) console_fg_colour (CC_RED, FALSE);
+          if (i == hi_start - ps) program_colour (context, out, CC_RED);
           char c = line[i + ps];
-          if (i == hi_end - ps) console_fg_colour (CC_DEFAULT, FALSE);
-          putchar (c);
+          if (i == hi_end - ps) program_colour (context, out, CC_DEFAULT);
+          putc (c, out);
           }
         }
-      printf ("\n");
+      fputc ('\n', out);
       }
 
-  console_fg_colour (CC_DEFAULT, FALSE); // TOD -- only if changed
+  program_colour (context, out, CC_DEFAULT); // TOD -- only if changed
   
   LOG_OUT
   }
 
 
+/*==========================================================================
+  program_shows_count
+
+  Returns TRUE if the query whose options are in context reports the 
+    number of matches, rather than the matches themselves. --quiet and 
+    the --files- options take precedence over --count, as in grep
+==========================================================================*/
+BOOL program_shows_count (const ProgramContext *context)
+  {
+  return program_context_get_boolean (context, "count", FALSE) 
+    && !program_context_get_boolean (context, "quiet", FALSE) 
+    && !program_context_get_boolean (context, "files-with-matches", FALSE) 
+    && !program_context_get_boolean (context, "files-without-match", FALSE);
+  }
+
+/*==========================================================================
+  program_print_count
+
+  With --count, show the number of matching lines in an entry or, if 
+    int_filename is NULL, in a whole zipfile
+==========================================================================*/
+void program_print_count (const ProgramContext *context, FILE *out,
+       const char *zip_filename, const char *int_filename, int count)
+  {
+  if (!program_context_get_boolean (context, "no-filename", FALSE))
+    {
+    program_attribute (context, out, CA_BRIGHT);
+    fprintf (out, "%s:", zip_filename);
+    if (int_filename)
+      fprintf (out, "%s:", int_filename);
+    program_attribute (context, out, CA_NORMAL);
+    }
+  fprintf (out, "%d\n", count);
+  }
+
+/*==========================================================================
+  program_source_offset
+
+  Returns the offset in the entry of the byte at offset in the text that
+    is searched. They are the same unless markup is being stripped
+==========================================================================*/
+uint64_t program_source_offset (const Markup *markup, uint64_t offset)
+  {
+  return markup ? markup_source_offset (markup, offset) : offset;
+  }
+
+
 /*==========================================================================
   program_grep_binary
  
-  Search for the specified regex in the buffer. If found, display the
-    match, and return TRUE
+  Search for the specified regex in a buffer of non-text data. There is 
+    no meaningful way to divide it into lines, so the pattern is just run
+    over the whole buffer, as it is -- the regex engine doesn't mind 
+    nulls, so long as it's told the length. If there are several 
+    patterns, the one that matched is shown as well.
+
+  Normally, once we know that the buffer matches, there is nothing more
+    to say. But with --byte-offset, every match is reported, with its
+    offset in the entry; base is the offset of the buffer, and markup,
+    if not NULL, translates it to an offset in the entry.
+
+  The buffer is a window on the entry, as it is for text, but it's not
+    cut at the end of a line. Only matches that start at or after 
+    lines->next, and before length, are reported, but they may carry on
+    up to limit; the caller searches the rest again, with the next chunk.
+    The bytes before lines->next are there so that lookbehind, \b and ^
+    see what comes before. lines->next is left where the next search 
+    should start -- the end of the last match reported, or length --
+    and lines->limited is set if PCRE gives up, because the search needs 
+    more work than the limits allow.
+
+  If one match is all we need to know about, any match that ends before
+    limit will do, wherever it starts: more data can't make it any 
+    shorter, unless the pattern looks ahead, or at the end of the 
+    subject. So a binary entry can be decided before a whole overlap's 
+    worth of it has been decompressed.
+
+  Returns the number of matches reported
 ==========================================================================*/
-BOOL program_grep_binary (const ProgramContext *context, 
+int program_grep_binary (const ProgramContext *context, FILE *out,
        const char *zip_filename, const char *int_filename, 
-       const pcre *preg, const BYTE *buff, int length)
+       const Pattern *pattern, const BYTE *buff, int length, int limit,
+       uint64_t base, const Markup *markup, ProgramLines *lines)
   {
   LOG_IN
-  BOOL ret = FALSE;
-  char *buff2 = malloc (length + 1);
-  memcpy (buff2, buff, length);
-  buff2[length] = 0;
-  BOOL quiet = program_context_get_boolean (context, "quiet", FALSE);
-
+  int matches = 0;
+  BOOL show = program_shows_lines (context);
   BOOL no_entries = program_context_get_boolean 
           (context, "no-entryname", FALSE);
-
-  for (int i = 0; i < length; i++)
-    if (buff2[i] == 0) buff2[i] = ' ';
-
-  int pmatch[30];
-
-  int m = pcre_exec (preg, NULL, (const char *)buff2, 
-           length, 0, 0, pmatch, 30);
-  if (m > 0)
+  BOOL byte_offsets = show && program_context_get_boolean 
+          (context, "byte-offset", FALSE);
+
+  const char *b = (const char *)buff;
+  int start = lines->next - base;
+  // At the end of the entry, an empty match at the very end counts
+  int last = length < limit ? length - 1 : length;
+  BOOL any = !byte_offsets && !pattern_needs_lines (pattern);
+  BOOL stop = FALSE;
+  while (!stop && start <= (any ? limit : last))
     {
-    if (!quiet)
+    int pmatch[30];
+    int which = 0;
+    if (pattern_prefilter (pattern, b, limit, start) < 0) break;
+    int rc = pattern_exec (pattern, b, limit, start, PT_EXEC_DEFAULT, 
+      pmatch, 30, &which);
+    if (rc == PT_ERROR_LIMIT) lines->limited = TRUE;
+    if (rc < 0) break;
+    if (pmatch[0] > last && !(any && pmatch[1] < limit)) break;
+    matches++;
+    if (show)
       {
-      console_write_attribute (CA_BRIGHT, FALSE);
-      printf ("%s:", zip_filename);
+      program_attribute (context, out, CA_BRIGHT);
+      fprintf (out, "%s:", zip_filename);
       if (!no_entries)
-        printf ("%s:", int_filename);
-      console_write_attribute (CA_NORMAL, FALSE);
-      printf ("binary file matches\n");
+        fprintf (out, "%s:", int_filename);
+      if (byte_offsets)
+        fprintf (out, "%ld:", (long)program_source_offset (markup, 
+          base + pmatch[0]));
+      if (pattern_get_count (pattern) > 1)
+        fprintf (out, "%s:", pattern_get_text (pattern, which));
+      program_attribute (context, out, CA_NORMAL);
+      fputs ("binary file matches\n", out);
       }
-    ret = TRUE;
+    if (!byte_offsets) stop = TRUE;
+    // An empty match would be found again, at the same place
+    start = pmatch[1] > pmatch[0] ? pmatch[1] : pmatch[0] + 1;
+    lines->next = base + start;
     }
-  free (buff2);
+  if (!stop && lines->next < base + length) lines->next = base + length;
+
   LOG_OUT
-  return ret;
+  return matches;
+  }
+
+
+/*==========================================================================
+  program_count_lines
+  
+  Returns the number of line endings in the buffer
+==========================================================================*/
+int program_count_lines (const UTF8 *buff, int length)
+  {
+  return linecount_count ((const BYTE *)buff, length);
   }
 
 
 /*==========================================================================
-  program_grep_utf8_line
+  program_print_utf8_line
   
-  Search for the regular expression in the specified line. If 
-    found, display the result and return TRUE
+  Display a matching line, preceded by the zipfile name, entry name, 
+    line number, and the offset of the line in the entry, as the context 
+    dictates. The line need not be null-terminated. If hit is not NULL, 
+    it's the pattern that matched, which is shown after the other 
+    details. The details are followed by sep, which is ':' for a line 
+    that matches, and '-' for a line of context, as in grep.
 ==========================================================================*/
-BOOL program_grep_utf8_line (const ProgramContext *context, 
+void program_print_utf8_line (const ProgramContext *context, FILE *out,
        const char *zip_filename, const char *int_filename, 
-       const pcre *preg, const UTF8 *line, int line_number)
+       const UTF8 *line, int line_length, int line_number, 
+       uint64_t offset, int hi_start, int hi_end, const char *hit,
+       char sep)
   {
   LOG_IN
-  BOOL ret = FALSE;
-  BOOL quiet = program_context_get_boolean (context, "quiet", FALSE);
   BOOL line_numbers = program_context_get_boolean 
           (context, "line-number", FALSE);
+  BOOL byte_offsets = program_context_get_boolean 
+          (context, "byte-offset", FALSE);
   BOOL no_entries = program_context_get_boolean 
           (context, "no-entryname", FALSE);
 
-  int pmatch[30];
-  int m = pcre_exec (preg, NULL, (const char *)line, 
-           strlen ((char *)line), 0, 0, pmatch, 30);
-  if (m > 0)
+  if (!program_context_get_boolean (context, "no-filename", FALSE))
     {
-    ret = TRUE;
-    if (!quiet)
-      {
-      if (!program_context_get_boolean (context, "no-filename", FALSE))
-        {
-        console_write_attribute (CA_BRIGHT, FALSE);
-        printf ("%s:", zip_filename);
-        if (!no_entries)
-          printf ("%s:", int_filename);
-        if (line_numbers && !no_entries)
-          printf ("%d:", line_number);
-        console_write_attribute (CA_NORMAL, FALSE);
-        }
-    
-      program_truncate_and_print_line (context, line, 
-         pmatch[0], pmatch[1]);
-      }
+    program_attribute (context, out, CA_BRIGHT);
+    fprintf (out, "%s%c", zip_filename, sep);
+    if (!no_entries)
+      fprintf (out, "%s%c", int_filename, sep);
+    if (line_numbers && !no_entries)
+      fprintf (out, "%d%c", line_number, sep);
+    if (byte_offsets && !no_entries)
+      fprintf (out, "%ld%c", (long)offset, sep);
+    program_attribute (context, out, CA_NORMAL);
+    }
+
+  if (hit)
+    {
+    program_attribute (context, out, CA_BRIGHT);
+    fprintf (out, "%s:", hit);
+    program_attribute (context, out, CA_NORMAL);
     }
 
+  program_truncate_and_print_line (context, out, line, line_length,
+     hi_start, hi_end);
+
   LOG_OUT
-  return ret;
   }
 
+
+/*==========================================================================
+  program_line_number
+
+  Returns the number of the line that starts at offset pos in the entry,
+    which must be in the buffer, whose offset in the entry is base. Lines
+    are counted lazily, from wherever the last count stopped, so the
+    cost of line numbers is a single scan of the text that is searched,
+    done a vector at a time (see linecount.c). A line of leading context
+    might come before that point, in which case we count backwards 
+    instead.
+==========================================================================*/
+int program_line_number (ProgramLines *lines, const UTF8 *buff, 
+       uint64_t base, uint64_t pos)
+  {
+  if (pos < lines->counted)
+    return lines->number + 1 - program_count_lines 
+      (buff + (pos - base), lines->counted - pos);
+  lines->number += program_count_lines (buff + (lines->counted - base), 
+    pos - lines->counted);
+  lines->counted = pos;
+  return lines->number + 1;
+  }
+
+
+/*==========================================================================
+  program_print_context
+
+  Show lines of context, from offset from up to (but not including) 
+    offset to, in a buffer whose offset in the entry is base. from is
+    always the start of a line. If max is not negative, at most that 
+    many lines are shown, and it is decreased by the number shown.
+    The lines are shown where they are, in the buffer; nothing is
+    copied.
+==========================================================================*/
+void program_print_context (const ProgramContext *context, FILE *out,
+       const char *zip_filename, const char *int_filename, 
+       const UTF8 *buff, uint64_t base, int from, int to, 
+       BOOL line_numbers, const Markup *markup, ProgramLines *lines, 
+       int *max)
+  {
+  const char *b = (const char *)buff;
+  while (from < to && (!max || *max > 0))
+    {
+    const char *nl = memchr (b + from, '\n', to - from);
+    int line_end = nl ? nl - b : to;
+    int line_length = line_end - from;
+    const char *nul = memchr (b + from, 0, line_length);
+    if (nul) line_length = nul - b - from;
+    int line_number = line_numbers ? 
+      program_line_number (lines, buff, base, base + from) : 0;
+    program_print_utf8_line (context, out, zip_filename, int_filename, 
+      buff + from, line_length, line_number, 
+      program_source_offset (markup, base + from), -1, -1, NULL, '-');
+    from = nl ? line_end + 1 : to;
+    lines->shown = base + from;
+    if (max) (*max)--;
+    }
+  }
+
+
 /*==========================================================================
   program_grep_utf8
-  Split the data buffer into lines, and scan each one. This whole thing
-    needs to be tidied up so as to avoid possibly mistaking part of a 
-    multi-byte character for a end-of-line. The easiest way to do this
-    would be to convert the entire buffer into UTF32 and do the processing
-    with integers rather than bytes; but this wil be very memory 
-    intensive. Moreover, the regex library only works with byte-size
-    characters, so we would have to convert repeatedly. 
+  Search a buffer of text for lines that match, and display them. The 
+    regular expression is compiled in multi-line mode, and run over the 
+    whole buffer, not line by line. Only when it matches do we work out 
+    which line the match is in, and then carry on from the start of the 
+    next line. So nothing is copied, and the cost of a line that does not
+    match is just the cost of the regex engine scanning it.
+
+  A match found this way might run over the end of its line, or (if the
+    line contains a null) past the point where the per-line search would
+    have stopped. In that case the search is repeated on the line alone,
+    which decides whether the line matches.
+
+  If the pattern contains a literal that every match must include, we
+    don't run the regex engine over the whole buffer -- just over each 
+    line that the prefilter finds the literal in. As before, empty lines never
+    match, and a line is only searched as far as its first null. A 
+    pattern that could match differently in a line and in the buffer 
+    around it -- one with \A or lookbehind, for example -- is run over
+    every line on its own.
+
+  This whole thing still needs to be tidied up so as to avoid possibly 
+    mistaking part of a multi-byte character for a end-of-line. 
+
+  If valid_utf8 is TRUE, the buffer has been checked, so the regex 
+    engine need not check it again.
+
+  The buffer need not be a whole entry -- it can be any run of whole
+    lines from it, the last of which might be incomplete. base is the
+    offset of the buffer in the entry. The first 'searched' bytes of the
+    buffer have been searched already, and are only there to provide 
+    leading context (-B). lines holds the state of the search that is
+    carried from one buffer to the next: the line count, if line numbers
+    are shown, and how much trailing context (-A) is still to be shown.
+    Lines of context are found by their offsets in the buffer, only when
+    there is a match for them to surround, and printed from where they 
+    are. If PCRE gives up, because the search needs more work than the
+    limits allow, the search stops, and lines->limited is set.
   
   This funnction returns the number of lines that match.
 ==========================================================================*/
-int program_grep_utf8 (const ProgramContext *context, 
+int program_grep_utf8 (const ProgramContext *context, FILE *out,
        const char *zip_filename, const char *int_filename, 
-       const pcre *preg, const UTF8 *buff, int length)
+       const Pattern *pattern, const UTF8 *buff, int length, int searched,
+       uint64_t base, BOOL valid_utf8, const Markup *markup, 
+       ProgramLines *lines)
   {
   LOG_IN
   int matches = 0;
+  BOOL show = program_shows_lines (context);
+  BOOL first = program_stops_at_first (context);
+  BOOL line_numbers = show && program_context_get_boolean 
+          (context, "line-number", FALSE);
+  int before = program_context_lines (context, "before-context");
+  int after = program_context_lines (context, "after-context");
+  // As in grep, groups of lines are separated if any context is asked
+  //   for, even none
+  BOOL separate = program_context_get (context, "after-context") ||
+    program_context_get (context, "before-context") ||
+    program_context_get (context, "context");
+
+  const char *b = (const char *)buff;
+  int offset = searched; // Always the start of a line
   BOOL stop = FALSE;
-  BOOL quiet = program_context_get_boolean (context, "quiet", FALSE);
-  BOOL first = program_context_get_boolean (context, "first", FALSE);
 
-  char *b = (char *)buff;
-  char *lastb = b;
-  int lines = 0;
-  int i = 0;
+  BOOL prefilter = pattern_has_prefilter (pattern);
+  BOOL by_line = pattern_needs_lines (pattern);
+  int flags = valid_utf8 ? PT_EXEC_VALID_UTF8 : PT_EXEC_DEFAULT;
 
-  do 
+  while (offset < length && !stop && !lines->limited)
     {
-    char c = 0;
-    if (i != length) c = *b;
-    if (c == (char) '\n' || i == length)
+    // With a prefilter, the line to search is the next one that contains
+    //   the required literal, and if the pattern needs lines searched 
+    //   one by one, it's the next line. Otherwise it's the line that the
+    //   next match starts in. A match that starts with the newline itself
+    //   belongs to the line that the newline ends
+    int pmatch[30];
+    int start;
+    int which = 0;
+    BOOL matched = FALSE; // pmatch holds a match in the buffer
+    if (prefilter)
+      start = pattern_prefilter (pattern, b, length, offset);
+    else if (by_line)
+      start = offset;
+    else
+      {
+      int rc = pattern_exec (pattern, b, length, offset, flags, pmatch, 30,
+        &which);
+      if (rc == PT_ERROR_LIMIT) lines->limited = TRUE;
+      matched = rc >= 0;
+      start = matched ? pmatch[0] : -1;
+      }
+    if (start < 0) break;
+
+    const char *nl = memrchr (b + offset, '\n', start - offset);
+    int line_start = nl ? nl - b + 1 : offset;
+    nl = memchr (b + start, '\n', length - start);
+    int line_end = nl ? nl - b : length;
+
+    int line_length = line_end - line_start;
+    const char *nul = memchr (b + line_start, 0, line_length);
+    if (nul) line_length = nul - b - line_start;
+
+    BOOL found = FALSE;
+    int hi_start = 0, hi_end = 0;
+    if (line_end > line_start)
+      {
+      if (matched && pmatch[1] <= line_start + line_length)
+        {
+        found = TRUE;
+        hi_start = start - line_start;
+        hi_end = pmatch[1] - line_start;
+        }
+      else
+        {
+        int rc = pattern_exec (pattern, b + line_start, line_length, 0, 
+          flags, pmatch, 30, &which);
+        if (rc == PT_ERROR_LIMIT) lines->limited = TRUE;
+        if (rc >= 0)
+          {
+          found = TRUE;
+          hi_start = pmatch[0];
+          hi_end = pmatch[1];
+          }
+        }
+      }
+
+    if (found)
       {
-      lines++;
-      int linelen = b - lastb;
-      if (linelen > 0)
+      matches++;
+      if (show)
         {
-        char *line = malloc ((linelen + 1) * sizeof (char));
-        memcpy (line, lastb, linelen * sizeof (char));
-        line[linelen] = 0;
-        if (line[0] != (char)'\n')
+        // Whatever is left of the trailing context of the last match,
+        //   then the leading context of this one, which starts no 
+        //   earlier than the end of the last line shown
+        int shown = lines->shown > base ? lines->shown - base : 0;
+        program_print_context (context, out, zip_filename, int_filename, 
+          buff, base, shown, line_start, line_numbers, markup, lines, 
+          &lines->after);
+        int from = line_start;
+        for (int i = 0; i < before && from > 0; i++)
           {
-          if (program_grep_utf8_line (context, zip_filename, int_filename, 
-                preg, (UTF8 *)line, lines))
-            matches++;
+          nl = memrchr (b, '\n', from - 1);
+          from = nl ? nl - b + 1 : 0;
           }
-        free (line);
+        if (base + from < lines->shown) from = lines->shown - base;
+        if (separate && lines->any && 
+            base + from > lines->shown)
+          fputs ("--\n", out);
+        program_print_context (context, out, zip_filename, int_filename, 
+          buff, base, from, line_start, line_numbers, markup, lines, 
+          NULL);
+
+        int line_number = line_numbers ? 
+          program_line_number (lines, buff, base, base + line_start) : 0;
+        program_print_utf8_line (context, out, zip_filename, 
+           int_filename, buff + line_start, line_length, line_number, 
+           program_source_offset (markup, base + line_start), hi_start, 
+           hi_end, pattern_get_count (pattern) > 1 ? 
+           pattern_get_text (pattern, which) : NULL, ':');
+        lines->shown = base + (line_end < length ? line_end + 1 : length);
+        lines->after = after;
+        lines->any = TRUE;
+        }
+      if (first) stop = TRUE;
+      }
+
+    offset = line_end + 1;
+    } 
+
+  if (show && lines->after > 0)
+    {
+    int shown = lines->shown > base ? lines->shown - base : 0;
+    program_print_context (context, out, zip_filename, int_filename, 
+      buff, base, shown, length, line_numbers, markup, lines, 
+      &lines->after);
+    }
+  if (line_numbers && !stop && !lines->limited)
+    program_line_number (lines, buff, base, base + length);
+  LOG_OUT
+  return matches;
+  }
+
+
+/*==========================================================================
+  program_grep_multiline
+
+  With --multiline, search a buffer of text for matches that might span
+    several lines. Each match is shown along with the rest of the lines
+    that it starts and ends in, and the search carries on from the line
+    after those, as pcregrep -M does. So one match is one "line", as
+    far as counting, context, and so on are concerned.
+
+  Only matches that start in the first length bytes of the buffer are
+    reported, but they may carry on up to limit. The caller makes sure
+    there is enough of the entry beyond length -- the overlap -- for the
+    longest match that must not be missed, and the rest is searched 
+    again, with the next chunk. If the lines of a match carry on past 
+    length, lines->next records where they end, so nothing in them is 
+    reported again.
+
+  Otherwise this works as program_grep_utf8 does, and takes the same
+    arguments.
+==========================================================================*/
+int program_grep_multiline (const ProgramContext *context, FILE *out,
+       const char *zip_filename, const char *int_filename, 
+       const Pattern *pattern, const UTF8 *buff, int length, int limit, 
+       int searched, uint64_t base, BOOL valid_utf8, const Markup *markup,
+       ProgramLines *lines)
+  {
+  LOG_IN
+  int matches = 0;
+  BOOL show = program_shows_lines (context);
+  BOOL first = program_stops_at_first (context);
+  BOOL line_numbers = show && program_context_get_boolean 
+          (context, "line-number", FALSE);
+  int before = program_context_lines (context, "before-context");
+  int after = program_context_lines (context, "after-context");
+  BOOL separate = program_context_get (context, "after-context") ||
+    program_context_get (context, "before-context") ||
+    program_context_get (context, "context");
+
+  const char *b = (const char *)buff;
+  int offset = searched; // Always the start of a line
+  if (lines->next > base + offset) offset = lines->next - base;
+  BOOL stop = FALSE;
+  int flags = valid_utf8 ? PT_EXEC_VALID_UTF8 : PT_EXEC_DEFAULT;
+
+  while (offset < length && !stop)
+    {
+    // If the required literal isn't in the rest of the buffer, nothing
+    //   that starts in it can match
+    int pmatch[30];
+    int which = 0;
+    if (pattern_prefilter (pattern, b, limit, offset) < 0) break;
+    int rc = pattern_exec (pattern, b, limit, offset, flags, pmatch, 30, 
+      &which);
+    if (rc == PT_ERROR_LIMIT) lines->limited = TRUE;
+    if (rc < 0 || pmatch[0] >= length) break;
+
+    const char *nl = memrchr (b + offset, '\n', pmatch[0] - offset);
+    int line_start = nl ? nl - b + 1 : offset;
+    // The line that the last character of the match is in
+    int last = pmatch[1] > pmatch[0] ? pmatch[1] - 1 : pmatch[0];
+    nl = memchr (b + last, '\n', limit - last);
+    int line_end = nl ? nl - b : limit;
+
+    matches++;
+    if (show)
+      {
+      int shown = lines->shown > base ? lines->shown - base : 0;
+      program_print_context (context, out, zip_filename, int_filename, 
+        buff, base, shown, line_start, line_numbers, markup, lines, 
+        &lines->after);
+      int from = line_start;
+      for (int i = 0; i < before && from > 0; i++)
+        {
+        nl = memrchr (b, '\n', from - 1);
+        from = nl ? nl - b + 1 : 0;
         }
-      lastb = b + 1; // Skip over the \n so it is not included
+      if (base + from < lines->shown) from = lines->shown - base;
+      if (separate && lines->any && base + from > lines->shown)
+        fputs ("--\n", out);
+      program_print_context (context, out, zip_filename, int_filename, 
+        buff, base, from, line_start, line_numbers, markup, lines, NULL);
+
+      int line_number = line_numbers ? 
+        program_line_number (lines, buff, base, base + line_start) : 0;
+      program_print_utf8_line (context, out, zip_filename, 
+         int_filename, buff + line_start, line_end - line_start, 
+         line_number, program_source_offset (markup, base + line_start), 
+         pmatch[0] - line_start, pmatch[1] - line_start, 
+         pattern_get_count (pattern) > 1 ? 
+         pattern_get_text (pattern, which) : NULL, ':');
+      lines->shown = base + (line_end < limit ? line_end + 1 : limit);
+      lines->after = after;
+      lines->any = TRUE;
       }
-    b++;
-    i++;
-    if (matches > 0 && (quiet || first)) stop = TRUE;
-    } while (i <= length && !stop);
+    if (first) stop = TRUE;
+
+    offset = line_end + 1;
+    lines->next = base + offset;
+    } 
+
+  if (show && lines->after > 0)
+    {
+    int shown = lines->shown > base ? lines->shown - base : 0;
+    program_print_context (context, out, zip_filename, int_filename, 
+      buff, base, shown, length, line_numbers, markup, lines, 
+      &lines->after);
+    }
+  if (line_numbers && !stop && !lines->limited)
+    program_line_number (lines, buff, base, base + length);
   LOG_OUT
   return matches;
   }
@@ -394,58 +1011,379 @@ int program_grep_utf8 (const ProgramContext *context,
   
   Process a specific entry from the zipfile, which may be text or non-text,
     but at this point is assumed to be a viable target (entry filename
-    matches, etc); 
+    matches, etc) for each query that is selected. 
+
+  The entry is decompressed a chunk at a time into a window buffer. After
+    each chunk, the whole lines at the start of the window are searched,
+    and any partial line at the end is moved to the start of the window,
+    to be completed by the next chunk. So the memory needed depends on
+    the chunk size and the longest line, not on the size of the entry.
+    A line longer than PROGRAM_MAX_LINE is split, and searched in pieces.
+    Binary data isn't held back to the end of a line at all: once no 
+    query is searching the entry as text, each window is searched as it
+    is, and the last --max-match bytes are searched again with the next
+    chunk.
+    With -B, the last few lines of a window are kept for the next one,
+    to provide leading context for a match near its start. With 
+    --multiline, the end of the window is searched again with the next
+    chunk, so that a match is not missed just because it is split
+    between chunks.
+
+  The first chunk decides whether the entry is text: it is, if the chunk
+    is valid UTF-8 (allowing for a character cut short at the end). 
+    After that, each window is checked before it is searched, so the 
+    regex engine needn't check it again. If a text entry turns out not 
+    to be UTF-8 after all, the rest of it is treated as binary, as grep 
+    does. Nothing is searched as text that has not been checked, unless
+    --text says it's text anyway.
+
+  Before that, the first chunk is checked for UTF-16, by its byte order
+    mark or, failing that, by its pattern of nulls. A UTF-16 entry is 
+    converted to UTF-8 a chunk at a time, as it is decompressed, and is
+    then searched just like any other text. Line numbers are unchanged
+    by that, but offsets are offsets in the converted text.
+
+  Decompression is driven by the search: nothing more is inflated once
+    the outcome for the entry is known. If that can be decided by a 
+    single match, we start with small chunks, so a match near the start
+    of a large entry costs very little.
  
-  Returns the number of matching lines for a text entry, and either 0
-    or 1 for a non-text entry
+  In batch mode, the entry is decompressed only once, however many 
+    queries select it. Each window is searched for each query in turn, 
+    and decompression stops when the outcome is known for all of them.
+    The matches for each query go to its own stream in outs.
+
+  If prefetch is not NULL, the entry has been decompressed ahead of time
+    by the prefetch thread, and the data is taken from there.
+
+  If strip is TRUE, the entry is (X)HTML or XML, and the markup is 
+    stripped from each chunk as it is decompressed (--text-only), so 
+    the window holds just the text. Line numbers are unchanged by that,
+    but offsets have to be translated back to offsets in the entry.
+
+  If PCRE gives up on a query, because the search needs more work than
+    --match-limit or --recursion-limit allows, the rest of the entry is
+    skipped for that query, with a warning, and the entry is counted in
+    the query's statistics.
+
+  The number of matching lines for a text entry, or 1 if a non-text entry
+    matches, is added to the count for each query in matches
 ==========================================================================*/
-int program_do_entry (const ProgramContext *context, const ZipFile *z,
-       const pcre *preg, int n)
+void program_do_entry (const ProgramRun *run, FILE **outs, 
+       const ZipFile *z, int n, Prefetch *prefetch, const BOOL *selected,
+       BOOL strip, int *matches)
   {
   LOG_IN
-  int matches = 0;
-  uint64_t size;
-  char int_filename[PATH_MAX];
+  const char *int_filename = zipfile_get_entry_name (z, n);
   const char *zip_filename = zipfile_get_filename (z);
+  int num_queries = run->num_queries;
+
+  // The state of the search of this entry, for each query
+  int *found = calloc (num_queries, sizeof (int));
+  ProgramLines *lines = calloc (num_queries, sizeof (ProgramLines));
+  BOOL *text = malloc (num_queries * sizeof (BOOL));
+  BOOL *done = malloc (num_queries * sizeof (BOOL));
+  BOOL first = TRUE; // One match decides the outcome for every query
+  int before = 0; // The most lines of leading context any query shows
+  uint64_t overlap = 0; // The longest match that must not be missed
+  uint64_t binary_overlap = 0; // The same, if the entry is binary
+  for (int q = 0; q < num_queries; q++)
+    {
+    text[q] = TRUE;
+    done[q] = !selected[q];
+    if (!selected[q]) continue;
+    const ProgramContext *context = run->queries[q].context;
+    if (!run->queries[q].first) first = FALSE;
+    int b = program_context_lines (context, "before-context");
+    if (b > before) before = b;
+    uint64_t m = program_context_get_int64 (context, "max-match", 
+      PROGRAM_MAX_MATCH);
+    if (program_context_get_boolean (context, "multiline", FALSE) &&
+        m > overlap) 
+      overlap = m;
+    if (m > binary_overlap) binary_overlap = m;
+    }
+  if (overlap > PROGRAM_MAX_LINE / 2) overlap = PROGRAM_MAX_LINE / 2;
+  if (binary_overlap > PROGRAM_MAX_LINE / 2) 
+    binary_overlap = PROGRAM_MAX_LINE / 2;
 
-  zipfile_get_entry_details (z, n, int_filename, 
-        sizeof (int_filename), &size); 
-  
-  BOOL force_text = program_context_get_boolean (context, "text", 
-         FALSE);
-
-  BYTE *buff = NULL;
-  uint64_t length;
-  ZipError error = zipfile_extract_to_memory (z, n, &buff, &length);
+  ZipStream *stream = NULL;
+  ZipError error = prefetch ? prefetch_open (prefetch, n) 
+    : zipfile_stream_open (z, n, &stream);
   if (!error)
     {
-    if (program_is_utf8 (buff, length) || force_text) 
-      {
-      log_debug ("Assuming %s is UTF8", int_filename);
-      matches += program_grep_utf8 (context, zip_filename, int_filename, 
-                   preg, buff, length);
-      }
-    else
+    // No point allocating a whole chunk for a small entry. The size in
+    //   the index might be wrong, but that only matters for efficiency
+    uint64_t capacity = PROGRAM_CHUNK_SIZE;
+    uint64_t size = zipfile_get_entry_size (z, n);
+    if (size < capacity) capacity = size + 1;
+    BYTE *window = malloc (capacity);
+    Markup *markup = strip ? markup_create () : NULL;
+    BYTE *raw = strip ? malloc (PROGRAM_CHUNK_SIZE) : NULL;
+    // Stripping markup can produce a little more than it is given
+    uint64_t reserve = strip ? MARKUP_MAX_PENDING : 0;
+    Utf16 *utf16 = NULL;
+    BYTE *decoded = NULL; // UTF-16 converted, waiting to be stripped
+    uint64_t length = 0; 
+    uint64_t offset = 0; // Of the window, in the entry or its text
+    uint64_t kept = 0; // Lines at the start of the window already searched
+    BOOL eof = FALSE;
+    BOOL stop = FALSE;
+    BOOL decided = FALSE;
+    uint64_t chunk = first ? PROGRAM_FIRST_CHUNK : PROGRAM_CHUNK_SIZE;
+
+    while (!eof && !stop && !error)
       {
-      BOOL do_binary = TRUE;
-      if (program_context_get_boolean (context, "no-binary", FALSE)) 
-        do_binary = FALSE;
-      if (do_binary)
+      // Converting UTF-16 needs room for at least one code unit
+      uint64_t least = utf16 ? 3 : 0;
+      if (length + reserve + least >= capacity)
+        {
+        // The window is full, and holds no complete line
+        while (length + reserve + least >= capacity) capacity *= 2;
+        window = realloc (window, capacity);
+        }
+      uint64_t want = capacity - length - reserve;
+      // Each two bytes of UTF-16 can become three of UTF-8
+      if (utf16) want = want / 3 * 2;
+      if (want > chunk) want = chunk;
+      uint64_t got = 0;
+      BYTE *to = strip || utf16 ? raw : window + length;
+      if (prefetch)
+        error = prefetch_read (prefetch, to, want, &got);
+      else
+        error = zipfile_stream_read (stream, to, want, &got);
+      if (got < want) eof = TRUE;
+
+      size_t bom = 0;
+      Utf16Order order = decided ? UTF16_NONE : utf16_detect (to, got, &bom);
+      if (order != UTF16_NONE)
+        {
+        log_debug ("%s is UTF-16%s", int_filename, 
+          order == UTF16_LE ? "LE" : "BE");
+        utf16 = utf16_create (order);
+        reserve += UTF16_MAX_OUTPUT (0);
+        if (!raw)
+          {
+          raw = malloc (PROGRAM_CHUNK_SIZE);
+          memcpy (raw, to, got);
+          }
+        if (strip) decoded = malloc (UTF16_MAX_OUTPUT (PROGRAM_CHUNK_SIZE));
+        to = raw + bom;
+        got -= bom;
+        // This chunk was read without allowing for the conversion
+        if (length + reserve + UTF16_MAX_OUTPUT (got) > capacity)
+          {
+          while (length + reserve + UTF16_MAX_OUTPUT (got) > capacity) 
+            capacity *= 2;
+          window = realloc (window, capacity);
+          }
+        }
+
+      if (utf16)
         {
-        matches += program_grep_binary (context, zip_filename, 
-                     int_filename, preg, buff, length);
+        BYTE *out = strip ? decoded : window + length;
+        got = utf16_decode (utf16, to, got, out, eof);
+        to = out;
         }
+      if (strip)
+        length += markup_strip (markup, to, got, window + length, eof);
       else
-        log_debug ("Skipping binary file %s", int_filename);
+        length += got;
+      if (chunk < PROGRAM_CHUNK_SIZE) chunk *= 2;
+
+      if (!decided)
+        {
+        decided = TRUE;
+        size_t incomplete = 0;
+        BOOL utf8 = utf8_classify (window, length, 
+          eof ? NULL : &incomplete) != UTF8_INVALID;
+        for (int q = 0; q < num_queries; q++)
+          {
+          if (done[q]) continue;
+          const ProgramContext *context = run->queries[q].context;
+          if (utf8 || program_context_get_boolean (context, "text", FALSE))
+            log_debug ("Assuming %s is UTF8", int_filename);
+          else if (program_context_get_boolean (context, "no-binary", 
+              FALSE))
+            {
+            log_debug ("Skipping binary file %s", int_filename);
+            done[q] = TRUE;
+            }
+          else
+            text[q] = FALSE;
+          }
+        }
+
+      BOOL lines_needed = FALSE; // Some query is searching text
+      BOOL binary = FALSE; // Some query is searching binary data
+      for (int q = 0; q < num_queries; q++)
+        {
+        if (done[q]) continue;
+        if (text[q]) 
+          lines_needed = TRUE;
+        else
+          binary = TRUE;
+        }
+
+      // Search up to the end of the last complete line, or the whole
+      //   window if we are at the end of the entry, or the window can't 
+      //   grow any more
+      uint64_t end = length;
+      if (lines_needed && !eof && length < PROGRAM_MAX_LINE)
+        {
+        BYTE *nl = memrchr (window + kept, '\n', length - kept);
+        end = nl ? nl - window + 1 : 0;
+        }
+
+      // With --multiline, a match can go on past the end of a line, so
+      //   only matches that start at least 'overlap' bytes before the 
+      //   end of the window are searched for now; the rest of the window
+      //   is searched again, when more has been added to it. For
+      //   simplicity, all text queries search up to the same point. 
+      //   Binary data has no lines to wait for the end of, and is 
+      //   searched the same way, as it arrives, up to binary_cut. Each
+      //   binary query carries on from where it got to, which is not 
+      //   necessarily where the text queries did
+      uint64_t binary_cut = length;
+      if (!eof) 
+        binary_cut = length > binary_overlap ? length - binary_overlap : 0;
+      uint64_t cut = end;
+      if (!lines_needed && !eof)
+        cut = binary_cut > kept ? binary_cut : kept;
+      else if (overlap > 0 && !eof && length < PROGRAM_MAX_LINE)
+        {
+        cut = kept;
+        if (end > kept + overlap)
+          {
+          BYTE *nl = memrchr (window + kept, '\n', end - overlap - kept);
+          if (nl) cut = nl - window + 1;
+          }
+        }
+
+      // A binary match that is sure not to be cut short by the end of the
+      //   window decides the outcome, if one match is enough, so binary
+      //   queries search what they can, even if it's before binary_cut,
+      //   and the text queries have no new lines to search
+      if ((cut > kept || binary) && !error)
+        {
+        BOOL lines_due = cut > kept;
+        if (!lines_due) cut = kept;
+        // A window that ends part-way through a line might end part-way
+        //   through a character, too
+        size_t incomplete = 0;
+        Utf8Class utf8 = lines_needed && lines_due ? utf8_classify (window, 
+          end, end == length && !eof ? &incomplete : NULL) : UTF8_INVALID;
+        for (int q = 0; q < num_queries; q++)
+          {
+          if (done[q] || (text[q] && !lines_due)) continue;
+          const ProgramQuery *query = &run->queries[q];
+          if (text[q] && utf8 == UTF8_INVALID && 
+              !program_context_get_boolean (query->context, "text", FALSE))
+            {
+            log_debug ("%s is not UTF8 after all", int_filename);
+            text[q] = FALSE;
+            if (lines[q].next < offset + kept) lines[q].next = offset + kept;
+            if (program_context_get_boolean (query->context, "no-binary",
+                FALSE))
+              {
+              done[q] = TRUE;
+              continue;
+              }
+            }
+          BOOL valid = utf8 != UTF8_INVALID && incomplete == 0;
+          if (text[q] && program_context_get_boolean (query->context, 
+                "multiline", FALSE))
+            found[q] += program_grep_multiline (query->context, outs[q], 
+               zip_filename, int_filename, query->pattern, window, cut, 
+               end, kept, offset, valid, markup, &lines[q]);
+          else if (text[q])
+            found[q] += program_grep_utf8 (query->context, outs[q], 
+               zip_filename, int_filename, query->pattern, window, cut, 
+               kept, offset, valid, markup, &lines[q]);
+          else
+            {
+            int hits = program_grep_binary (query->context, outs[q], 
+               zip_filename, int_filename, query->pattern, window, 
+               binary_cut, length, offset, markup, &lines[q]);
+            // Once a binary entry matches, there is nothing more to 
+            //   report, unless each match is reported with its offset
+            found[q] += hits;
+            if (hits > 0 && (!program_shows_lines (query->context) ||
+                  !program_context_get_boolean (query->context, 
+                  "byte-offset", FALSE)))
+              done[q] = TRUE;
+            }
+          if (found[q] > 0 && query->first) done[q] = TRUE;
+          if (lines[q].limited) done[q] = TRUE;
+          }
+
+        // Keep the last few lines that have been searched, if they are
+        //   not too long, as leading context for a match in the next 
+        //   window. Keep whatever binary queries have still to search,
+        //   too, with enough before it for lookbehind
+        uint64_t from = cut;
+        for (int i = 0; i < before && from > 0 && lines_needed; i++)
+          {
+          BYTE *nl = memrchr (window, '\n', from - 1);
+          uint64_t line_start = nl ? nl - window + 1 : 0;
+          if (cut - line_start > PROGRAM_MAX_CONTEXT) break;
+          from = line_start;
+          }
+        for (int q = 0; q < num_queries; q++)
+          {
+          if (done[q] || text[q]) continue;
+          uint64_t next = lines[q].next - offset;
+          next = next > PROGRAM_LOOKBEHIND ? next - PROGRAM_LOOKBEHIND : 0;
+          if (next < from) from = next;
+          }
+        memmove (window, window + from, length - from);
+        length -= from;
+        offset += from;
+        kept = cut - from;
+        if (markup) markup_forget (markup, offset);
+        }
+
+      stop = TRUE;
+      for (int q = 0; q < num_queries && stop; q++)
+        if (!done[q]) stop = FALSE;
       }
+
+    free (window);
+    free (raw);
+    free (decoded);
+    utf16_destroy (utf16);
+    markup_destroy (markup);
+    if (prefetch)
+      prefetch_close (prefetch);
+    else
+      zipfile_stream_close (stream);
     }
-  else log_warning ("%s!%s: %s", zip_filename, int_filename, 
-        program_zip_strerror (error));
 
-  if (buff) free (buff);
+  if (error)
+    log_warning ("%s!%s: %s", zip_filename, int_filename, 
+        program_zip_strerror (error));
 
+  for (int q = 0; q < num_queries; q++)
+    {
+    const ProgramContext *context = run->queries[q].context;
+    if (lines[q].limited)
+      {
+      log_warning ("%s!%s: Skipped the rest of the entry: the regular "
+        "expression needs too much work (see --match-limit)", zip_filename,
+        int_filename);
+      __atomic_add_fetch (&run->queries[q].limited, 1, __ATOMIC_RELAXED);
+      }
+    if (found[q] > 0 && program_shows_count (context) &&
+        !program_context_get_boolean (context, "no-entryname", FALSE))
+      program_print_count (context, outs[q], zip_filename, int_filename,
+        found[q]);
+    matches[q] += found[q];
+    }
+  free (found);
+  free (lines);
+  free (text);
+  free (done);
   LOG_OUT
-  return matches;
   }
 
 
@@ -504,39 +1442,34 @@ BOOL program_match_filename (const ProgramContext *context,
 /*==========================================================================
   program_consider_entry
   
-  Consider unpacking the n'th entry in ZipFile z and, if the entry 
-    filename matches the inclusion criteria, send it for searching
+  Returns TRUE if the n'th entry in ZipFile z is to be searched for
+    a query: if the entry filename matches the query's inclusion 
+    criteria, and the entry is not too large. In batch mode, the zipfile 
+    has been chosen for all the queries together, so its name has to 
+    match the query's --files as well. If warn is TRUE, complain about
+    an entry that is too large.
 
   By the time this method is called, we have already established that the
     zipfile is valid, and the entry is of non-zero size.
-
-  Returns the number of matches found in those files that were actually
-    searched.
 ==========================================================================*/
-int program_consider_entry (const ProgramContext *context, const ZipFile *z,
-       const pcre *preg, int n, BOOL *did_something)
+BOOL program_consider_entry (const ProgramRun *run, 
+       const ProgramQuery *query, const ZipFile *z, int n, BOOL warn)
   {
   LOG_IN
-  int matches = 0;
-  uint64_t size;
-  char int_filename[PATH_MAX];
+  BOOL ret = FALSE;
+  const ProgramContext *context = query->context;
+  const char *int_filename = zipfile_get_entry_name (z, n);
+  uint64_t size = zipfile_get_entry_size (z, n);
   const char *zip_filename = zipfile_get_filename (z);
 
-  zipfile_get_entry_details (z, n, int_filename, 
-        sizeof (int_filename), &size); 
-
-  if (program_match_filename (context, int_filename, TRUE))
+  if (program_match_filename (context, int_filename, TRUE) && 
+      (!run->batch || program_match_filename (context, zip_filename, FALSE)))
     {
     uint64_t max_size = program_context_get_int64 (context, 
-      "max-size", 1024*1024); 
-    if (size <= max_size)
-      {
-      // We can't put it off any longer -- we have to unpack
-      //   and grep this entry
-      *did_something = TRUE;
-      matches += program_do_entry (context, z, preg, n);
-      }
-    else
+      "max-size", 0); 
+    if (max_size == 0 || size <= max_size)
+      ret = TRUE;
+    else if (warn)
       {
       char *ss = numberformat_size_64 (size, ",", TRUE);
       log_warning ("%s!%s is too large (%s)", zip_filename, 
@@ -544,35 +1477,506 @@ int program_consider_entry (const ProgramContext *context, const ZipFile *z,
       free (ss);
       }
     }
-  else
-    {
-    log_debug ("Skipping non-matching entry: %s: %s\n", 
-      zip_filename, int_filename);
-    }
 
   LOG_OUT
-  return matches;
+  return ret;
   }
 
 
 /*==========================================================================
-  program_do_file
+  program_is_searchable
 
-  Process a specific zipfile, examining each entry and, if it meets 
-   certain criteria, sending it for further examination.
-
-  Returns the total number of matches
+  Returns TRUE if the n'th entry in ZipFile z would be searched for
+    any query. Unlike program_consider_entry(), this function does not
+    complain about entries that are too large.
 ==========================================================================*/
-int program_do_file (const ProgramContext *context, const pcre *preg,
-    const Path *path, BOOL *did_something)
+BOOL program_is_searchable (const ProgramRun *run, const ZipFile *z, int n)
   {
   LOG_IN
-
-  log_debug ("%s: path=%s", __PRETTY_FUNCTION__, path);
-
-  int matches = 0;
-  char *s_path = (char *)path_to_utf8 (path);
-  ZipFile *z = zipfile_create (s_path);
+  BOOL ret = FALSE;
+  if (zipfile_get_entry_size (z, n) != 0)
+    {
+    for (int q = 0; q < run->num_queries && !ret; q++)
+      ret = program_consider_entry (run, &run->queries[q], z, n, FALSE);
+    }
+  LOG_OUT
+  return ret;
+  }
+
+
+/*==========================================================================
+  program_is_markup
+
+  Returns TRUE if an entry is (X)HTML or XML, by its name, so that 
+    --text-only applies to it. That covers the text of EPUB and ODF 
+    files, and of Microsoft Office files too
+==========================================================================*/
+BOOL program_is_markup (const char *int_filename)
+  {
+  static const char *exts[] = 
+    {".htm", ".html", ".xhtml", ".xht", ".xml", NULL};
+  int len = strlen (int_filename);
+  for (int i = 0; exts[i]; i++)
+    {
+    int l = strlen (exts[i]);
+    if (len > l && strcasecmp (int_filename + len - l, exts[i]) == 0)
+      return TRUE;
+    }
+  return FALSE;
+  }
+
+
+/*==========================================================================
+  program_start_prefetch
+
+  With --prefetch, start a thread that decompresses the entries from 
+    first_entry up to, but not including, end_entry, that will be 
+    searched. Returns NULL if there is to be no prefetching.
+==========================================================================*/
+Prefetch *program_start_prefetch (const ProgramRun *run, 
+    const ZipFile *z, int first_entry, int end_entry)
+  {
+  LOG_IN
+  Prefetch *ret = NULL;
+  uint64_t budget = (uint64_t)program_context_get_integer 
+    (run->context, "prefetch", 0) * 1024 * 1024;
+  if (budget > 0 && end_entry > first_entry)
+    {
+    int *entries = malloc ((end_entry - first_entry) * sizeof (int));
+    int num_entries = 0;
+    for (int n = first_entry; n < end_entry; n++)
+      if (program_is_searchable (run, z, n)) 
+        entries[num_entries++] = n;
+    if (num_entries > 0)
+      {
+      BOOL first = TRUE;
+      for (int q = 0; q < run->num_queries; q++)
+        if (!run->queries[q].first) first = FALSE;
+      ret = prefetch_create (z, entries, num_entries, budget, 
+        first ? PROGRAM_FIRST_CHUNK : PROGRAM_CHUNK_SIZE, 
+        PROGRAM_CHUNK_SIZE);
+      }
+    free (entries);
+    }
+  LOG_OUT
+  return ret;
+  }
+
+
+/*==========================================================================
+  program_query_is_done
+
+  Returns TRUE if there's no need to search any more entries of a zipfile
+    for the q'th query: if the outcome of the whole search is already
+    known for it or, with --first, if a match has been found in this
+    run of entries, or in an earlier unit of a split zipfile. found is 
+    the number of matches in this run of entries so far.
+==========================================================================*/
+BOOL program_query_is_done (const ProgramRun *run, int q, 
+       ProgramSplit *split, int unit, int found)
+  {
+  const ProgramQuery *query = &run->queries[q];
+  if (__atomic_load_n (&query->decided, __ATOMIC_RELAXED)) return TRUE;
+  if (found > 0 && query->first) return TRUE;
+  return split && 
+    unit > __atomic_load_n (&split->first_match[q], __ATOMIC_RELAXED);
+  }
+
+
+/*==========================================================================
+  program_do_entries
+
+  Search the entries from first_entry up to, but not including, 
+    end_entry, in a zipfile. If the zipfile has been split, and this
+    is one of its units, a query stops if an earlier unit has already 
+    found its first match. With --prefetch, the entries are decompressed 
+    in another thread, while this one searches them.
+
+  Each entry is searched for whichever queries select it, and are not 
+    yet done with the zipfile. The number of matches for each query is
+    added to matches.
+==========================================================================*/
+void program_do_entries (ProgramRun *run, FILE **outs, const ZipFile *z,
+    int first_entry, int end_entry, ProgramSplit *split, int unit, 
+    int *matches, BOOL *did_something)
+  {
+  LOG_IN
+  int num_queries = run->num_queries;
+  int *found = calloc (num_queries, sizeof (int));
+  BOOL *selected = malloc (num_queries * sizeof (BOOL));
+  BOOL *stripped = malloc (num_queries * sizeof (BOOL));
+  BOOL stop = FALSE;
+  Prefetch *prefetch = program_start_prefetch (run, z, 
+     first_entry, end_entry);
+
+  for (int n = first_entry; n < end_entry && !stop; n++)
+    {
+    const char *int_filename = zipfile_get_entry_name (z, n);
+    BOOL empty = zipfile_get_entry_size (z, n) == 0;
+    BOOL wanted = FALSE; // Some query still has to search this zipfile
+    BOOL any = FALSE; // Some query will search this entry
+    for (int q = 0; q < num_queries; q++)
+      {
+      selected[q] = FALSE;
+      if (program_query_is_done (run, q, split, unit, found[q])) continue;
+      wanted = TRUE;
+      if (!empty)
+        selected[q] = program_consider_entry (run, &run->queries[q], 
+          z, n, TRUE);
+      if (selected[q]) any = TRUE;
+      }
+
+    if (!wanted)
+      {
+      log_debug ("Stopping now because the outcome is known");
+      stop = TRUE;
+      }
+    else if (any)
+      {
+      // We can't put it off any longer -- we have to unpack
+      //   and grep this entry
+      log_debug ("Consider entry %d", n);
+      *did_something = TRUE;
+      // With --text-only, markup is stripped from (X)HTML and XML 
+      //   entries. If only some of the queries want that, the entry
+      //   has to be searched twice, and the second time it is read 
+      //   directly, because the prefetch thread only provides it once
+      BOOL markup = program_is_markup (int_filename);
+      BOOL strip = FALSE, keep = FALSE;
+      for (int q = 0; q < num_queries; q++)
+        {
+        stripped[q] = selected[q] && markup && program_context_get_boolean 
+          (run->queries[q].context, "text-only", FALSE);
+        if (stripped[q]) 
+          {
+          strip = TRUE;
+          selected[q] = FALSE;
+          }
+        else if (selected[q]) 
+          keep = TRUE;
+        }
+      if (strip)
+        program_do_entry (run, outs, z, n, prefetch, stripped, TRUE, 
+          found);
+      if (keep)
+        program_do_entry (run, outs, z, n, strip ? NULL : prefetch, 
+          selected, FALSE, found);
+      }
+    else if (empty)
+      log_debug ("Skipping zero-length entry %s", int_filename);
+    else
+      log_debug ("Skipping non-matching entry: %s: %s\n", 
+        zipfile_get_filename (z), int_filename);
+    }
+
+  prefetch_destroy (prefetch);
+  for (int q = 0; q < num_queries; q++)
+    matches[q] += found[q];
+  free (found);
+  free (selected);
+  free (stripped);
+  LOG_OUT
+  }
+
+/*==========================================================================
+  program_output_open
+
+  Start collecting output in memory: a stream for each query, and one for
+    messages if they are kept apart. Messages logged by this thread are
+    collected as well.
+==========================================================================*/
+void program_output_open (const ProgramRun *run, ProgramOutput *output)
+  {
+  LOG_IN
+  int n = run->separate_log ? run->num_queries + 1 : 1;
+  output->num_streams = n;
+  output->streams = malloc (n * sizeof (FILE *));
+  output->texts = calloc (n, sizeof (char *));
+  output->lengths = calloc (n, sizeof (size_t));
+  output->outs = malloc (run->num_queries * sizeof (FILE *));
+  for (int i = 0; i < n; i++)
+    output->streams[i] = open_memstream (&output->texts[i], 
+      &output->lengths[i]);
+  for (int q = 0; q < run->num_queries; q++)
+    output->outs[q] = output->streams[run->separate_log ? q : 0];
+  log_set_thread_stream (output->streams[n - 1]);
+  LOG_OUT
+  }
+
+/*==========================================================================
+  program_output_close
+
+  Stop collecting output. The thread's log stream is not reset, because 
+    the caller knows what it should be.
+==========================================================================*/
+void program_output_close (ProgramOutput *output)
+  {
+  LOG_IN
+  for (int i = 0; i < output->num_streams; i++)
+    fclose (output->streams[i]);
+  LOG_OUT
+  }
+
+/*==========================================================================
+  program_output_write
+
+  Write output that has been collected, to the stream for each query in 
+    outs, and messages to log. If keep is not NULL, the output of the
+    queries for which it is FALSE is discarded. When messages are not
+    kept apart, they are in the stream of the (only) query, and go 
+    wherever its output goes.
+==========================================================================*/
+void program_output_write (const ProgramRun *run, 
+       const ProgramOutput *output, FILE **outs, FILE *log, 
+       const BOOL *keep)
+  {
+  LOG_IN
+  if (output->num_streams > 0)
+    {
+    for (int q = 0; q < run->num_queries; q++)
+      {
+      int i = run->separate_log ? q : 0;
+      if (!keep || keep[q])
+        fwrite (output->texts[i], 1, output->lengths[i], outs[q]);
+      }
+    if (run->separate_log)
+      {
+      int i = run->num_queries;
+      fwrite (output->texts[i], 1, output->lengths[i], log);
+      }
+    }
+  LOG_OUT
+  }
+
+/*==========================================================================
+  program_output_free
+==========================================================================*/
+void program_output_free (ProgramOutput *output)
+  {
+  LOG_IN
+  for (int i = 0; i < output->num_streams; i++)
+    free (output->texts[i]);
+  free (output->streams);
+  free (output->texts);
+  free (output->lengths);
+  free (output->outs);
+  memset (output, 0, sizeof (ProgramOutput));
+  LOG_OUT
+  }
+
+/*==========================================================================
+  program_split_release
+
+  Give up a reference to the split, freeing it if it was the last
+==========================================================================*/
+void program_split_release (ProgramSplit *split)
+  {
+  LOG_IN
+  pthread_mutex_lock (&split->mutex);
+  BOOL last = (--split->refs == 0);
+  pthread_mutex_unlock (&split->mutex);
+  if (last)
+    {
+    pthread_cond_destroy (&split->cond);
+    pthread_mutex_destroy (&split->mutex);
+    for (int i = 0; i < split->num_units; i++)
+      free (split->units[i].matches);
+    free (split->units);
+    free (split->first_match);
+    free (split);
+    }
+  LOG_OUT
+  }
+
+/*==========================================================================
+  program_split_work
+
+  Search units of a split zipfile, until there are none left to start.
+    Messages logged while searching a unit are collected along with its
+    output.
+==========================================================================*/
+void program_split_work (ProgramSplit *split)
+  {
+  LOG_IN
+  ProgramRun *run = split->run;
+  FILE *log_stream = log_get_thread_stream ();
+
+  pthread_mutex_lock (&split->mutex);
+  while (split->next_unit < split->num_units)
+    {
+    int unit = split->next_unit++;
+    pthread_mutex_unlock (&split->mutex);
+
+    ProgramUnit *u = &split->units[unit];
+    program_output_open (run, &u->output);
+    program_do_entries (run, u->output.outs, split->z, u->first_entry, 
+      u->end_entry, split, unit, u->matches, &u->did_something);
+    log_set_thread_stream (log_stream);
+    program_output_close (&u->output);
+
+    pthread_mutex_lock (&split->mutex);
+    for (int q = 0; q < run->num_queries; q++)
+      {
+      if (u->matches[q] > 0 && run->queries[q].first && 
+          unit < split->first_match[q])
+        __atomic_store_n (&split->first_match[q], unit, __ATOMIC_RELAXED);
+      }
+    split->finished_units++;
+    pthread_cond_broadcast (&split->cond);
+    }
+  pthread_mutex_unlock (&split->mutex);
+  LOG_OUT
+  }
+
+/*==========================================================================
+  program_split_helper
+
+  The task run by the thread pool, to help with a split zipfile
+==========================================================================*/
+void program_split_helper (void *arg)
+  {
+  LOG_IN
+  ProgramSplit *split = arg;
+  program_split_work (split);
+  program_split_release (split);
+  LOG_OUT
+  }
+
+/*==========================================================================
+  program_do_split
+
+  Search a zipfile that is big enough to be worth splitting into 
+    units, for a pool of threads to share. The zipfile is only read, so
+    the threads can share it safely. The output of the units is written
+    in order when they have all finished, so it's the same as if the 
+    entries had been searched one after another. With --first, the units
+    after the first one that matched are abandoned, and their output is
+    discarded -- separately for each query, in batch mode.
+
+  The number of matches for each query is added to matches
+==========================================================================*/
+void program_do_split (ProgramRun *run, FILE **outs, const ZipFile *z,
+    ProgramUnit *units, int num_units, int *matches, BOOL *did_something)
+  {
+  LOG_IN
+  int num_queries = run->num_queries;
+  ProgramSplit *split = malloc (sizeof (ProgramSplit));
+  memset (split, 0, sizeof (ProgramSplit));
+  split->run = run;
+  split->z = z;
+  split->units = units;
+  split->num_units = num_units;
+  split->first_match = malloc (num_queries * sizeof (int));
+  for (int q = 0; q < num_queries; q++)
+    split->first_match[q] = num_units;
+  for (int i = 0; i < num_units; i++)
+    units[i].matches = calloc (num_queries, sizeof (int));
+  pthread_mutex_init (&split->mutex, NULL);
+  pthread_cond_init (&split->cond, NULL);
+
+  int helpers = threadpool_get_threads (run->pool) - 1;
+  if (helpers > num_units - 1) helpers = num_units - 1;
+  log_debug ("Searching %s in %d units, with %d helper(s)", 
+    zipfile_get_filename (z), num_units, helpers);
+
+  split->refs = helpers + 1;
+  for (int i = 0; i < helpers; i++)
+    threadpool_submit (run->pool, program_split_helper, split);
+
+  program_split_work (split);
+
+  pthread_mutex_lock (&split->mutex);
+  while (split->finished_units < num_units)
+    pthread_cond_wait (&split->cond, &split->mutex);
+  pthread_mutex_unlock (&split->mutex);
+
+  FILE *log = log_get_thread_stream ();
+  if (!log) log = stdout;
+  BOOL *keep = malloc (num_queries * sizeof (BOOL));
+  for (int i = 0; i < num_units; i++)
+    {
+    ProgramUnit *u = &units[i];
+    BOOL kept = FALSE;
+    for (int q = 0; q < num_queries; q++)
+      {
+      keep[q] = i <= split->first_match[q];
+      if (keep[q])
+        {
+        matches[q] += u->matches[q];
+        kept = TRUE;
+        }
+      }
+    if (kept && u->did_something) *did_something = TRUE;
+    program_output_write (run, &u->output, outs, log, keep);
+    program_output_free (&u->output);
+    }
+  free (keep);
+
+  program_split_release (split);
+  LOG_OUT
+  }
+
+/*==========================================================================
+  program_report_file
+
+  Once a zipfile has been searched, report on it as a whole, for each 
+    query that asks for it: its name, with --files-with-matches if it 
+    matched, or with --files-without-match if it did not; or, with 
+    --count, the number of matching lines in it. In batch mode, a query
+    only reports on the zipfiles that its --files selects. found is the
+    number of matches in the zipfile for each query
+==========================================================================*/
+void program_report_file (const ProgramRun *run, FILE **outs, 
+       const char *zip_filename, const int *found)
+  {
+  LOG_IN
+  for (int q = 0; q < run->num_queries; q++)
+    {
+    const ProgramContext *context = run->queries[q].context;
+    if (run->batch && !program_match_filename (context, zip_filename, 
+         FALSE))
+      continue;
+    if (program_context_get_boolean (context, "quiet", FALSE))
+      continue;
+    if (program_context_get_boolean (context, "files-with-matches", FALSE))
+      {
+      if (found[q] > 0) fprintf (outs[q], "%s\n", zip_filename);
+      }
+    else if (program_context_get_boolean (context, "files-without-match", 
+         FALSE))
+      {
+      if (found[q] == 0) fprintf (outs[q], "%s\n", zip_filename);
+      }
+    else if (program_shows_count (context))
+      program_print_count (context, outs[q], zip_filename, NULL, found[q]);
+    }
+  LOG_OUT
+  }
+
+/*==========================================================================
+  program_do_file
+
+  Process a specific zipfile, examining each entry and, if it meets 
+   certain criteria, sending it for further examination.
+
+  Matches for each query are written to its stream in outs, which need
+   not be stdout. With --threads, a large zipfile is split into units 
+   that several threads can search at once. 
+
+  With --files-with-matches, as with --first, no more entries are 
+   decompressed once one matches.
+
+  The number of matches for each query is added to matches
+==========================================================================*/
+void program_do_file (ProgramRun *run, FILE **outs, const Path *path, 
+    int *matches, BOOL *did_something)
+  {
+  LOG_IN
+  int *found = calloc (run->num_queries, sizeof (int));
+
+  char *s_path = (char *)path_to_utf8 (path);
+  log_debug ("%s: path=%s", __PRETTY_FUNCTION__, s_path);
+  ZipFile *z = zipfile_create (s_path);
   int error = zipfile_read_contents (z);
   if (!error)
     {
@@ -580,78 +1984,330 @@ int program_do_file (const ProgramContext *context, const pcre *preg,
 
     log_debug ("zipfile_read_contents OK");
 
-    BOOL stop = FALSE;
-    BOOL first = program_context_get_boolean (context, 
-          "first", FALSE);
-    int l = zipfile_get_num_entries (z); 
-    for (int i = 0; i < l && !stop; i++)
-      {
-      uint64_t size;
-      char int_filename[PATH_MAX];
-      zipfile_get_entry_details (z, i, int_filename, 
-        sizeof (int_filename), &size); 
-      if (size != 0)
+    int num_entries = zipfile_get_num_entries (z);
+    ProgramUnit *units = NULL;
+    int num_units = 0;
+    if (run->pool)
+      {
+      // Divide the entries into runs of about PROGRAM_UNIT_SIZE 
+      int max_units = 0;
+      uint64_t size = 0;
+      for (int n = 0; n < num_entries; n++)
         {
-        log_debug ("Consider entry %d", i);
-        matches += program_consider_entry (context, z, preg, i, did_something);
-        if (matches && first) 
+        if (num_units == 0 || size >= PROGRAM_UNIT_SIZE)
           {
-          log_debug 
-               ("Stopping now because first match only is set");
-          stop = TRUE;
+          if (num_units == max_units)
+            {
+            max_units = max_units ? max_units * 2 : 16;
+            units = realloc (units, max_units * sizeof (ProgramUnit));
+            }
+          memset (&units[num_units], 0, sizeof (ProgramUnit));
+          units[num_units].first_entry = n;
+          num_units++;
+          size = 0;
           }
-        }
-      else
-        {
-        log_debug ("Skipping zero-length entry %s", int_filename);
+        units[num_units - 1].end_entry = n + 1;
+        size += zipfile_get_entry_size (z, n);
         }
       }
+
+    if (num_units > 1)
+      program_do_split (run, outs, z, units, num_units, found,
+        did_something);
+    else
+      {
+      free (units);
+      program_do_entries (run, outs, z, 0, num_entries, NULL, 0, 
+        found, did_something);
+      }
+    program_report_file (run, outs, s_path, found);
     }
   else log_warning ("%s: %s", s_path, program_zip_strerror (error));
   zipfile_destroy (z);
   free (s_path);
+  for (int q = 0; q < run->num_queries; q++)
+    matches[q] += found[q];
+  free (found);
 
   LOG_OUT
-  return matches;
+  }
+
+/*==========================================================================
+  program_job_run
+
+  Search the zipfile specified by a job. This might be called on a worker 
+    thread, in which case the output is collected in memory, to be
+    written by program_finish_job, along with any messages logged while 
+    searching it. With --unordered there's no need to wait for that -- 
+    the output is written as soon as the zipfile has been searched. 
+    Either way, all the output from one zipfile is written together.
+==========================================================================*/
+void program_job_run (void *arg)
+  {
+  LOG_IN
+  ProgramJob *job = arg;
+  ProgramRun *run = job->run;
+
+  // Don't start on a file if a previous one has decided the outcome
+  if (!program_is_decided (run))
+    {
+    FILE **outs = run->sinks;
+    if (run->pool)
+      {
+      program_output_open (run, &job->output);
+      outs = job->output.outs;
+      }
+    program_do_file (run, outs, job->path, job->matches, 
+      &job->did_something);
+    if (run->pool)
+      {
+      log_set_thread_stream (NULL);
+      program_output_close (&job->output);
+      if (run->unordered)
+        {
+        program_output_write (run, &job->output, run->sinks, stdout, NULL);
+        program_output_free (&job->output);
+        }
+      }
+    for (int q = 0; q < run->num_queries; q++)
+      {
+      if (job->matches[q] > 0 && run->queries[q].quiet)
+        __atomic_store_n (&run->queries[q].decided, TRUE, 
+          __ATOMIC_RELAXED);
+      }
+    }
+
+  pthread_mutex_lock (&run->mutex);
+  job->done = TRUE;
+  pthread_cond_broadcast (&run->cond);
+  pthread_mutex_unlock (&run->mutex);
+  LOG_OUT
+  }
+
+/*==========================================================================
+  program_finish_job
+
+  Write the output of a job that has been completed, and add its results
+    to the totals. For an end-of-argument marker, warn if none of the 
+    files found from that argument had any entries that could be 
+    searched. This function is only called on the main thread.
+==========================================================================*/
+void program_finish_job (ProgramRun *run, ProgramJob *job)
+  {
+  LOG_IN
+  if (job->messages)
+    {
+    fwrite (job->messages, 1, job->messages_length, stdout);
+    free (job->messages);
+    }
+  program_output_write (run, &job->output, run->sinks, stdout, NULL);
+  program_output_free (&job->output);
+  if (job->path)
+    {
+    for (int q = 0; q < run->num_queries; q++)
+      run->matches += job->matches[q];
+    if (job->did_something) run->did_something[job->arg] = TRUE;
+    path_destroy (job->path);
+    }
+  else if (job->arg >= 0 && !run->did_something[job->arg] && 
+      !program_is_decided (run))
+    {
+    char ** const argv = program_context_get_nonswitch_argv (run->context);
+    log_warning ("%s: No zipfile entries were processed", argv[job->arg]);
+    }
+  free (job->matches);
+  free (job);
+  LOG_OUT
+  }
+/*==========================================================================
+  program_finish_jobs
+
+  Collect the results of completed jobs, in order -- or, with --unordered,
+    in whatever order they complete. If more than max_pending jobs are 
+    still outstanding, wait for some of them to finish. So calling this
+    function with max_pending set to zero waits for all jobs to finish.
+==========================================================================*/
+void program_finish_jobs (ProgramRun *run, int max_pending)
+  {
+  LOG_IN
+  pthread_mutex_lock (&run->mutex);
+  for (;;)
+    {
+    // An end-of-argument marker can only be dealt with when all the
+    //   jobs before it have been, even when unordered
+    ProgramJob *prev = NULL;
+    ProgramJob *job = run->head;
+    while (job && !(job->done && 
+          (job == run->head || (run->unordered && job->path))))
+      {
+      prev = job;
+      job = job->next;
+      }
+
+    if (job)
+      {
+      if (prev) prev->next = job->next; else run->head = job->next;
+      if (run->tail == job) run->tail = prev;
+      if (job->path) run->pending--;
+      pthread_mutex_unlock (&run->mutex);
+      program_finish_job (run, job);
+      pthread_mutex_lock (&run->mutex);
+      }
+    else if (run->pending > max_pending)
+      pthread_cond_wait (&run->cond, &run->mutex);
+    else
+      break;
+    }
+  pthread_mutex_unlock (&run->mutex);
+  LOG_OUT
+  }
+
+/*==========================================================================
+  program_append_job
+
+  Add a job to the end of the list of outstanding jobs
+==========================================================================*/
+void program_append_job (ProgramRun *run, ProgramJob *job)
+  {
+  LOG_IN
+  job->run = run;
+  pthread_mutex_lock (&run->mutex);
+  if (run->tail) run->tail->next = job; else run->head = job;
+  run->tail = job;
+  if (job->path) run->pending++;
+  pthread_mutex_unlock (&run->mutex);
+  LOG_OUT
+  }
+
+/*==========================================================================
+  program_start_log
+
+  When writing results in order, collect the messages that the main
+    thread logs, so they can be written in order as well.
+==========================================================================*/
+void program_start_log (ProgramRun *run)
+  {
+  LOG_IN
+  if (run->pool && !run->unordered)
+    {
+    run->log = open_memstream (&run->log_output, &run->log_length);
+    log_set_thread_stream (run->log);
+    }
+  LOG_OUT
+  }
+
+/*==========================================================================
+  program_cut_log
+
+  Stop collecting messages logged by the main thread and, if there were
+    any, queue them for output after the jobs that have already been
+    started. 
+==========================================================================*/
+void program_cut_log (ProgramRun *run)
+  {
+  LOG_IN
+  if (run->log)
+    {
+    log_set_thread_stream (NULL);
+    fclose (run->log);
+    run->log = NULL;
+    if (run->log_length > 0)
+      {
+      ProgramJob *job = malloc (sizeof (ProgramJob));
+      memset (job, 0, sizeof (ProgramJob));
+      job->arg = -1;
+      job->messages = run->log_output;
+      job->messages_length = run->log_length;
+      job->done = TRUE;
+      program_append_job (run, job);
+      }
+    else
+      free (run->log_output);
+    run->log_output = NULL;
+    }
+  LOG_OUT
+  }
+
+/*==========================================================================
+  program_add_job
+
+  Add a job to the list of outstanding jobs and, if it's a real job 
+    rather than an end-of-argument marker, start it. The path may be
+    NULL, for a marker; otherwise the job takes a copy of it. Then 
+    collect the results of any jobs that have finished.
+==========================================================================*/
+void program_add_job (ProgramRun *run, const Path *path, int n)
+  {
+  LOG_IN
+  program_cut_log (run);
+
+  ProgramJob *job = malloc (sizeof (ProgramJob));
+  memset (job, 0, sizeof (ProgramJob));
+  job->arg = n;
+  if (path) 
+    {
+    job->path = path_clone (path);
+    job->matches = calloc (run->num_queries, sizeof (int));
+    }
+  else
+    job->done = TRUE;
+  program_append_job (run, job);
+
+  if (path)
+    {
+    if (run->pool)
+      threadpool_submit (run->pool, program_job_run, job);
+    else
+      program_job_run (job);
+    }
+
+  program_finish_jobs (run, run->max_pending);
+  program_start_log (run);
+  LOG_OUT
   }
 
 /*==========================================================================
   program_consider_file
 
   Check whether a filename matches the inclusion criteria and, if
-    so, send it for checking
-
-  Returns the total number of matches 
+    so, send it for checking. In batch mode, it must also match the 
+    criteria of at least one query.
 ==========================================================================*/
-int program_consider_file (const ProgramContext *context, 
-     const pcre *preg, const Path *path, BOOL *did_something)
+void program_consider_file (ProgramRun *run, const Path *path, int n)
   {
   LOG_IN
-  int matches = 0;
   char *s_path = (char *)path_to_utf8 (path);
   log_debug ("%s arg=%s", __PRETTY_FUNCTION__, s_path);
 
   char *filename = (char *)path_get_filename_utf8 (path);
   if (filename)
     {
-    if (program_match_filename (context, filename, FALSE))
-      matches += program_do_file (context, preg, path, did_something);
+    BOOL wanted = program_match_filename (run->context, filename, FALSE);
+    if (wanted && run->batch)
+      {
+      wanted = FALSE;
+      for (int q = 0; q < run->num_queries && !wanted; q++)
+        wanted = program_match_filename (run->queries[q].context, 
+          filename, FALSE);
+      }
+    if (wanted)
+      program_add_job (run, path, n);
     free (filename);
     }
 
   free (s_path);
   LOG_OUT
-  return matches;
   } 
 
 /*==========================================================================
   program_do_file_or_dir
+
+  n is the index of the command-line argument that this file or 
+    directory came from
 ==========================================================================*/
-int program_do_file_or_dir (const ProgramContext *context, 
-       const pcre *preg, const char *arg, BOOL *did_something)
+void program_do_file_or_dir (ProgramRun *run, const char *arg, int n)
   {
   LOG_IN
-  int matches = 0;
   log_debug ("%s arg=%s", __PRETTY_FUNCTION__, arg);
   Path *path = path_create (arg);
   struct stat sb;
@@ -659,13 +2315,13 @@ int program_do_file_or_dir (const ProgramContext *context,
     {
     if (path_is_regular (path))
       {
-      matches += program_consider_file (context, preg, path, did_something);
+      program_consider_file (run, path, n);
       }
     else if (path_is_directory (path))
       {
-      if (program_context_get_boolean (context, "recurse", FALSE))
+      if (program_context_get_boolean (run->context, "recurse", FALSE))
         {
-        matches += program_do_dir (context, preg, path, did_something);
+        program_do_dir (run, path, n);
         }
       else
         {
@@ -686,10 +2342,392 @@ int program_do_file_or_dir (const ProgramContext *context,
   
   path_destroy (path);
   LOG_OUT
-  return matches;
   }
 
 
+/*==========================================================================
+  program_add_string
+
+  Add a string to a list, which takes ownership of it
+==========================================================================*/
+void program_add_string (ProgramStrings *list, char *s)
+  {
+  if (list->count == list->size)
+    {
+    list->size = list->size ? list->size * 2 : 16;
+    list->texts = realloc (list->texts, list->size * sizeof (char *));
+    }
+  list->texts[list->count++] = s;
+  }
+
+/*==========================================================================
+  program_free_strings
+==========================================================================*/
+void program_free_strings (ProgramStrings *list)
+  {
+  for (int i = 0; i < list->count; i++)
+    free (list->texts[i]);
+  free (list->texts);
+  }
+
+/*==========================================================================
+  program_split_lines
+
+  Add each line of s to a list. Unlike string_split(), this
+    keeps empty lines -- an empty pattern is a valid one
+==========================================================================*/
+void program_split_lines (const char *s, ProgramStrings *list)
+  {
+  for (;;)
+    {
+    const char *nl = strchr (s, '\n');
+    if (!nl)
+      {
+      program_add_string (list, strdup (s));
+      break;
+      }
+    program_add_string (list, strndup (s, nl - s));
+    s = nl + 1;
+    }
+  }
+
+/*==========================================================================
+  program_read_patterns
+
+  Add the patterns in a file, one to a line, to the list. The filename 
+    "-" means standard input. Returns FALSE if the file can't be read
+==========================================================================*/
+BOOL program_read_patterns (const char *filename, ProgramStrings *patterns)
+  {
+  LOG_IN
+  BOOL ret = FALSE;
+  FILE *f = strcmp (filename, "-") == 0 ? stdin : fopen (filename, "r");
+  if (f)
+    {
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t n;
+    while ((n = getline (&line, &size, f)) >= 0)
+      {
+      if (n > 0 && line[n - 1] == '\n') line[n - 1] = 0;
+      program_add_string (patterns, strdup (line));
+      }
+    free (line);
+    ret = !ferror (f);
+    if (f != stdin) fclose (f);
+    }
+  if (!ret)
+    log_error ("Can't read patterns from '%s': %s", filename, 
+      strerror (errno));
+  LOG_OUT
+  return ret;
+  }
+
+/*==========================================================================
+  program_get_patterns
+
+  Make a list of the patterns to search for. They come from --regexp 
+    and --file, if either was given, and otherwise from the first 
+    non-switch argument, which is passed as pattern. Each of --regexp
+    and --file can be given more than once, and the values are stored 
+    in the context one to a line. Returns FALSE if a pattern file can't
+    be read
+==========================================================================*/
+BOOL program_get_patterns (const ProgramContext *context, 
+      const char *pattern, ProgramStrings *patterns)
+  {
+  LOG_IN
+  BOOL ret = TRUE;
+  if (pattern)
+    program_add_string (patterns, strdup (pattern));
+
+  const char *regexps = program_context_get (context, "regexp");
+  if (regexps)
+    program_split_lines (regexps, patterns);
+
+  const char *files = program_context_get (context, "pattern-file");
+  if (files)
+    {
+    ProgramStrings names;
+    memset (&names, 0, sizeof (ProgramStrings));
+    program_split_lines (files, &names);
+    for (int i = 0; i < names.count && ret; i++)
+      ret = program_read_patterns (names.texts[i], patterns);
+    program_free_strings (&names);
+    }
+
+  LOG_OUT
+  return ret;
+  }
+
+/*==========================================================================
+  program_has_pattern_options
+
+  Returns TRUE if the patterns are given as options (--regexp, --file),
+    rather than as the first non-switch argument
+==========================================================================*/
+BOOL program_has_pattern_options (const ProgramContext *context)
+  {
+  return program_context_get (context, "regexp") != NULL
+    || program_context_get (context, "pattern-file") != NULL;
+  }
+
+/*==========================================================================
+  program_open_sink
+
+  Open the file that a query's matches are to be written to. A query 
+    without --output writes to stdout. Queries that name the same file
+    share it, so it's only opened once. Returns NULL if the file can't
+    be opened.
+==========================================================================*/
+FILE *program_open_sink (const ProgramRun *run, const char *filename)
+  {
+  LOG_IN
+  FILE *ret = NULL;
+  if (!filename)
+    ret = stdout;
+  for (int q = 0; q < run->num_queries && !ret; q++)
+    {
+    const char *other = program_context_get (run->queries[q].context, 
+      "output");
+    if (other && strcmp (other, filename) == 0)
+      ret = run->queries[q].sink;
+    }
+  if (!ret)
+    {
+    ret = fopen (filename, "w");
+    if (!ret)
+      log_error ("Can't open '%s' for writing: %s", filename, 
+        strerror (errno));
+    }
+  LOG_OUT
+  return ret;
+  }
+
+/*==========================================================================
+  program_add_query
+
+  Compile the patterns of a query, whose options are in context, and add 
+    it to the run. The patterns come from --regexp and --file if 
+    pattern_options is TRUE, and otherwise from the first non-switch
+    argument. Returns FALSE, having logged the reason, if the patterns 
+    can't be read or compiled, or the output file can't be opened.
+==========================================================================*/
+BOOL program_add_query (ProgramRun *run, ProgramContext *context, 
+       BOOL pattern_options)
+  {
+  LOG_IN
+  BOOL ret = FALSE;
+  char ** const argv = program_context_get_nonswitch_argv (context);
+
+  ProgramStrings patterns;
+  memset (&patterns, 0, sizeof (ProgramStrings));
+  if (program_get_patterns (context, pattern_options ? NULL : argv[1], 
+        &patterns))
+    {
+    int flags = PT_DEFAULT;
+    if (program_context_get_boolean (context, "ignore-case", FALSE))
+      flags |= PT_CASELESS;
+    if (program_context_get_boolean (context, "word-regexp", FALSE))
+      flags |= PT_WORD;
+    if (program_context_get_boolean (context, "fixed-strings", FALSE))
+      flags |= PT_FIXED;
+
+    const char *pcre_error = NULL;
+    int error_pos = 0-1;
+    int error_index = 0;
+
+    Pattern *pattern = pattern_create_set ((const char **)patterns.texts,
+       patterns.count, flags, &pcre_error, &error_pos, &error_index);
+    FILE *sink = NULL;
+    if (pattern)
+      sink = program_open_sink (run, program_context_get (context, 
+        "output"));
+    if (sink)
+      {
+      run->queries = realloc (run->queries, 
+        (run->num_queries + 1) * sizeof (ProgramQuery));
+      ProgramQuery *query = &run->queries[run->num_queries++];
+      memset (query, 0, sizeof (ProgramQuery));
+      query->context = context;
+      query->pattern = pattern;
+      query->sink = sink;
+      query->quiet = program_context_get_boolean (context, "quiet", FALSE);
+      query->first = program_stops_at_first (context);
+      int match_limit = program_context_get_integer (context, 
+        "match-limit", PROGRAM_MATCH_LIMIT);
+      int recursion_limit = program_context_get_integer (context, 
+        "recursion-limit", 0);
+      pattern_set_limits (pattern, match_limit > 0 ? match_limit : 0, 
+        recursion_limit > 0 ? recursion_limit : 0);
+      ret = TRUE;
+      }
+    else if (pattern)
+      pattern_destroy (pattern);
+    else if (patterns.count > 1)
+      log_error ("Bad regular expression '%s': %s, position %d", 
+          patterns.texts[error_index], pcre_error, error_pos);
+    else
+      log_error ("Bad regular expression: %s, position %d", 
+          pcre_error, error_pos);
+    }
+  program_free_strings (&patterns);
+
+  LOG_OUT
+  return ret;
+  }
+
+/*==========================================================================
+  program_split_words
+
+  Split a line of a batch file into words, much as a shell would. Words
+    are separated by whitespace, and quotes or a backslash can be used to
+    include whitespace in a word. Text in single quotes is taken 
+    literally; in double quotes, a backslash escapes a double quote or
+    another backslash. Returns FALSE if a quote is not closed.
+==========================================================================*/
+BOOL program_split_words (const char *s, ProgramStrings *list)
+  {
+  BOOL ret = TRUE;
+  char *word = malloc (strlen (s) + 1);
+  const char *p = s;
+  for (;;)
+    {
+    while (*p == ' ' || *p == '\t' || *p == '\r') p++;
+    if (!*p) break;
+    int length = 0;
+    while (ret && *p && *p != ' ' && *p != '\t' && *p != '\r')
+      {
+      if (*p == '\'')
+        {
+        const char *close = strchr (p + 1, '\'');
+        if (close)
+          {
+          memcpy (word + length, p + 1, close - p - 1);
+          length += close - p - 1;
+          p = close + 1;
+          }
+        else
+          ret = FALSE;
+        }
+      else if (*p == '"')
+        {
+        p++;
+        while (*p && *p != '"')
+          {
+          if (*p == '\\' && (p[1] == '"' || p[1] == '\\')) p++;
+          word[length++] = *p++;
+          }
+        if (*p) p++; else ret = FALSE;
+        }
+      else if (*p == '\\' && p[1])
+        {
+        word[length++] = p[1];
+        p += 2;
+        }
+      else
+        word[length++] = *p++;
+      }
+    if (!ret) break;
+    program_add_string (list, strndup (word, length));
+    }
+  free (word);
+  return ret;
+  }
+
+/*==========================================================================
+  program_read_query
+
+  Parse a line of a batch file, and add the query to the run. The line
+    is parsed as if it were a command line -- after the RC files have 
+    been read, but without any options from the real command line. A 
+    query gives its patterns, but no files. argv0 is the name of the
+    program, for messages. Returns FALSE if the query is not valid.
+==========================================================================*/
+BOOL program_read_query (ProgramRun *run, const char *line, 
+       const char *argv0)
+  {
+  LOG_IN
+  BOOL ret = FALSE;
+  ProgramStrings words;
+  memset (&words, 0, sizeof (ProgramStrings));
+  program_add_string (&words, strdup (argv0));
+  if (program_split_words (line, &words))
+    {
+    ProgramContext *context = program_context_create ();
+    program_context_read_rc_files (context, NAME ".rc");
+    if (program_context_parse_command_line (context, words.count, 
+          words.texts))
+      {
+      BOOL pattern_options = program_has_pattern_options (context);
+      int argc = program_context_get_nonswitch_argc (context);
+      if (argc != (pattern_options ? 1 : 2))
+        log_error ("A query must have a pattern, and no files");
+      else 
+        ret = program_add_query (run, context, pattern_options);
+      }
+    if (!ret)
+      program_context_destroy (context);
+    }
+  else
+    log_error ("Unmatched quote");
+  program_free_strings (&words);
+  LOG_OUT
+  return ret;
+  }
+
+/*==========================================================================
+  program_read_batch
+
+  Read the queries from a batch file, one to a line, ignoring empty lines
+    and those that start with '#'. The filename "-" means standard input.
+    Returns FALSE if the file can't be read, or a query is not valid.
+==========================================================================*/
+BOOL program_read_batch (ProgramRun *run, const char *filename, 
+       const char *argv0)
+  {
+  LOG_IN
+  BOOL ret = FALSE;
+  FILE *f = strcmp (filename, "-") == 0 ? stdin : fopen (filename, "r");
+  if (f)
+    {
+    char *line = NULL;
+    size_t size = 0;
+    int line_number = 0;
+    ret = TRUE;
+    while (ret && getline (&line, &size, f) >= 0)
+      {
+      line_number++;
+      const char *s = line + strspn (line, " \t\r\n");
+      if (*s == 0 || *s == '#') continue;
+      line[strcspn (line, "\n")] = 0;
+      if (!program_read_query (run, s, argv0))
+        {
+        log_error ("%s: bad query at line %d", filename, line_number);
+        ret = FALSE;
+        }
+      }
+    if (ret && ferror (f))
+      {
+      log_error ("Can't read queries from '%s': %s", filename, 
+        strerror (errno));
+      ret = FALSE;
+      }
+    free (line);
+    if (f != stdin) fclose (f);
+    }
+  else
+    log_error ("Can't read queries from '%s': %s", filename, 
+      strerror (errno));
+  if (ret && run->num_queries == 0)
+    {
+    log_error ("%s: no queries", filename);
+    ret = FALSE;
+    }
+  LOG_OUT
+  return ret;
+  }
+
 /*==========================================================================
   program_run
 
@@ -702,68 +2740,118 @@ int program_do_file_or_dir (const ProgramContext *context,
     multiple entries in multiple files. Consequently, this function
     only returns 2 in cases where the errors are so fatal as to prevent 
     searching any files at all.
+    It returns 3 if any entry could not be searched completely, because
+    PCRE reached --match-limit or --recursion-limit -- whether or not 
+    anything matched, since the outcome is then not certain.
+
+  With --threads, zipfiles are searched by a pool of worker threads, 
+    while this thread walks the directories, and writes the results. 
+
+  With --batch, there are many queries, read from a file, and all the
+    non-switch arguments are files to search. The files are found, and 
+    each entry decompressed, just once for all the queries. Otherwise 
+    there is a single query, with the options from the command line. In 
+    batch mode, and whenever a query's output goes to a file, messages 
+    are written to stdout separately from the matches. In any event, 
+    the exit value reflects the matches of all the queries together.
 ==========================================================================*/
 int program_run (ProgramContext *context)
   {
   LOG_IN
   int ret = 0;
   int matches = 0;
+  int limited = 0;
   
   char ** const argv = program_context_get_nonswitch_argv (context);
   int argc = program_context_get_nonswitch_argc (context);
 
-  if (argc >= 3)
-    {
-    const char *_pattern = argv[1];
-    int flags = 0;
-    if (program_context_get_boolean (context, "ignore-case", FALSE))
-      flags |= PCRE_CASELESS;
-
-    BOOL word_regexp = program_context_get_boolean 
-      (context, "word-regexp", FALSE);
+  // If the patterns are given as options, or come from a batch file, the 
+  //   first non-switch argument is a file to search
+  const char *batch = program_context_get (context, "batch");
+  BOOL pattern_options = program_has_pattern_options (context);
+  int first_file = (batch || pattern_options) ? 1 : 2;
 
-    char *pattern;
-    if (word_regexp)
-      asprintf (&pattern, "\\b(%s)\\b", _pattern);
-    else
-      asprintf (&pattern, "%s", _pattern);
+  ProgramRun run;
+  memset (&run, 0, sizeof (ProgramRun));
+  run.context = context;
+  run.batch = batch != NULL;
 
-    const char *pcre_error = NULL;
-    int error_pos = 0-1;
-    
-    pcre *re = pcre_compile (pattern, flags, 
-       &pcre_error, &error_pos, NULL);
-    if (re)
+  if (argc <= first_file)
+    {
+    usage_show (stderr, argv[0]);
+    ret = 2;
+    }
+  else if (batch ? !program_read_batch (&run, batch, argv[0]) 
+      : !program_add_query (&run, context, pattern_options))
+    ret = 2;
+  else
+    {
+    run.sinks = malloc (run.num_queries * sizeof (FILE *));
+    run.separate_log = run.batch;
+    for (int q = 0; q < run.num_queries; q++)
       {
-      for (int i = 2; i < argc; i++)
-        {
-        BOOL did_something = FALSE;
-        matches += program_do_file_or_dir (context, re, argv[i], 
-          &did_something);
-        if (!did_something)
-          {
-          log_warning ("%s: No zipfile entries were processed", argv[i]);
-          }
-        }
-      pcre_free (re);
+      run.sinks[q] = run.queries[q].sink;
+      if (run.sinks[q] != stdout) run.separate_log = TRUE;
       }
-    else
+    run.unordered = program_context_get_boolean (context, "unordered", 
+      FALSE);
+    run.did_something = malloc (argc * sizeof (BOOL));
+    memset (run.did_something, 0, argc * sizeof (BOOL));
+    pthread_mutex_init (&run.mutex, NULL);
+    pthread_cond_init (&run.cond, NULL);
+
+    int threads = program_context_get_integer (context, "threads", 1);
+    if (threads <= 0) threads = sysconf (_SC_NPROCESSORS_ONLN);
+    if (threads > 1)
       {
-      log_error ("Bad regular expression: %s, position %d", 
-          pcre_error, error_pos);
-      ret = 2;
+      run.pool = threadpool_create (threads);
+      run.max_pending = threads * PROGRAM_JOBS_PER_THREAD;
+      }
+
+    program_start_log (&run);
+    for (int i = first_file; i < argc && !program_is_decided (&run); i++)
+      {
+      program_do_file_or_dir (&run, argv[i], i);
+      program_add_job (&run, NULL, i);
       }
-    free (pattern);
+    program_cut_log (&run);
+
+    program_finish_jobs (&run, 0);
+    threadpool_destroy (run.pool);
+    matches = run.matches;
+
+    pthread_cond_destroy (&run.cond);
+    pthread_mutex_destroy (&run.mutex);
+    free (run.did_something);
+    free (run.sinks);
     }
-  else
+
+  for (int q = 0; q < run.num_queries; q++)
     {
-    usage_show (stderr, argv[0]);
-    ret = 2;
+    ProgramQuery *query = &run.queries[q];
+    limited += query->limited;
+    // Close each output file once, however many queries share it
+    BOOL shared = FALSE;
+    for (int p = 0; p < q && !shared; p++)
+      if (run.queries[p].sink == query->sink) shared = TRUE;
+    if (query->sink != stdout && !shared)
+      fclose (query->sink);
+    pattern_destroy (query->pattern);
+    if (query->context != context)
+      program_context_destroy (query->context);
     }
+  free (run.queries);
+
+  if (limited > 0)
+    log_warning ("%d %s not searched completely, because the regular "
+      "expression reached its limits", limited, 
+      limited == 1 ? "entry was" : "entries were");
 
   if (ret != 2)
     {
-    if (matches > 0) ret = 0; else ret = 1;
+    if (limited > 0) ret = 3; 
+    else if (matches > 0) ret = 0; 
+    else ret = 1;
     }
 
   LOG_OUT
@@ -84,6 +84,28 @@ void program_context_query_console (ProgramContext *self)
   }
 
 
+/*==========================================================================
+  program_context_add_line
+
+  Add a value to a property that can be given more than once on the 
+    command line, like --regexp. The values are stored one to a line
+==========================================================================*/
+static void program_context_add_line (ProgramContext *self, 
+     const char *key, const char *value)
+  {
+  const char *old = program_context_get (self, key);
+  if (old)
+    {
+    char *s;
+    asprintf (&s, "%s\n%s", old, value);
+    program_context_put (self, key, s);
+    free (s);
+    }
+  else
+    program_context_put (self, key, value);
+  }
+
+
 /*==========================================================================
   program_context_parse_command_line
   This needs to be called after program_context_read_rc_files, in order
@@ -112,32 +134,55 @@ BOOL program_context_parse_command_line (ProgramContext *self,
   BOOL ret = TRUE;
   static struct option long_options[] =
     {
+      {"after-context", required_argument, NULL, 'A'},
       {"all", no_argument, NULL, 'a'},
+      {"before-context", required_argument, NULL, 'B'},
+      {"batch", required_argument, NULL, 0},
+      {"byte-offset", no_argument, NULL, 'b'},
+      {"context", required_argument, NULL, 'C'},
+      {"count", no_argument, NULL, 'c'},
       {"entries", required_argument, NULL, 0},
+      {"file", required_argument, NULL, 0},
       {"files", required_argument, NULL, 0},
+      {"files-with-matches", no_argument, NULL, 0},
+      {"files-without-match", no_argument, NULL, 'L'},
       {"first", no_argument, NULL, 'f'},
+      {"fixed-strings", no_argument, NULL, 'F'},
       {"help", no_argument, NULL, '?'},
       {"ignore-case", no_argument, NULL, 'i'},
       {"log-level", required_argument, NULL, 'l'},
       {"line-number", no_argument, NULL, 'n'},
+      {"match-limit", required_argument, NULL, 0},
+      {"max-match", required_argument, NULL, 0},
       {"max-size", required_argument, NULL, 'm'},
+      {"multiline", no_argument, NULL, 'z'},
       {"no-binary", no_argument, NULL, 'I'},
       {"no-filename", no_argument, NULL, 'h'},
       {"no-entryname", no_argument, NULL, 'e'},
+      {"output", required_argument, NULL, 0},
+      {"prefetch", required_argument, NULL, 0},
       {"quiet", no_argument, NULL, 'q'},
       {"recurse", no_argument, NULL, 'r'},
+      {"recursion-limit", required_argument, NULL, 0},
+      {"regexp", required_argument, NULL, 0},
       {"text", no_argument, NULL, 0},
+      {"text-only", no_argument, NULL, 0},
+      {"threads", required_argument, NULL, 0},
+      {"unordered", no_argument, NULL, 0},
       {"version", no_argument, NULL, 'v'},
       {"word-regexp", no_argument, NULL, 'o'},
       {"width", no_argument, NULL, 'w'},
       {0, 0, 0, 0}
     };
 
+   // The command line of each query in a batch file is parsed in the
+   //   same way, so getopt has to start again from the beginning
+   optind = 0;
    int opt;
    while (ret)
      {
      int option_index = 0;
-     opt = getopt_long (argc, argv, "?fhiIvl:w:ram:oqne",
+     opt = getopt_long (argc, argv, "?A:B:C:bcfFhiIvl:Lw:ram:oqnez",
      long_options, &option_index);
 
      if (opt == -1) break;
@@ -147,8 +192,18 @@ BOOL program_context_parse_command_line (ProgramContext *self,
        case 0:
          if (strcmp (long_options[option_index].name, "help") == 0)
            program_context_put_boolean (self, "show-usage", TRUE);
+         else if (strcmp (long_options[option_index].name, "byte-offset") == 0)
+           program_context_put_boolean (self, "byte-offset", TRUE);
+         else if (strcmp (long_options[option_index].name, "count") == 0)
+           program_context_put_boolean (self, "count", TRUE);
+         else if (strcmp (long_options[option_index].name, "files-with-matches") == 0)
+           program_context_put_boolean (self, "files-with-matches", TRUE);
+         else if (strcmp (long_options[option_index].name, "files-without-match") == 0)
+           program_context_put_boolean (self, "files-without-match", TRUE);
          else if (strcmp (long_options[option_index].name, "first") == 0)
            program_context_put_boolean (self, "first", TRUE);
+         else if (strcmp (long_options[option_index].name, "fixed-strings") == 0)
+           program_context_put_boolean (self, "fixed-strings", TRUE);
          else if (strcmp (long_options[option_index].name, "no-entryname") == 0)
            program_context_put_boolean (self, "no-entryname", TRUE);
          else if (strcmp (long_options[option_index].name, "line-number") == 0)
@@ -171,25 +226,73 @@ BOOL program_context_parse_command_line (ProgramContext *self,
            program_context_put_boolean (self, "recurse", TRUE);
          else if (strcmp (long_options[option_index].name, "text") == 0)
            program_context_put_boolean (self, "text", TRUE);
+         else if (strcmp (long_options[option_index].name, "text-only") == 0)
+           program_context_put_boolean (self, "text-only", TRUE);
+         else if (strcmp (long_options[option_index].name, "unordered") == 0)
+           program_context_put_boolean (self, "unordered", TRUE);
+         else if (strcmp (long_options[option_index].name, "prefetch") == 0)
+           program_context_put_integer (self, "prefetch", atoi (optarg)); 
+         else if (strcmp (long_options[option_index].name, "threads") == 0)
+           program_context_put_integer (self, "threads", atoi (optarg)); 
+         else if (strcmp (long_options[option_index].name, "match-limit") == 0)
+           program_context_put_integer (self, "match-limit", atoi (optarg)); 
+         else if (strcmp (long_options[option_index].name, "recursion-limit") == 0)
+           program_context_put_integer (self, "recursion-limit", atoi (optarg)); 
          else if (strcmp (long_options[option_index].name, "log-level") == 0)
            program_context_put_integer (self, "log-level", atoi (optarg)); 
+         else if (strcmp (long_options[option_index].name, "after-context") == 0)
+           program_context_put_integer (self, "after-context", atoi (optarg)); 
+         else if (strcmp (long_options[option_index].name, "before-context") == 0)
+           program_context_put_integer (self, "before-context", atoi (optarg)); 
+         else if (strcmp (long_options[option_index].name, "context") == 0)
+           program_context_put_integer (self, "context", atoi (optarg)); 
          else if (strcmp (long_options[option_index].name, "width") == 0)
            program_context_put_integer (self, "width", atoi (optarg)); 
          else if (strcmp (long_options[option_index].name, "files") == 0)
            program_context_put (self, "files", optarg); 
          else if (strcmp (long_options[option_index].name, "max-size") == 0)
            program_context_put (self, "max-size", optarg); 
+         else if (strcmp (long_options[option_index].name, "max-match") == 0)
+           program_context_put (self, "max-match", optarg); 
+         else if (strcmp (long_options[option_index].name, "multiline") == 0)
+           program_context_put_boolean (self, "multiline", TRUE);
          else if (strcmp (long_options[option_index].name, "entries") == 0)
            program_context_put (self, "entries", optarg); 
+         else if (strcmp (long_options[option_index].name, "regexp") == 0)
+           program_context_add_line (self, "regexp", optarg); 
+         else if (strcmp (long_options[option_index].name, "file") == 0)
+           program_context_add_line (self, "pattern-file", optarg); 
+         else if (strcmp (long_options[option_index].name, "batch") == 0)
+           program_context_put (self, "batch", optarg); 
+         else if (strcmp (long_options[option_index].name, "output") == 0)
+           program_context_put (self, "output", optarg); 
          else
            exit (-1);
          break;
        case '?': 
          program_context_put_boolean (self, "show-usage", TRUE); break;
+       case 'A': program_context_put_integer (self, "after-context", 
+           atoi (optarg)); break;
+       case 'B': program_context_put_integer (self, "before-context", 
+           atoi (optarg)); break;
+       case 'C': 
+         program_context_put_integer (self, "context", atoi (optarg)); 
+         break;
+       case 'b': 
+         program_context_put_boolean (self, "byte-offset", TRUE); break;
+       case 'c': 
+         program_context_put_boolean (self, "count", TRUE); break;
        case 'e': 
          program_context_put_boolean (self, "no-entryname", TRUE); break;
        case 'f': 
          program_context_put_boolean (self, "first", TRUE); break;
+       case 'F': 
+         program_context_put_boolean (self, "fixed-strings", TRUE); break;
+       case 'L': 
+         program_context_put_boolean (self, "files-without-match", TRUE); 
+         break;
+       case 'z': 
+         program_context_put_boolean (self, "multiline", TRUE); break;
        case 'q': 
          program_context_put_boolean (self, "quiet", TRUE); break;
        case 'v': 
@@ -134,9 +134,9 @@ void props_delete (Props *self, const char *name)
   for (int i = 0; i < l && !found; i++)
     {
     const NameValuePair *nvp = list_get (self->list, i);
-    if (nvp)
+    if (strcmp (nvp_get_name (nvp), name) == 0)
       {
-      log_debug ("props_delete, found NVP, deleting", name);
+      log_debug ("props_delete, found %s, deleting", name);
       list_remove_object (self->list, nvp);
       found = TRUE;
       }
@@ -523,10 +523,11 @@ BOOL string_write_to_path (const String *self, const Path *path)
 /*==========================================================================
   string_split
 
-  Returns a List of String objects. The string is split using strtok(),
-  and so this method has all the limitations that strtok() has. In 
-  particular, there's no way to enter an empty token -- multiple delimiters
-  are collapsed into one.
+  Returns a List of String objects. The string is split using strtok_r(),
+  and so this method has all the limitations that strtok() has, except 
+  that it is safe to call from multiple threads. 
+  In particular, there's no way to enter an empty token -- multiple 
+  delimiters are collapsed into one.
 
   This method always returns a List, but it may be empty if the input
   string was empty.
@@ -537,14 +538,15 @@ List *string_split (const String *self, const char *delim)
 
   char *s = strdup (self->str);
   
-  char *tok = strtok (s, delim);
+  char *saveptr = NULL;
+  char *tok = strtok_r (s, delim, &saveptr);
 
   if (tok)
     {
     do
       {
       list_append (l, string_create (tok));
-      } while ((tok = strtok (NULL, delim)));
+      } while ((tok = strtok_r (NULL, delim, &saveptr)));
     }
 
   free (s);
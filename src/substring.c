@@ -0,0 +1,225 @@
+/*==========================================================================
+
+  kzgrep
+  substring.c
+  Copyright (c)2020 Kevin Boone
+  Distributed under the terms of the GPL v3.0
+
+  Fast substring search, for fixed-string searches and for the literal
+  prefilter in front of the regex engine.
+
+  On x86, the haystack is scanned a block of 16 (SSE2) or 32 (AVX2) bytes
+  at a time. Each position in the block is checked, all at once, for the
+  first byte of the needle, and for the last byte at the right distance
+  from it. Only where both match -- which for most needles is rarely --
+  do we compare the bytes in between. Ignoring case just means comparing
+  each position with both cases of the first and last bytes. AVX2 is 
+  used if the CPU has it, which is checked at run time; elsewhere, 
+  we use memmem() or a simple loop.
+
+  Only ASCII letters have case here. That's all that PCRE's default 
+  character tables know about, and we don't want -F -i to give different
+  results from -i.
+
+==========================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "defs.h" 
+#include "substring.h" 
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#include <immintrin.h>
+#define SUBSTRING_X86 1
+#endif
+
+#ifdef SUBSTRING_X86
+static BOOL substring_avx2 = FALSE;
+static pthread_once_t substring_once = PTHREAD_ONCE_INIT;
+#endif
+
+/*==========================================================================
+  substring_lower, substring_upper
+==========================================================================*/
+static inline char substring_lower (char c)
+  {
+  return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+  }
+
+static inline char substring_upper (char c)
+  {
+  return (c >= 'a' && c <= 'z') ? c - ('a' - 'A') : c;
+  }
+
+/*==========================================================================
+  substring_equal
+
+  Compare n bytes, which may be zero or (when the needle is a single 
+    byte) -1
+==========================================================================*/
+static inline BOOL substring_equal (const char *a, const char *b, 
+    long n, const BOOL caseless)
+  {
+  if (n <= 0) return TRUE;
+  if (!caseless) return memcmp (a, b, n) == 0;
+  for (long i = 0; i < n; i++)
+    if (substring_lower (a[i]) != substring_lower (b[i])) return FALSE;
+  return TRUE;
+  }
+
+/*==========================================================================
+  substring_find_simple
+
+  Check each position in turn. Used for whatever is left over at the
+    end of the haystack, after the vector search, and where there is
+    no vector search at all
+==========================================================================*/
+static const char *substring_find_simple (const char *h, size_t length, 
+    const char *needle, size_t n, const BOOL caseless)
+  {
+  if (!caseless) return memmem (h, length, needle, n);
+  if (n > length) return NULL;
+  char lower = substring_lower (needle[0]);
+  for (size_t i = 0; i <= length - n; i++)
+    if (substring_lower (h[i]) == lower && 
+        substring_equal (h + i + 1, needle + 1, n - 1, TRUE)) 
+      return h + i;
+  return NULL;
+  }
+
+#ifdef SUBSTRING_X86
+
+/*==========================================================================
+  substring_init
+==========================================================================*/
+static void substring_init (void)
+  {
+  __builtin_cpu_init ();
+  substring_avx2 = __builtin_cpu_supports ("avx2");
+  }
+
+/*==========================================================================
+  substring_find_sse2
+==========================================================================*/
+static inline const char *substring_find_sse2 (const char *h, 
+    size_t length, const char *needle, size_t n, const BOOL caseless)
+  {
+  // Without case folding, only the 'lower' comparison is used, with the
+  //   bytes as they are
+  char first = caseless ? substring_lower (needle[0]) : needle[0];
+  char last = caseless ? substring_lower (needle[n - 1]) : needle[n - 1];
+  const __m128i first_lower = _mm_set1_epi8 (first);
+  const __m128i first_upper = _mm_set1_epi8 (substring_upper (first));
+  const __m128i last_lower = _mm_set1_epi8 (last);
+  const __m128i last_upper = _mm_set1_epi8 (substring_upper (last));
+
+  size_t i = 0;
+  for (; i + n - 1 + 16 <= length; i += 16)
+    {
+    __m128i a = _mm_loadu_si128 ((const __m128i *)(h + i));
+    __m128i b = _mm_loadu_si128 ((const __m128i *)(h + i + n - 1));
+    __m128i ea = _mm_cmpeq_epi8 (a, first_lower);
+    __m128i eb = _mm_cmpeq_epi8 (b, last_lower);
+    if (caseless)
+      {
+      ea = _mm_or_si128 (ea, _mm_cmpeq_epi8 (a, first_upper));
+      eb = _mm_or_si128 (eb, _mm_cmpeq_epi8 (b, last_upper));
+      }
+    unsigned mask = _mm_movemask_epi8 (_mm_and_si128 (ea, eb));
+    while (mask)
+      {
+      int bit = __builtin_ctz (mask);
+      if (substring_equal (h + i + bit + 1, needle + 1, (long)n - 2, 
+            caseless))
+        return h + i + bit;
+      mask &= mask - 1;
+      }
+    }
+  return substring_find_simple (h + i, length - i, needle, n, caseless);
+  }
+
+/*==========================================================================
+  substring_find_avx2
+==========================================================================*/
+__attribute__((target("avx2")))
+static const char *substring_find_avx2 (const char *h, 
+    size_t length, const char *needle, size_t n, const BOOL caseless)
+  {
+  char first = caseless ? substring_lower (needle[0]) : needle[0];
+  char last = caseless ? substring_lower (needle[n - 1]) : needle[n - 1];
+  const __m256i first_lower = _mm256_set1_epi8 (first);
+  const __m256i first_upper = _mm256_set1_epi8 (substring_upper (first));
+  const __m256i last_lower = _mm256_set1_epi8 (last);
+  const __m256i last_upper = _mm256_set1_epi8 (substring_upper (last));
+
+  size_t i = 0;
+  for (; i + n - 1 + 32 <= length; i += 32)
+    {
+    __m256i a = _mm256_loadu_si256 ((const __m256i *)(h + i));
+    __m256i b = _mm256_loadu_si256 ((const __m256i *)(h + i + n - 1));
+    __m256i ea = _mm256_cmpeq_epi8 (a, first_lower);
+    __m256i eb = _mm256_cmpeq_epi8 (b, last_lower);
+    if (caseless)
+      {
+      ea = _mm256_or_si256 (ea, _mm256_cmpeq_epi8 (a, first_upper));
+      eb = _mm256_or_si256 (eb, _mm256_cmpeq_epi8 (b, last_upper));
+      }
+    unsigned mask = _mm256_movemask_epi8 (_mm256_and_si256 (ea, eb));
+    while (mask)
+      {
+      int bit = __builtin_ctz (mask);
+      if (substring_equal (h + i + bit + 1, needle + 1, (long)n - 2, 
+            caseless))
+        return h + i + bit;
+      mask &= mask - 1;
+      }
+    }
+  return substring_find_simple (h + i, length - i, needle, n, caseless);
+  }
+
+/*==========================================================================
+  substring_find_vector
+==========================================================================*/
+static const char *substring_find_vector (const char *h, size_t length, 
+    const char *needle, size_t n, const BOOL caseless)
+  {
+  pthread_once (&substring_once, substring_init);
+  if (substring_avx2)
+    return substring_find_avx2 (h, length, needle, n, caseless);
+  return substring_find_sse2 (h, length, needle, n, caseless);
+  }
+
+#endif
+
+/*==========================================================================
+  substring_find
+==========================================================================*/
+const char *substring_find (const char *haystack, size_t length, 
+              const char *needle, size_t n)
+  {
+  if (n == 0) return haystack;
+  if (n == 1) return memchr (haystack, needle[0], length);
+#ifdef SUBSTRING_X86
+  return substring_find_vector (haystack, length, needle, n, FALSE);
+#else
+  return substring_find_simple (haystack, length, needle, n, FALSE);
+#endif
+  }
+
+/*==========================================================================
+  substring_find_caseless
+==========================================================================*/
+const char *substring_find_caseless (const char *haystack, size_t length,
+              const char *needle, size_t n)
+  {
+  if (n == 0) return haystack;
+#ifdef SUBSTRING_X86
+  return substring_find_vector (haystack, length, needle, n, TRUE);
+#else
+  return substring_find_simple (haystack, length, needle, n, TRUE);
+#endif
+  }
+
@@ -0,0 +1,27 @@
+/*==========================================================================
+
+  kzgrep
+  substring.h
+  Copyright (c)2020 Kevin Boone
+  Distributed under the terms of the GPL v3.0
+
+==========================================================================*/
+
+#pragma once
+
+#include <stddef.h>
+#include "defs.h"
+
+BEGIN_DECLS
+
+// Find the first occurrence of needle, of length n, in haystack. Returns
+//   NULL if there is none. An empty needle is found at the start
+const char *substring_find (const char *haystack, size_t length, 
+              const char *needle, size_t n);
+
+// As substring_find(), but ignoring the case of ASCII letters 
+const char *substring_find_caseless (const char *haystack, size_t length,
+              const char *needle, size_t n);
+
+END_DECLS
+
@@ -0,0 +1,162 @@
+/*==========================================================================
+
+  kzgrep
+  threadpool.c
+  Copyright (c)2020 Kevin Boone
+  Distributed under the terms of the GPL v3.0
+
+  A fixed-size pool of worker threads, taking tasks from a FIFO queue.
+  There's nothing clever here -- a single mutex protects the queue, 
+  which is fine so long as each task represents a reasonable amount of 
+  work, like searching a whole zipfile.
+
+==========================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "defs.h" 
+#include "log.h" 
+#include "threadpool.h" 
+
+typedef struct _ThreadPoolTask
+  {
+  struct _ThreadPoolTask *next;
+  ThreadPoolFn fn;
+  void *arg;
+  } ThreadPoolTask;
+
+struct _ThreadPool
+  {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  ThreadPoolTask *head;
+  ThreadPoolTask *tail;
+  BOOL closing;
+  int threads;
+  pthread_t *workers;
+  };
+
+/*==========================================================================
+  threadpool_worker
+
+  Take tasks from the queue and run them, until the queue is empty and
+    the pool is being destroyed
+==========================================================================*/
+static void *threadpool_worker (void *arg)
+  {
+  ThreadPool *self = arg;
+  pthread_mutex_lock (&self->mutex);
+  for (;;)
+    {
+    ThreadPoolTask *task = self->head;
+    if (task)
+      {
+      self->head = task->next;
+      if (!self->head) self->tail = NULL;
+      pthread_mutex_unlock (&self->mutex);
+      task->fn (task->arg);
+      free (task);
+      pthread_mutex_lock (&self->mutex);
+      }
+    else if (self->closing)
+      break;
+    else
+      pthread_cond_wait (&self->cond, &self->mutex);
+    }
+  pthread_mutex_unlock (&self->mutex);
+  return NULL;
+  }
+
+/*==========================================================================
+  threadpool_create
+==========================================================================*/
+ThreadPool *threadpool_create (int threads)
+  {
+  LOG_IN
+  ThreadPool *self = malloc (sizeof (ThreadPool));
+  memset (self, 0, sizeof (ThreadPool));
+  pthread_mutex_init (&self->mutex, NULL);
+  pthread_cond_init (&self->cond, NULL);
+  self->workers = malloc (threads * sizeof (pthread_t));
+  for (int i = 0; i < threads; i++)
+    {
+    int error = pthread_create (&self->workers[i], NULL, 
+      threadpool_worker, self);
+    if (error)
+      {
+      log_warning ("Can't start worker thread: %s", strerror (error));
+      break;
+      }
+    self->threads++;
+    }
+  log_debug ("Started %d worker thread(s)", self->threads);
+  LOG_OUT
+  return self;
+  }
+
+/*==========================================================================
+  threadpool_destroy
+==========================================================================*/
+void threadpool_destroy (ThreadPool *self)
+  {
+  LOG_IN
+  if (self)
+    {
+    pthread_mutex_lock (&self->mutex);
+    self->closing = TRUE;
+    pthread_cond_broadcast (&self->cond);
+    pthread_mutex_unlock (&self->mutex);
+
+    for (int i = 0; i < self->threads; i++)
+      pthread_join (self->workers[i], NULL);
+
+    pthread_cond_destroy (&self->cond);
+    pthread_mutex_destroy (&self->mutex);
+    free (self->workers);
+    free (self);
+    }
+  LOG_OUT
+  }
+
+/*==========================================================================
+  threadpool_get_threads
+==========================================================================*/
+int threadpool_get_threads (const ThreadPool *self)
+  {
+  return self->threads;
+  }
+
+/*==========================================================================
+  threadpool_submit
+==========================================================================*/
+void threadpool_submit (ThreadPool *self, ThreadPoolFn fn, void *arg)
+  {
+  LOG_IN
+  if (self->threads == 0)
+    {
+    // No thread could be started at all. Rather than leave the task
+    //   waiting forever, do it here
+    fn (arg);
+    }
+  else
+    {
+    ThreadPoolTask *task = malloc (sizeof (ThreadPoolTask));
+    task->next = NULL;
+    task->fn = fn;
+    task->arg = arg;
+
+    pthread_mutex_lock (&self->mutex);
+    if (self->tail)
+      self->tail->next = task;
+    else
+      self->head = task;
+    self->tail = task;
+    pthread_cond_signal (&self->cond);
+    pthread_mutex_unlock (&self->mutex);
+    }
+  LOG_OUT
+  }
+
@@ -0,0 +1,40 @@
+/*==========================================================================
+
+  kzgrep
+  threadpool.h
+  Copyright (c)2020 Kevin Boone
+  Distributed under the terms of the GPL v3.0
+
+==========================================================================*/
+
+#pragma once
+
+#include "defs.h"
+
+BEGIN_DECLS
+
+struct _ThreadPool;
+typedef struct _ThreadPool ThreadPool;
+
+// A task to be run on one of the pool's threads 
+typedef void (*ThreadPoolFn) (void *arg);
+
+// Start the specified number of worker threads
+ThreadPool *threadpool_create (int threads);
+
+// Wait for all the tasks that have been submitted to finish, then
+//   stop the worker threads
+void threadpool_destroy (ThreadPool *self);
+
+// Get the number of threads that were actually started. This might be 
+//   fewer than were asked for, or even zero, in which case tasks are 
+//   run by the thread that submits them
+int threadpool_get_threads (const ThreadPool *self);
+
+// Queue a task. Tasks are started in the order they are submitted, but
+//   may finish in any order. The queue is not bounded -- it's up to the
+//   caller not to submit more work than it is prepared to hold in memory
+void threadpool_submit (ThreadPool *self, ThreadPoolFn fn, void *arg);
+
+END_DECLS
+
@@ -22,22 +22,43 @@
 void usage_show (FILE *fout, const char *argv0)
   {
   fprintf (fout, "Usage: %s [options] {pattern} {files}\n", argv0);
+  fprintf (fout, "  -A,--after-context=N    show N lines after each match\n");
   fprintf (fout, "  -a,--all                include hiden paths\n");
+  fprintf (fout, "     --batch=FILE         run each query in FILE\n");
+  fprintf (fout, "  -B,--before-context=N   show N lines before each match\n");
+  fprintf (fout, "  -b,--byte-offset        show offsets of matches\n");
+  fprintf (fout, "  -C,--context=N          show N lines around each match\n");
+  fprintf (fout, "  -c,--count              count matching lines\n");
   fprintf (fout, "  -?,--help               show this message\n");
   fprintf (fout, "     --entries=patterns   include entries with patterns\n");
+  fprintf (fout, "  -F,--fixed-strings      pattern is a string, not a regex\n");
+  fprintf (fout, "     --file=FILE          read patterns from FILE\n");
   fprintf (fout, "     --files=patterns     include files wth patterns\n");
+  fprintf (fout, "     --files-with-matches show only matching files\n");
+  fprintf (fout, "  -L,--files-without-match\n");
+  fprintf (fout, "                          show only non-matching files\n");
   fprintf (fout, "  -e,--no-entryname       don't show entry filenames\n");
   fprintf (fout, "  -f,--first              stop after first matching entry\n");
   fprintf (fout, "  -i,--ignore-case        ignore letter case\n");
   fprintf (fout, "  -h,--no-filename        suppress filename output\n");
   fprintf (fout, "  -I,--no-binary          ignore binary entries\n");
   fprintf (fout, "  -l,--log-level=N        log level, 0-5 (default 2)\n");
-  fprintf (fout, "  -m,--max-size=N         max size of compressed entry\n");
+  fprintf (fout, "     --match-limit=N      max regex work per search; 0=PCRE's\n");
+  fprintf (fout, "     --max-match=N        with -z or binary, longest match\n");
+  fprintf (fout, "  -m,--max-size=N         max entry size; 0=no limit\n");
+  fprintf (fout, "  -z,--multiline          matches may span lines\n");
   fprintf (fout, "  -n,--line-number        show matching line numbers\n");
   fprintf (fout, "  -o,--word-regexp        'word match' mode\n");
+  fprintf (fout, "     --output=FILE        write matches to FILE\n");
+  fprintf (fout, "     --prefetch=N         inflate up to N Mb ahead; 0=off\n");
   fprintf (fout, "  -q,--quiet              produce no normal output\n");
   fprintf (fout, "  -r,--recurse            expand directories\n");
+  fprintf (fout, "     --recursion-limit=N  max regex recursion; 0=PCRE's\n");
+  fprintf (fout, "     --regexp=PATTERN     search for PATTERN; may repeat\n");
   fprintf (fout, "     --text               treat all entries as text\n");
+  fprintf (fout, "     --text-only          search text of XML/HTML, not markup\n");
+  fprintf (fout, "     --threads=N          search N files at once; 0=all CPUs\n");
+  fprintf (fout, "     --unordered          with --threads, don't sort output\n");
   fprintf (fout, "  -v,--version            show version\n");
   fprintf (fout, "  -w,--width=N            set text output width; 0=all\n");
   }
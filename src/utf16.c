@@ -0,0 +1,269 @@
+/*==========================================================================
+
+  kzgrep
+  utf16.c
+  Copyright (c)2020 Kevin Boone
+  Distributed under the terms of the GPL v3.0
+
+  Convert UTF-16 entries -- some XML files, and resources in Java and
+  Office files -- to UTF-8 as they are decompressed, so they can be
+  searched as text. This does the same job as ConvertUTF16toUTF8() in
+  convertutf.c, but works on a stream of bytes in either byte order,
+  split into pieces anywhere, and is quicker for the text we usually
+  see, which is mostly ASCII.
+
+  On x86, the input is taken 16 bytes -- 8 code units -- at a time with
+  SSE2, which every x86-64 CPU has. If all 8 units are ASCII, they are
+  packed into 8 bytes of output with a single instruction; if not, that
+  block is converted a unit at a time. Elsewhere, the whole thing is
+  done a unit at a time.
+
+==========================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "defs.h"
+#include "log.h"
+#include "utf16.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#include <immintrin.h>
+#define UTF16_X86 1
+#endif
+
+// How much of the start of the data utf16_detect() looks at
+#define UTF16_DETECT_SIZE 1024
+
+// Without a byte order mark, a sample shorter than this is never taken 
+//   to be UTF-16 -- there's too little of it to be sure
+#define UTF16_DETECT_MIN 32
+
+struct _Utf16
+  {
+  Utf16Order order;
+  BYTE odd; // The first byte of a code unit that was split
+  BOOL has_odd;
+  uint32_t high; // A high surrogate, waiting for its partner; or 0
+  };
+
+/*==========================================================================
+  utf16_detect
+==========================================================================*/
+Utf16Order utf16_detect (const BYTE *s, size_t n, size_t *bom)
+  {
+  *bom = 0;
+  if (n >= 2 && s[0] == 0xFF && s[1] == 0xFE)
+    {
+    // FF FE 00 00 would be UTF-32, which we don't handle
+    if (n >= 4 && s[2] == 0 && s[3] == 0) return UTF16_NONE;
+    *bom = 2;
+    return UTF16_LE;
+    }
+  if (n >= 2 && s[0] == 0xFE && s[1] == 0xFF)
+    {
+    *bom = 2;
+    return UTF16_BE;
+    }
+
+  // Without a byte order mark, we need at least three quarters of the 
+  //   characters to be printable ASCII, so that one byte of each is 
+  //   null, and far fewer to look like that in the other byte order -- a
+  //   few characters, like U+4E00, do. Binary data rarely has a pattern
+  //   like this, and UTF-8 text has no nulls at all, so a sample with 
+  //   none is text as it is, and a few stray nulls in text are nowhere 
+  //   near enough
+  if (n > UTF16_DETECT_SIZE) n = UTF16_DETECT_SIZE;
+  if (n < UTF16_DETECT_MIN || !memchr (s, 0, n)) return UTF16_NONE;
+  size_t pairs = n / 2;
+  size_t le = 0, be = 0;
+  for (size_t i = 0; i < pairs; i++)
+    {
+    BYTE a = s[2 * i], b = s[2 * i + 1];
+    BOOL a_text = a == '\t' || a == '\n' || a == '\r' ||
+      (a >= 0x20 && a < 0x7F);
+    BOOL b_text = b == '\t' || b == '\n' || b == '\r' ||
+      (b >= 0x20 && b < 0x7F);
+    if (b == 0 && a_text) le++;
+    if (a == 0 && b_text) be++;
+    }
+  if (le >= pairs * 3 / 4 && le > 16 * be) return UTF16_LE;
+  if (be >= pairs * 3 / 4 && be > 16 * le) return UTF16_BE;
+  return UTF16_NONE;
+  }
+
+/*==========================================================================
+  utf16_create
+==========================================================================*/
+Utf16 *utf16_create (Utf16Order order)
+  {
+  LOG_IN
+  Utf16 *self = malloc (sizeof (Utf16));
+  memset (self, 0, sizeof (Utf16));
+  self->order = order;
+  LOG_OUT
+  return self;
+  }
+
+/*==========================================================================
+  utf16_destroy
+==========================================================================*/
+void utf16_destroy (Utf16 *self)
+  {
+  LOG_IN
+  free (self);
+  LOG_OUT
+  }
+
+/*==========================================================================
+  utf16_put
+
+  Write a character as UTF-8. Returns the number of bytes written
+==========================================================================*/
+static inline int utf16_put (uint32_t c, BYTE *out)
+  {
+  if (c < 0x80)
+    {
+    out[0] = c;
+    return 1;
+    }
+  if (c < 0x800)
+    {
+    out[0] = 0xC0 | (c >> 6);
+    out[1] = 0x80 | (c & 0x3F);
+    return 2;
+    }
+  if (c < 0x10000)
+    {
+    out[0] = 0xE0 | (c >> 12);
+    out[1] = 0x80 | ((c >> 6) & 0x3F);
+    out[2] = 0x80 | (c & 0x3F);
+    return 3;
+    }
+  out[0] = 0xF0 | (c >> 18);
+  out[1] = 0x80 | ((c >> 12) & 0x3F);
+  out[2] = 0x80 | ((c >> 6) & 0x3F);
+  out[3] = 0x80 | (c & 0x3F);
+  return 4;
+  }
+
+/*==========================================================================
+  utf16_unit
+
+  Convert one code unit, pairing surrogates. Returns the number of bytes
+    written
+==========================================================================*/
+static inline int utf16_unit (Utf16 *self, uint32_t u, BYTE *out)
+  {
+  int k = 0;
+  if (self->high)
+    {
+    if (u >= 0xDC00 && u <= 0xDFFF)
+      {
+      uint32_t c = 0x10000 + ((self->high - 0xD800) << 10) + (u - 0xDC00);
+      self->high = 0;
+      return utf16_put (c, out);
+      }
+    k = utf16_put (0xFFFD, out);
+    self->high = 0;
+    }
+  if (u >= 0xD800 && u <= 0xDBFF)
+    self->high = u;
+  else if (u >= 0xDC00 && u <= 0xDFFF)
+    k += utf16_put (0xFFFD, out + k);
+  else
+    k += utf16_put (u, out + k);
+  return k;
+  }
+
+#ifdef UTF16_X86
+/*==========================================================================
+  utf16_ascii_sse2
+
+  Convert as many blocks of 8 code units as are all ASCII, from the
+    start of the input. Sets *used to the number of bytes of input used,
+    and returns the number of bytes written
+==========================================================================*/
+static size_t utf16_ascii_sse2 (Utf16Order order, const BYTE *in, size_t n,
+    BYTE *out, size_t *used)
+  {
+  const __m128i high = _mm_set1_epi16 ((short)0xFF80);
+  const __m128i zero = _mm_setzero_si128 ();
+  size_t i = 0;
+  while (i + 16 <= n)
+    {
+    __m128i v = _mm_loadu_si128 ((const __m128i *)(in + i));
+    if (order == UTF16_BE)
+      v = _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+    __m128i test = _mm_cmpeq_epi16 (_mm_and_si128 (v, high), zero);
+    if (_mm_movemask_epi8 (test) != 0xFFFF) break;
+    _mm_storel_epi64 ((__m128i *)(out + i / 2), _mm_packus_epi16 (v, v));
+    i += 16;
+    }
+  *used = i;
+  return i / 2;
+  }
+#endif
+
+/*==========================================================================
+  utf16_decode
+==========================================================================*/
+size_t utf16_decode (Utf16 *self, const BYTE *in, size_t n, BYTE *out,
+         BOOL eof)
+  {
+  size_t k = 0;
+  size_t i = 0;
+  BOOL le = self->order == UTF16_LE;
+
+  if (self->has_odd && n > 0)
+    {
+    uint32_t u = le ? self->odd | (in[0] << 8) : (self->odd << 8) | in[0];
+    k += utf16_unit (self, u, out + k);
+    self->has_odd = FALSE;
+    i = 1;
+    }
+
+  while (i + 1 < n)
+    {
+#ifdef UTF16_X86
+    if (!self->high)
+      {
+      size_t used;
+      k += utf16_ascii_sse2 (self->order, in + i, n - i, out + k, &used);
+      i += used;
+      // Convert the rest of the block that stopped the fast path
+      size_t end = i + 16 < n ? i + 16 : n;
+      for (; i + 1 < end; i += 2)
+        {
+        uint32_t u = le ? in[i] | (in[i + 1] << 8)
+          : (in[i] << 8) | in[i + 1];
+        k += utf16_unit (self, u, out + k);
+        }
+      continue;
+      }
+#endif
+    uint32_t u = le ? in[i] | (in[i + 1] << 8) : (in[i] << 8) | in[i + 1];
+    k += utf16_unit (self, u, out + k);
+    i += 2;
+    }
+
+  if (i < n)
+    {
+    self->odd = in[i];
+    self->has_odd = TRUE;
+    }
+
+  if (eof)
+    {
+    // A code unit cut short, or a surrogate without a partner, is
+    //   not a character
+    if (self->high || self->has_odd)
+      k += utf16_put (0xFFFD, out + k);
+    self->high = 0;
+    self->has_odd = FALSE;
+    }
+  return k;
+  }
+
@@ -0,0 +1,54 @@
+/*==========================================================================
+
+  kzgrep
+  utf16.h
+  Copyright (c)2020 Kevin Boone
+  Distributed under the terms of the GPL v3.0
+
+==========================================================================*/
+
+#pragma once
+
+#include <stddef.h>
+#include "defs.h"
+
+typedef enum
+  {
+  UTF16_NONE = 0, // Not UTF-16, so far as we can tell
+  UTF16_LE,
+  UTF16_BE
+  } Utf16Order;
+
+// The most that utf16_decode() can write, for n bytes of input
+#define UTF16_MAX_OUTPUT(n) (3 * ((n) / 2 + 2))
+
+struct _Utf16;
+typedef struct _Utf16 Utf16;
+
+BEGIN_DECLS
+
+// Decide whether data that starts with these n bytes is UTF-16, and in
+//   which byte order: by its byte order mark if it has one, or else if
+//   there is enough of it, and it looks like mostly-ASCII text with a 
+//   null in every other byte.
+//   If there is a byte order mark, *bom is set to its length, 2;
+//   otherwise to 0
+Utf16Order utf16_detect (const BYTE *s, size_t n, size_t *bom);
+
+// Create a decoder for a single document, which is then passed to
+//   utf16_decode() in pieces, in order
+Utf16     *utf16_create (Utf16Order order);
+
+void       utf16_destroy (Utf16 *self);
+
+// Convert n more bytes of UTF-16 to UTF-8, writing to out, which must
+//   have room for UTF16_MAX_OUTPUT(n) bytes. The pieces can be split
+//   anywhere -- even in the middle of a code unit, or of a surrogate
+//   pair. A surrogate without its partner becomes U+FFFD. If eof is
+//   TRUE, this is the end of the document, and anything held back is
+//   written. Returns the number of bytes written
+size_t     utf16_decode (Utf16 *self, const BYTE *in, size_t n, BYTE *out,
+             BOOL eof);
+
+END_DECLS
+
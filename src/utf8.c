@@ -0,0 +1,407 @@
+/*==========================================================================
+
+  kzgrep
+  utf8.c
+  Copyright (c)2020 Kevin Boone
+  Distributed under the terms of the GPL v3.0
+
+  Check whether data is valid UTF-8. This decides whether an entry is
+  searched as text, and whether the regex engine can be told that the
+  text has already been checked. Every byte of every text entry goes
+  through here, so it has to be fast.
+
+  On x86, the data is checked a block of 16 (SSSE3) or 32 (AVX2) bytes
+  at a time, by the 'lookup' method of Keiser and Lemire. Almost every
+  error in UTF-8 can be detected by looking at two consecutive bytes:
+  the high nibble of the first, its low nibble, and the high nibble of
+  the second are each looked up in a 16-entry table, with a vector
+  shuffle, and the three results are ANDed together. Each bit stands
+  for one kind of error, so it survives only if all three lookups agree
+  that it's present. What's left -- whether the third and fourth bytes
+  of a character are continuation bytes -- is checked by looking two
+  and three bytes back. A block of plain ASCII needs only a single
+  test. AVX2 is used if the CPU has it, which is checked at run time,
+  and elsewhere we use a simple loop, that also skips ASCII quickly.
+
+==========================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "defs.h"
+#include "utf8.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#include <immintrin.h>
+#define UTF8_X86 1
+#endif
+
+#ifdef UTF8_X86
+static BOOL utf8_avx2 = FALSE;
+static BOOL utf8_ssse3 = FALSE;
+static pthread_once_t utf8_once = PTHREAD_ONCE_INIT;
+
+// The kinds of error that can be seen in a pair of bytes. Each is
+//   a bit in the lookup tables
+#define UTF8_TOO_SHORT      0x01 // Lead byte not followed by continuation
+#define UTF8_TOO_LONG       0x02 // Continuation after ASCII
+#define UTF8_OVERLONG_3     0x04 // 11100000 100_____
+#define UTF8_TOO_LARGE      0x08 // Above U+10FFFF
+#define UTF8_SURROGATE      0x10 // 11101101 101_____
+#define UTF8_OVERLONG_2     0x20 // 1100000_ 10______
+#define UTF8_TOO_LARGE_1000 0x40 // Above U+10FFFF, second byte 1000____
+#define UTF8_OVERLONG_4     0x40 // 11110000 1000____
+#define UTF8_TWO_CONTS      0x80 // Continuation after continuation;
+                                 //   only an error if the character
+                                 //   can't have a third or fourth byte
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+// Indexed by the high nibble of the first byte of a pair
+static const BYTE utf8_byte_1_high[16] =
+  {
+  // 0_______ ASCII
+  UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+  UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+  // 10______ continuation
+  UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+  // 1100____ two-byte lead
+  UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+  // 1101____ two-byte lead
+  UTF8_TOO_SHORT,
+  // 1110____ three-byte lead
+  UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+  // 1111____ four-byte lead
+  UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+  };
+
+// Indexed by the low nibble of the first byte
+static const BYTE utf8_byte_1_low[16] =
+  {
+  UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+  UTF8_CARRY | UTF8_OVERLONG_2,
+  UTF8_CARRY,
+  UTF8_CARRY,
+  UTF8_CARRY | UTF8_TOO_LARGE,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+  };
+
+// Indexed by the high nibble of the second byte
+static const BYTE utf8_byte_2_high[16] =
+  {
+  // 0_______ ASCII
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+  // 1000____
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3
+    | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+  // 1001____
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3
+    | UTF8_TOO_LARGE,
+  // 101_____
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE
+    | UTF8_TOO_LARGE,
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE
+    | UTF8_TOO_LARGE,
+  // 11______ lead
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+  };
+
+// A block whose last bytes are greater than these ends part-way through
+//   a character
+static const BYTE utf8_max_value[32] =
+  {
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1
+  };
+#endif
+
+/*==========================================================================
+  utf8_classify_simple
+
+  Check each character in turn. Used where there is no vector check
+==========================================================================*/
+static Utf8Class utf8_classify_simple (const BYTE *s, size_t n)
+  {
+  Utf8Class ret = UTF8_ASCII;
+  size_t i = 0;
+  while (i < n)
+    {
+    // Skip ASCII eight bytes at a time
+    uint64_t w;
+    if (i + 8 <= n)
+      {
+      memcpy (&w, s + i, 8);
+      if ((w & 0x8080808080808080ULL) == 0)
+        {
+        i += 8;
+        continue;
+        }
+      }
+    BYTE c = s[i];
+    if (c < 0x80)
+      {
+      i++;
+      continue;
+      }
+
+    // The range of the second byte depends on the first
+    size_t length;
+    BYTE lo = 0x80, hi = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) length = 2;
+    else if (c == 0xE0) { length = 3; lo = 0xA0; }
+    else if (c == 0xED) { length = 3; hi = 0x9F; }
+    else if (c >= 0xE1 && c <= 0xEF) length = 3;
+    else if (c == 0xF0) { length = 4; lo = 0x90; }
+    else if (c >= 0xF1 && c <= 0xF3) length = 4;
+    else if (c == 0xF4) { length = 4; hi = 0x8F; }
+    else return UTF8_INVALID;
+
+    if (i + length > n || s[i + 1] < lo || s[i + 1] > hi)
+      return UTF8_INVALID;
+    for (size_t k = 2; k < length; k++)
+      if ((s[i + k] & 0xC0) != 0x80) return UTF8_INVALID;
+    ret = UTF8_VALID;
+    i += length;
+    }
+  return ret;
+  }
+
+#ifdef UTF8_X86
+
+/*==========================================================================
+  utf8_init
+==========================================================================*/
+static void utf8_init (void)
+  {
+  __builtin_cpu_init ();
+  utf8_avx2 = __builtin_cpu_supports ("avx2");
+  utf8_ssse3 = __builtin_cpu_supports ("ssse3");
+  }
+
+/*==========================================================================
+  utf8_check_ssse3
+
+  Returns the errors in a block, given the block before it (or zeros)
+==========================================================================*/
+__attribute__((target("ssse3")))
+static inline __m128i utf8_check_ssse3 (__m128i input, __m128i prev_input)
+  {
+  const __m128i nibble = _mm_set1_epi8 (0x0F);
+  __m128i prev1 = _mm_alignr_epi8 (input, prev_input, 15);
+  __m128i byte_1_high = _mm_shuffle_epi8
+    (_mm_loadu_si128 ((const __m128i *)utf8_byte_1_high),
+     _mm_and_si128 (_mm_srli_epi16 (prev1, 4), nibble));
+  __m128i byte_1_low = _mm_shuffle_epi8
+    (_mm_loadu_si128 ((const __m128i *)utf8_byte_1_low),
+     _mm_and_si128 (prev1, nibble));
+  __m128i byte_2_high = _mm_shuffle_epi8
+    (_mm_loadu_si128 ((const __m128i *)utf8_byte_2_high),
+     _mm_and_si128 (_mm_srli_epi16 (input, 4), nibble));
+  __m128i special = _mm_and_si128 (_mm_and_si128 (byte_1_high,
+    byte_1_low), byte_2_high);
+
+  // Two continuation bytes in a row are correct only where the byte two
+  //   back is a three- or four-byte lead, or the byte three back is a
+  //   four-byte lead; and then they are required
+  __m128i prev2 = _mm_alignr_epi8 (input, prev_input, 14);
+  __m128i prev3 = _mm_alignr_epi8 (input, prev_input, 13);
+  __m128i third = _mm_subs_epu8 (prev2, _mm_set1_epi8 ((char)(0xE0 - 0x80)));
+  __m128i fourth = _mm_subs_epu8 (prev3, _mm_set1_epi8 ((char)(0xF0 - 0x80)));
+  __m128i must23 = _mm_and_si128 (_mm_or_si128 (third, fourth),
+    _mm_set1_epi8 ((char)0x80));
+  return _mm_xor_si128 (must23, special);
+  }
+
+/*==========================================================================
+  utf8_classify_ssse3
+==========================================================================*/
+__attribute__((target("ssse3")))
+static Utf8Class utf8_classify_ssse3 (const BYTE *s, size_t n)
+  {
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i max_value = _mm_loadu_si128
+    ((const __m128i *)(utf8_max_value + 16));
+  __m128i prev_input = zero;
+  __m128i prev_incomplete = zero;
+  __m128i error = zero;
+  BOOL ascii = TRUE;
+  BYTE last[16];
+
+  for (size_t i = 0; i < n; i += 16)
+    {
+    __m128i input;
+    if (i + 16 <= n)
+      input = _mm_loadu_si128 ((const __m128i *)(s + i));
+    else
+      {
+      // A final part-block is padded with zeros, which are ASCII, so a
+      //   character that is cut short shows up as an error
+      memset (last, 0, sizeof (last));
+      memcpy (last, s + i, n - i);
+      input = _mm_loadu_si128 ((const __m128i *)last);
+      }
+    if (_mm_movemask_epi8 (input) == 0)
+      error = _mm_or_si128 (error, prev_incomplete);
+    else
+      {
+      ascii = FALSE;
+      error = _mm_or_si128 (error, utf8_check_ssse3 (input, prev_input));
+      if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (error, zero)) != 0xFFFF)
+        return UTF8_INVALID;
+      }
+    prev_incomplete = _mm_subs_epu8 (input, max_value);
+    prev_input = input;
+    }
+
+  error = _mm_or_si128 (error, prev_incomplete);
+  if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (error, zero)) != 0xFFFF)
+    return UTF8_INVALID;
+  return ascii ? UTF8_ASCII : UTF8_VALID;
+  }
+
+/*==========================================================================
+  utf8_prev_avx2
+
+  The bytes of the block shifted along by n, with the last n bytes
+    of the previous block in front. AVX2 can only shift within each
+    half of a block, so the half that straddles the two blocks is
+    made up first
+==========================================================================*/
+#define utf8_prev_avx2(input, prev_input, n) \
+  _mm256_alignr_epi8 (input, \
+    _mm256_permute2x128_si256 (prev_input, input, 0x21), 16 - (n))
+
+/*==========================================================================
+  utf8_check_avx2
+
+  As utf8_check_ssse3()
+==========================================================================*/
+__attribute__((target("avx2")))
+static inline __m256i utf8_check_avx2 (__m256i input, __m256i prev_input)
+  {
+  const __m256i nibble = _mm256_set1_epi8 (0x0F);
+  __m256i prev1 = utf8_prev_avx2 (input, prev_input, 1);
+  __m256i byte_1_high = _mm256_shuffle_epi8
+    (_mm256_broadcastsi128_si256
+       (_mm_loadu_si128 ((const __m128i *)utf8_byte_1_high)),
+     _mm256_and_si256 (_mm256_srli_epi16 (prev1, 4), nibble));
+  __m256i byte_1_low = _mm256_shuffle_epi8
+    (_mm256_broadcastsi128_si256
+       (_mm_loadu_si128 ((const __m128i *)utf8_byte_1_low)),
+     _mm256_and_si256 (prev1, nibble));
+  __m256i byte_2_high = _mm256_shuffle_epi8
+    (_mm256_broadcastsi128_si256
+       (_mm_loadu_si128 ((const __m128i *)utf8_byte_2_high)),
+     _mm256_and_si256 (_mm256_srli_epi16 (input, 4), nibble));
+  __m256i special = _mm256_and_si256 (_mm256_and_si256 (byte_1_high,
+    byte_1_low), byte_2_high);
+
+  __m256i prev2 = utf8_prev_avx2 (input, prev_input, 2);
+  __m256i prev3 = utf8_prev_avx2 (input, prev_input, 3);
+  __m256i third = _mm256_subs_epu8 (prev2,
+    _mm256_set1_epi8 ((char)(0xE0 - 0x80)));
+  __m256i fourth = _mm256_subs_epu8 (prev3,
+    _mm256_set1_epi8 ((char)(0xF0 - 0x80)));
+  __m256i must23 = _mm256_and_si256 (_mm256_or_si256 (third, fourth),
+    _mm256_set1_epi8 ((char)0x80));
+  return _mm256_xor_si256 (must23, special);
+  }
+
+/*==========================================================================
+  utf8_classify_avx2
+==========================================================================*/
+__attribute__((target("avx2")))
+static Utf8Class utf8_classify_avx2 (const BYTE *s, size_t n)
+  {
+  const __m256i zero = _mm256_setzero_si256 ();
+  const __m256i max_value = _mm256_loadu_si256
+    ((const __m256i *)utf8_max_value);
+  __m256i prev_input = zero;
+  __m256i prev_incomplete = zero;
+  __m256i error = zero;
+  BOOL ascii = TRUE;
+  BYTE last[32];
+
+  for (size_t i = 0; i < n; i += 32)
+    {
+    __m256i input;
+    if (i + 32 <= n)
+      input = _mm256_loadu_si256 ((const __m256i *)(s + i));
+    else
+      {
+      memset (last, 0, sizeof (last));
+      memcpy (last, s + i, n - i);
+      input = _mm256_loadu_si256 ((const __m256i *)last);
+      }
+    if (_mm256_movemask_epi8 (input) == 0)
+      error = _mm256_or_si256 (error, prev_incomplete);
+    else
+      {
+      ascii = FALSE;
+      error = _mm256_or_si256 (error, utf8_check_avx2 (input, prev_input));
+      if (!_mm256_testz_si256 (error, error)) return UTF8_INVALID;
+      }
+    prev_incomplete = _mm256_subs_epu8 (input, max_value);
+    prev_input = input;
+    }
+
+  error = _mm256_or_si256 (error, prev_incomplete);
+  if (!_mm256_testz_si256 (error, error)) return UTF8_INVALID;
+  return ascii ? UTF8_ASCII : UTF8_VALID;
+  }
+
+#endif
+
+/*==========================================================================
+  utf8_incomplete
+
+  The number of bytes at the end of the data that belong to a character
+    that has been cut short. They are not checked here -- if they're not
+    the start of a valid character, that will be found when the rest of
+    it arrives
+==========================================================================*/
+static size_t utf8_incomplete (const BYTE *s, size_t n)
+  {
+  for (size_t k = 1; k <= 3 && k <= n; k++)
+    {
+    BYTE c = s[n - k];
+    if ((c & 0xC0) == 0x80) continue;
+    size_t length = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+    return length > k ? k : 0;
+    }
+  return 0;
+  }
+
+/*==========================================================================
+  utf8_classify
+==========================================================================*/
+Utf8Class utf8_classify (const BYTE *s, size_t n, size_t *incomplete)
+  {
+  if (incomplete)
+    {
+    *incomplete = utf8_incomplete (s, n);
+    n -= *incomplete;
+    }
+#ifdef UTF8_X86
+  pthread_once (&utf8_once, utf8_init);
+  if (utf8_avx2) return utf8_classify_avx2 (s, n);
+  if (utf8_ssse3) return utf8_classify_ssse3 (s, n);
+#endif
+  return utf8_classify_simple (s, n);
+  }
+
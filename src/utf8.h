@@ -0,0 +1,33 @@
+/*==========================================================================
+
+  kzgrep
+  utf8.h
+  Copyright (c)2020 Kevin Boone
+  Distributed under the terms of the GPL v3.0
+
+==========================================================================*/
+
+#pragma once
+
+#include <stddef.h>
+#include "defs.h"
+
+typedef enum
+  {
+  UTF8_ASCII = 0, // Nothing but ASCII, which is valid UTF-8 as well
+  UTF8_VALID, // Valid UTF-8, with some characters outside ASCII
+  UTF8_INVALID
+  } Utf8Class;
+
+BEGIN_DECLS
+
+// Check whether n bytes are valid UTF-8, by the strict definition that
+//   PCRE uses: no overlong forms, surrogates, or characters above
+//   U+10FFFF. If incomplete is NULL, a character cut short at the end of
+//   the data makes it invalid. Otherwise that is allowed, and *incomplete
+//   is set to the number of bytes it has so far (0 if there is none).
+//   Any number of threads may call this function at the same time
+Utf8Class utf8_classify (const BYTE *s, size_t n, size_t *incomplete);
+
+END_DECLS
+
@@ -21,6 +21,16 @@
     permissions are set by the user's unask (so usually end up 644).
   The actual data decompression is carried out by zlib, which must be
     linked with the application.
+  The file is opened only once, by zipfile_read_contents(). Where possible
+    it is mapped into memory, and all header parsing and data access 
+    is done directly from the mapping, through bounds-checked cursors. 
+    For regular files that can't be mapped, we keep the descriptor open
+    and use pread(). Either way, there is no further open() or lseek() 
+    for each entry. Pipes and other files that can't be read at an 
+    offset are not supported.
+  Once zipfile_read_contents() has succeeded, nothing modifies the 
+    ZipFile until it is destroyed, so any number of threads can read
+    and extract entries from it at the same time. 
 
   Limitations:
 
@@ -49,38 +59,165 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <ctype.h>
+#include <limits.h>
 #include <zlib.h>
 #include "defs.h" 
 #include "log.h" 
 #include "zipfile.h" 
-#include "list.h" 
 #include "path.h" 
 #include "feature.h"
 
 #ifdef FEATURE_ZIPFILE
 
+// One entry in the index. These are stored in a single contiguous array,
+//   so they must stay small, and of fixed size -- the filename is not
+//   stored here, but in the ZipFile's string pool, as an offset to a
+//   null-terminated string.
+typedef struct _ZipEntry
+  {
+  uint64_t compressed_size;
+  uint64_t uncompressed_size;
+  uint64_t local_header;
+  uint32_t name_offset;
+  uint16_t name_length;
+  uint16_t method;
+  uint16_t mode;
+  } ZipEntry;
+
 struct _ZipFile
   {
   char *filename;
-  List *contents; // List of struct ZipHeader
+  ZipEntry *entries; // NULL until the index has been read
+  int num_entries;
+  int max_entries; // Allocated size of entries
+  char *names; // String pool for entry filenames
+  uint64_t names_length;
+  uint64_t names_size; // Allocated size of names
+  int fd; // -1 until zipfile_read_contents() has opened the file
+  const BYTE *map; // NULL if the file could not be mapped
+  uint64_t size;
   }; 
 
+// State of an entry that is being extracted a piece at a time. When
+//   the file is mapped, the whole of the entry's data is available to
+//   zlib at once, and 'input' is not used.
+// ZipStream objects are recycled -- see zipfile_stream_alloc() -- so
+//   the zlib state and the input buffer are set up once per thread, 
+//   not once per entry.
+struct _ZipStream
+  {
+  const ZipFile *zipfile;
+  const ZipEntry *entry;
+  uint64_t offset; // Offset in the file of the next stored data to read
+  uint64_t remaining; // Stored data not yet read
+  uint64_t produced; // Decompressed bytes so far
+  BYTE *input; // For pread(); allocated when first needed 
+  BOOL finished;
+  BOOL zs_ready; // zs has been through inflateInit2()
+  z_stream zs;
+  };
+
+// Size of the input buffer for streams that can't use the mapping
+#define ZIP_STREAM_INPUT 65536
+
+// Number of idle ZipStream objects each thread keeps for reuse. There
+//   is rarely more than one stream open at a time in a thread
+#define ZIP_STREAM_CACHE 4
+
+typedef struct _ZipStreamCache
+  {
+  ZipStream *streams[ZIP_STREAM_CACHE];
+  int count;
+  } ZipStreamCache;
+
+static pthread_key_t zipfile_cache_key;
+static pthread_once_t zipfile_cache_once = PTHREAD_ONCE_INIT;
+
+// A ZipCursor is a read position in a block of zipfile data that is
+//   already in memory, either in the file mapping or in a scratch buffer.
+//   Reads past the end of the block return zero and set 'overrun', so
+//   a truncated or malicious header can never take us outside the 
+//   data. Callers parse a whole header, then check 'overrun' once.
+typedef struct _ZipCursor
+  {
+  const BYTE *data;
+  uint64_t length;
+  uint64_t pos;
+  BOOL overrun;
+  } ZipCursor;
+
+/*==========================================================================
 
-typedef struct _ZipHeader
+  zipcursor_init
+
+*==========================================================================*/
+static void zipcursor_init (ZipCursor *c, const BYTE *data, uint64_t length)
   {
-  int version;
-  int flags;
-  char filename[PATH_MAX];
-  uint64_t compressed_size;
-  uint64_t uncompressed_size;
-  uint64_t local_header;
-  uint64_t data_start;
-  uint64_t next_header;
-  uint64_t external_attr;
-  unsigned int mode;
-  int method;
-  } ZipHeader;
+  c->data = data;
+  c->length = length;
+  c->pos = 0;
+  c->overrun = FALSE;
+  }
+
+/*==========================================================================
+
+  zipcursor_check
+
+  Returns TRUE if there are at least n bytes left at the cursor. If not,
+    marks the cursor as overrun.
+
+*==========================================================================*/
+static BOOL zipcursor_check (ZipCursor *c, uint64_t n)
+  {
+  if (c->overrun || c->pos > c->length || c->length - c->pos < n)
+    {
+    c->overrun = TRUE;
+    return FALSE;
+    }
+  return TRUE;
+  }
+
+/*==========================================================================
+
+  zipcursor_u16, zipcursor_u32
+
+  Read little-endian integers, and advance the cursor.
+
+*==========================================================================*/
+static unsigned int zipcursor_u16 (ZipCursor *c)
+  {
+  if (!zipcursor_check (c, 2)) return 0;
+  const BYTE *p = c->data + c->pos;
+  c->pos += 2;
+  return p[0] + 256 * p[1];
+  }
+
+static uint64_t zipcursor_u32 (ZipCursor *c)
+  {
+  if (!zipcursor_check (c, 4)) return 0;
+  const BYTE *p = c->data + c->pos;
+  c->pos += 4;
+  return (uint64_t)p[0] + 256 * (uint64_t)p[1] + 
+     256 * 256 * (uint64_t)p[2] + 256 * 256 * 256 * (uint64_t)p[3];
+  }
+
+/*==========================================================================
+
+  zipcursor_bytes
+
+  Return a pointer to the next n bytes, and advance the cursor. Returns 
+    NULL if there are not n bytes left.
+
+*==========================================================================*/
+static const BYTE *zipcursor_bytes (ZipCursor *c, uint64_t n)
+  {
+  if (!zipcursor_check (c, n)) return NULL;
+  const BYTE *p = c->data + c->pos;
+  c->pos += n;
+  return p;
+  }
 
 /*==========================================================================
 
@@ -94,7 +231,15 @@ ZipFile *zipfile_create (const char *filename)
   {
   ZipFile *self = malloc (sizeof (ZipFile));
   self->filename = strdup (filename);
-  self->contents = NULL;
+  self->entries = NULL;
+  self->num_entries = 0;
+  self->max_entries = 0;
+  self->names = NULL;
+  self->names_length = 0;
+  self->names_size = 0;
+  self->fd = -1;
+  self->map = NULL;
+  self->size = 0;
   return self;
   }
 
@@ -112,7 +257,10 @@ void zipfile_destroy (ZipFile *self)
   if (self)
     {
     if (self->filename) free (self->filename);
-    if (self->contents) list_destroy (self->contents);
+    if (self->entries) free (self->entries);
+    if (self->names) free (self->names);
+    if (self->map) munmap ((void *)self->map, self->size);
+    if (self->fd >= 0) close (self->fd);
     free (self);
     }
   LOG_OUT
@@ -120,186 +268,146 @@ void zipfile_destroy (ZipFile *self)
 
 /*==========================================================================
 
-  zipfile_read_local_header
+  zipfile_open
 
-  Read a zip local header, assuming that the file pointer is already in
-    the right place. The only thing we really need to get from the local
-    header is the start of the compressed data. Unfortunately, this is
-    not stored, but calculated from the size of the local header, which is
-    (sigh) variable. So the whole process is far more complicated than it
-    needs to be.
+  Open the file once, for the lifetime of the object. If it is a
+    regular, non-empty file, we map it, and close the descriptor 
+    straight away -- the mapping is all we need. If mmap() fails, as it
+    can on some network filesystems, we keep the descriptor open and 
+    fall back to pread(). A pipe or other non-seekable file has no size
+    to map or read at an offset, so no end-of-CD record will be found, 
+    and it is reported as not being a zipfile.
 
 *==========================================================================*/
-ZipError zipfile_read_local_header (int f, ZipHeader *h)
+static ZipError zipfile_open (ZipFile *self)
   {
   LOG_IN
-  int error = ZE_OK;
-  unsigned char buff[PATH_MAX];
-  uint64_t offset = lseek (f, 0, SEEK_CUR);
-  if (read (f, buff, 30) == 30)
+  ZipError ret = ZE_OK;
+  int f = open (self->filename, O_RDONLY);
+  if (f >= 0)
     {
-    if (buff[0] == 0x50 && buff[1] == 0x4B && buff[2] == 0x03
-         && buff[3] == 0x04)
+    struct stat sb;
+    if (fstat (f, &sb) == 0)
       {
-      int version = buff[4] + 256 * buff[5];
-      h->version = version;
-      log_trace ("version = %d", version);
-      int flags = buff[6] + 256 * buff[7];
-      int method = buff[8] + 256 * buff[9];
-      h->flags = flags;
-      h->method = method;
-      log_trace ("flag = %08x", flags);
-      uint64_t compressed_size = buff[18] + 256 * buff[19] + 
-         256 * 256 * buff[20] + 256 * 256 * 256 * buff[21];
-      h->compressed_size = compressed_size;
-      uint64_t uncompressed_size = buff[22] + 256 * buff[23] + 
-         256 * 256 * buff[24] + 256 * 256 * 256 * buff[25];
-      h->uncompressed_size = uncompressed_size;
-      int filename_len = buff[26] + 256 * buff[27];
-      int extra_len = buff[28] + 256 * buff[29];
-      read (f, buff, filename_len);
-      buff[filename_len] = 0;
-      strcpy (h->filename, (char *)buff);
-      log_trace ("filename=%s", h->filename);
-      log_trace ("extra = %d", extra_len);
-      log_trace ("comp = %lld", (long long int)h->compressed_size);
-      log_trace ("uncomp = %lld", (long long int)h->uncompressed_size);
-      log_trace ("method = %d", h->method);
-      h->data_start = offset + 30 + filename_len + extra_len;
-      h->next_header = h->data_start + h->compressed_size; 
-      log_trace ("data start = %ld", h->data_start);
-      BOOL has_dd = FALSE;
-      if (flags & 0x08)
-	has_dd = TRUE;
-      if (has_dd)
+      self->size = sb.st_size;
+      if (S_ISREG (sb.st_mode) && sb.st_size > 0)
         {
-	// Ugh! This really sucks. If the entry has a 'data descriptor',
-	//   then the compressed size and checksum are written in a 
-	//   separate block _after_ the compressed data
-	// To make it worse, this block is not of a fixed size
-        log_trace ("Entry has DD");
-	uint64_t old_pos = lseek (f, 0, SEEK_SET);
-	lseek (f, h->data_start + h->compressed_size, SEEK_SET);
-        read (f, buff, 16);
-	int off = 8;
-        if (buff[0] == 0x50 && buff[1] == 0x4B && buff[2] == 0x07
-             && buff[3] == 0x08)
-           {
-           log_trace ("DD has signature");
-	   off = 12;
-           }
-
-        uint64_t uncompressed_size = buff[off] + 256 * buff[off+1] + 
-           256 * 256 * buff[off+2] + 256 * 256 * 256 * buff[off+3];
-        h->uncompressed_size = uncompressed_size;
-
-	lseek (f, old_pos, SEEK_SET);
-	h->next_header += off + 4;
-	}
-      log_trace ("next header = %ld", h->next_header);
-      }
-    else if (buff[0] == 0x50 && buff[1] == 0x4B && buff[2] == 0x01
-         && buff[3] == 0x02)
-      {
-      // We've reached the central directory. This is not an error, 
-      //   except if it is the first header in the file -- and
-      //   that isn't strictly speaking an error, it's just an empty
-      //   file
-      error = ZE_CD;
+        void *map = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, f, 0);
+        if (map != MAP_FAILED)
+          {
+          self->map = map;
+          close (f);
+          f = -1;
+          }
+        else
+          log_debug ("zipfile_open: can't map %s (%s), using pread", 
+            self->filename, strerror (errno));
+        }
+      self->fd = f;
       }
     else
       {
-      log_warning ("zip_read_header: bad magic number");
-      error = ZE_BADZIP;
+      close (f);
+      ret = ZE_OPENREAD;
       }
     }
   else
     {
-    log_warning ("zip_read_header: file too short");
-    error = ZE_BADZIP;
+    log_debug ("zipfile_open: can't open %s for reading", self->filename);
+    ret = ZE_OPENREAD;
     }
-
   LOG_OUT
-  return error;
+  return ret;
   }
 
-
 /*==========================================================================
 
-  zipfile_read_header_from_cd
+  zipfile_view
 
-  Read a file header from the central directory, assuming the file pointer
-    is in the right place. We can get all the information we need about
-    a compressed file from this place, _except_ where the data is actually
-    stored on disk. The central directory stores a pointer to the 'local
-    header' (which is of variable size); the compressed data starts after
-    that.
+  Get a pointer to length bytes of the file, starting at offset. If 
+    the file is mapped, this is just a pointer into the mapping. Otherwise
+    the data is read with pread() into a buffer that is allocated, and
+    returned in *scratch. The caller must free *scratch, if it is not NULL, 
+    when it is finished with the data.
+
+  Returns ZE_BADZIP if the requested range is not entirely inside the file.
 
 *==========================================================================*/
-ZipError zip_read_header_from_cd (int f, ZipHeader *h)
+static ZipError zipfile_view (const ZipFile *self, uint64_t offset, 
+    uint64_t length, const BYTE **data, BYTE **scratch)
   {
-  LOG_IN
-  int error = ZE_OK;
-  unsigned char buff[42];
-  uint64_t offset = lseek (f, 0, SEEK_CUR);
-  if (read (f, buff, 46) > 20)
+  *scratch = NULL;
+  if (offset > self->size || self->size - offset < length)
+    return ZE_BADZIP;
+
+  if (self->map)
     {
-    if (buff[0] == 0x50 && buff[1] == 0x4B && buff[2] == 0x01
-         && buff[3] == 0x02)
+    *data = self->map + offset;
+    return ZE_OK;
+    }
+
+  BYTE *buff = malloc (length > 0 ? length : 1);
+  uint64_t done = 0;
+  while (done < length)
+    {
+    ssize_t n = pread (self->fd, buff + done, length - done, offset + done);
+    if (n <= 0)
       {
-      uint64_t compressed_size = buff[20] + 256 * buff[21] + 
-         256 * 256 * buff[22] + 256 * 256 * 256 * buff[23];
-      uint64_t uncompressed_size = buff[24] + 256 * buff[25] + 
-         256 * 256 * buff[26] + 256 * 256 * 256 * buff[27];
-      uint64_t filename_length = buff[28] + 256 * buff[29];
-      uint64_t extra_length = buff[30] + 256 * buff[31];
-      uint64_t comment_length = buff[32] + 256 * buff[33];
-      uint64_t external_attr = buff[38] + 256 * buff[39] + 
-         256 * 256 * buff[40] + 256 * 256 * 256 * buff[41];
-      uint64_t local_header = buff[42] + 256 * buff[43] + 
-         256 * 256 * buff[44] + 256 * 256 * 256 * buff[45];
-      h->compressed_size = compressed_size;
-      h->uncompressed_size = uncompressed_size;
-      h->local_header = local_header;
-      h->external_attr = external_attr;
-      h->mode = (external_attr >> 16) & 0777; 
-      log_debug ("Compressed size = %ld", h->compressed_size);
-      log_debug ("Uncompressed size = %ld", h->uncompressed_size);
-
-      char buff[PATH_MAX];
-      read (f, buff, filename_length);
-      buff[filename_length] = 0;
-      strcpy (h->filename, (char *)buff);
-
-      h->next_header = offset + 46 + filename_length + extra_length + 
-          comment_length;
-   
-      lseek (f, local_header, SEEK_SET);
-      ZipHeader lh;
-      zipfile_read_local_header (f, &lh);
-      h->method = lh.method;
-      h->data_start = lh.data_start;
-
-      // We can seek to the local header now, because next_header is
-      //  already stored for this CD entry
+      if (n < 0 && errno == EINTR) continue;
+      free (buff);
+      return ZE_BADZIP;
       }
-    else if (buff[0] == 0x50 && buff[1] == 0x4B && buff[2] == 0x05
-         && buff[3] == 0x06)
+    done += n;
+    }
+  *scratch = buff;
+  *data = buff;
+  return ZE_OK;
+  }
+
+/*==========================================================================
+
+  zipfile_find_data
+
+  Work out where the compressed data for an entry starts, by reading its
+    local header. Unfortunately, this is not stored anywhere, but 
+    calculated from the size of the local header, which is (sigh) 
+    variable. We only do this when an entry is actually extracted, so 
+    entries that are filtered out never cost us a read of their
+    local headers. Everything else we need -- sizes, compression
+    method -- comes from the central directory, which is authoritative
+    even when the entry has a trailing data descriptor.
+
+*==========================================================================*/
+static ZipError zipfile_find_data (const ZipFile *self, const ZipEntry *e,
+    uint64_t *data_start)
+  {
+  LOG_IN
+  ZipError error = ZE_OK;
+  const BYTE *data;
+  BYTE *scratch;
+
+  if (zipfile_view (self, e->local_header, 30, &data, &scratch) == ZE_OK)
+    {
+    ZipCursor c;
+    zipcursor_init (&c, data, 30);
+    if (zipcursor_u32 (&c) == 0x04034b50)
       {
-      // Reached the end of the CD
-      error = ZE_CD;
+      c.pos = 26;
+      int filename_len = zipcursor_u16 (&c);
+      int extra_len = zipcursor_u16 (&c);
+      *data_start = e->local_header + 30 + filename_len + extra_len;
+      log_trace ("data start = %ld", *data_start);
       }
     else
       {
+      log_warning ("zipfile_find_data: bad magic number in local header");
       error = ZE_BADZIP;
-      log_debug ("Unrecognized CD signature");
       }
+    if (scratch) free (scratch);
     }
   else
     {
-    // It's an error if we hit EOF without encountering the end-of-CD
-    //   signature (although we could excuse this, I guess, in 
-    //   necessary)
+    log_warning ("zipfile_find_data: local header is outside the file");
     error = ZE_BADZIP;
     }
 
@@ -307,60 +415,117 @@ ZipError zip_read_header_from_cd (int f, ZipHeader *h)
   return error;
   }
 
+
+/*==========================================================================
+
+  zipfile_add_entry
+
+  Append an entry to the index, copying its filename into the string
+    pool. Both the entry table and the pool grow geometrically, so the
+    cost of building the index is proportional to the number of entries
+    and the total length of their names.
+
+*==========================================================================*/
+static void zipfile_add_entry (ZipFile *self, const ZipEntry *e, 
+    const BYTE *name, int name_length)
+  {
+  if (self->num_entries == self->max_entries)
+    {
+    self->max_entries = self->max_entries ? self->max_entries * 2 : 64;
+    self->entries = realloc (self->entries, 
+      self->max_entries * sizeof (ZipEntry));
+    }
+  if (self->names_length + name_length + 1 > self->names_size)
+    {
+    uint64_t size = self->names_size ? self->names_size * 2 : 4096;
+    while (size < self->names_length + name_length + 1) size *= 2;
+    self->names = realloc (self->names, size);
+    self->names_size = size;
+    }
+
+  ZipEntry *ne = &self->entries[self->num_entries];
+  *ne = *e;
+  ne->name_offset = self->names_length;
+  ne->name_length = name_length;
+  memcpy (self->names + self->names_length, name, name_length);
+  self->names[self->names_length + name_length] = 0;
+  self->names_length += name_length + 1;
+  self->num_entries++;
+  }
+
 /*==========================================================================
 
   zipfile_read_cd
 
-  Read the central directory, creating a List of struct ZipHeader as
-   we go. The List may legitimately be empty at the end -- it is not
+  Read the central directory, building the index as we go. The whole
+   directory is fetched in one go -- it is just a pointer into the mapping,
+   or a single pread() -- and the records parsed in a loop. We can get 
+   all the information we need about a compressed file from the CD, 
+   _except_ where the data is actually stored in the file; see 
+   zipfile_find_data() for that.
+
+  The index may legitimately be empty at the end -- it is not
    actually an error for a zipfile to contain no files (but it must
    contain a CD). 
 
 *==========================================================================*/
-ZipError zipfile_read_cd (ZipFile *self, uint64_t cd)
+static ZipError zipfile_read_cd (ZipFile *self, uint64_t cd, 
+    uint64_t cd_length, int count)
   {
   LOG_IN
   ZipError error = 0;
+  const BYTE *data;
+  BYTE *scratch;
 
   log_debug ("zipfile_read_cd: %s, %ld", self->filename, cd);
-  int f = open (self->filename, O_RDONLY);
-  if (f > 0)
+  if (zipfile_view (self, cd, cd_length, &data, &scratch) == ZE_OK)
     {
-    lseek (f, cd, SEEK_SET);
-    struct stat sb;
-    fstat (f, &sb);
-    uint64_t filesize = sb.st_size;
-    ZipHeader h;
-    error = zip_read_header_from_cd (f, &h); 
-    if (!error)
+    // The count from the end-of-CD record is only a hint, but it's 
+    //   usually right. Every CD record is at least 46 bytes plus its
+    //   filename, so the length of the CD is an upper bound on the
+    //   space we need for the names
+    self->max_entries = count > 0 ? count : 64;
+    self->entries = malloc (self->max_entries * sizeof (ZipEntry));
+    self->names_size = cd_length + 1;
+    self->names = malloc (self->names_size);
+
+    ZipCursor c;
+    zipcursor_init (&c, data, cd_length);
+    while (!error && c.pos + 4 <= cd_length)
       {
-      self->contents = list_create (free);
-      ZipHeader *hh = malloc (sizeof (ZipHeader));
-      memcpy (hh, &h, sizeof (ZipHeader));
-      list_append (self->contents, hh);
-      do
-	{
-	if (h.next_header < filesize)
-	  {
-	  lseek (f, h.next_header, SEEK_SET);
-          error = zip_read_header_from_cd (f, &h); 
-	  if (!error)
-	    {
-            ZipHeader *hh = malloc (sizeof (ZipHeader));
-            memcpy (hh, &h, sizeof (ZipHeader));
-            list_append (self->contents, hh);
-	    }
-	  }
-        } while (!error);
-      if (error == ZE_CD) error = 0;
+      uint64_t start = c.pos;
+      if (zipcursor_u32 (&c) != 0x02014b50) 
+        break; // Probably a zip64 end-of-CD, or a digital signature
+      ZipEntry e;
+      c.pos = start + 10;
+      e.method = zipcursor_u16 (&c);
+      c.pos = start + 20;
+      e.compressed_size = zipcursor_u32 (&c);
+      e.uncompressed_size = zipcursor_u32 (&c);
+      uint64_t filename_length = zipcursor_u16 (&c);
+      uint64_t extra_length = zipcursor_u16 (&c);
+      uint64_t comment_length = zipcursor_u16 (&c);
+      c.pos = start + 38;
+      uint64_t external_attr = zipcursor_u32 (&c);
+      e.local_header = zipcursor_u32 (&c);
+      e.mode = (external_attr >> 16) & 0777; 
+      const BYTE *name = zipcursor_bytes (&c, filename_length);
+      c.pos = start + 46 + filename_length + extra_length + comment_length;
+      if (c.overrun || c.pos > cd_length)
+        {
+        log_debug ("Truncated CD record");
+        error = ZE_BADZIP;
+        }
+      else
+        zipfile_add_entry (self, &e, name, filename_length);
       }
-    close (f);
+    if (scratch) free (scratch);
+    log_debug ("zipfile_read_cd: %d entries", self->num_entries);
     }
   else
     {
-    log_debug ("zipfile_find_cd: can't open %s for reading", 
-      self->filename);
-    return ZE_OPENREAD;
+    log_debug ("zipfile_read_cd: CD is outside the file");
+    error = ZE_BADZIP;
     }
 
   LOG_OUT
@@ -374,62 +539,52 @@ ZipError zipfile_read_cd (ZipFile *self, uint64_t cd)
 
   Find the central directory at the end of the zipfile. This is very ugly,
     but the zip file format does not provide any elegant way to find the
-    CD. We have to read the last 64k, and hunt for the signature of the
-    end-central-directory record. 64k is the largest this can be but, in
-    fact, it will usually be in the last hundred bytes or so. 
-  The end-central-directory contains the offset of the first CD header.
+    CD. We have to hunt for the signature of the
+    end-central-directory record in the last 64k (plus the size of the
+    record itself). 64k is the largest the trailing comment can be but, in
+    fact, the record will usually be the last 22 bytes of the file, so
+    we search backwards from the end. 
+  The end-central-directory contains the offset of the first CD header,
+    and the number of entries. The CD ends where the end-central-directory
+    record starts.
 
 *==========================================================================*/
-ZipError zipfile_find_cd (ZipFile *self, uint64_t *cd)
+static ZipError zipfile_find_cd (ZipFile *self, uint64_t *cd, 
+    uint64_t *cd_length, int *count)
   {
   LOG_IN
-  ZipError ret = 0;
-
-  log_debug ("zipfile_read_cd: %s", self->filename);
-  int f = open (self->filename, O_RDONLY);
-  if (f > 0)
+  ZipError ret = ZE_BADZIP;
+
+  log_debug ("zipfile_find_cd: %s", self->filename);
+  uint64_t toread = self->size;
+  if (toread > 65535 + 22) toread = 65535 + 22;
+  uint64_t tostart = self->size - toread;
+  const BYTE *buff;
+  BYTE *scratch;
+  if (toread >= 22 && 
+       zipfile_view (self, tostart, toread, &buff, &scratch) == ZE_OK)
     {
-    struct stat sb;
-    fstat (f, &sb);
-    uint64_t filesize = sb.st_size;
-    int toread, tostart;
-    if (filesize > 65536)
-      {
-      toread = 65536;
-      tostart = filesize - 65536;
-      }
-    else
-      {
-      toread = filesize;
-      tostart = 0;
-      }
-    unsigned char *buff = malloc (toread);
-    lseek (f, tostart, SEEK_SET);     
-    read (f, buff, toread);
-    //int n = read (f, buff, toread);
-
-    for (int i = 0; i < toread - 4 && (*cd == -1); i++)
+    for (int64_t i = toread - 22; i >= 0 && ret != ZE_OK; i--)
       {
-      BYTE b = buff[i];
-      if (b == 0x50)
+      if (buff[i] == 0x50 && buff[i+1] == 0x4b && buff[i+2] == 0x05 
+           && buff[i+3] == 0x06)
         {
-        if (buff[i+1] == 0x4b && buff[i+2] == 0x05 && buff[i+3] == 0x06)
+        ZipCursor c;
+        zipcursor_init (&c, buff + i, toread - i);
+        c.pos = 10;
+        *count = zipcursor_u16 (&c);
+        c.pos = 16;
+        *cd = zipcursor_u32 (&c);
+        uint64_t eocd = tostart + i;
+        if (*cd <= eocd)
           {
-          *cd = (int)buff[i + 16] + 256 * buff[i + 17] + 
-             256 * 256 * buff[i + 18] + 256 * 256 * 256 * buff[i + 19];
+          *cd_length = eocd - *cd;
           log_debug ("Found CD at %ld", *cd);
+          ret = ZE_OK;
           }
         }
       }
-    
-    free (buff);
-    close (f);
-    }
-  else
-    {
-    log_debug ("zipfile_find_cd: can't open %s for reading", 
-      self->filename);
-    ret = ZE_OPENREAD;
+    if (scratch) free (scratch);
     }
 
   LOG_OUT
@@ -441,7 +596,9 @@ ZipError zipfile_find_cd (ZipFile *self, uint64_t *cd)
   zipfile_read_contents
 
   Read the zipfile metadata and build an index. This must be the 
-   first method called after the ZipFile object is created.
+   first method called after the ZipFile object is created. This is
+   the only place the file is opened -- all subsequent operations use
+   the mapping or descriptor that is set up here.
 
 *==========================================================================*/
 ZipError zipfile_read_contents (ZipFile *self)
@@ -449,10 +606,13 @@ ZipError zipfile_read_contents (ZipFile *self)
   int error = ZE_OK;
   LOG_IN
 
-  uint64_t cd = -1;
-  error = zipfile_find_cd (self, &cd);
+  uint64_t cd = 0, cd_length = 0;
+  int count = 0;
+  error = zipfile_open (self);
+  if (!error)
+    error = zipfile_find_cd (self, &cd, &cd_length, &count);
   if (!error)
-    error = zipfile_read_cd (self, cd);
+    error = zipfile_read_cd (self, cd, cd_length, count);
 
   LOG_OUT
   return error;
@@ -468,7 +628,65 @@ ZipError zipfile_read_contents (ZipFile *self)
 *==========================================================================*/
 int zipfile_get_num_entries (const ZipFile *self)
   {
-  return list_length (self->contents);
+  return self->num_entries;
+  }
+
+
+/*==========================================================================
+
+  zipfile_get_entry_name
+
+  Get the filename of entry n. The string belongs to the ZipFile, and 
+    remains valid until it is destroyed. Note that filename may be a path. 
+    It may also be a directory, conventionally indicated by a trailing '/' 
+    and zero size.
+
+*==========================================================================*/
+const char *zipfile_get_entry_name (const ZipFile *self, int n)
+  {
+  return self->names + self->entries[n].name_offset;
+  }
+
+
+/*==========================================================================
+
+  zipfile_get_entry_size
+
+  Get the uncompressed size of entry n.
+
+*==========================================================================*/
+uint64_t zipfile_get_entry_size (const ZipFile *self, int n)
+  {
+  return self->entries[n].uncompressed_size;
+  }
+
+
+/*==========================================================================
+
+  zipfile_iterator_init, zipfile_iterator_next
+
+  Step through the entries in the index in order. Call 
+    zipfile_iterator_next() until it returns FALSE; each call that returns
+    TRUE fills in the index, name, and uncompressed size of the next entry. 
+
+*==========================================================================*/
+void zipfile_iterator_init (const ZipFile *self, ZipIterator *it)
+  {
+  it->zipfile = self;
+  it->index = -1;
+  it->name = NULL;
+  it->size = 0;
+  }
+
+BOOL zipfile_iterator_next (ZipIterator *it)
+  {
+  const ZipFile *self = it->zipfile;
+  if (it->index + 1 >= self->num_entries) return FALSE;
+  it->index++;
+  const ZipEntry *e = &self->entries[it->index];
+  it->name = self->names + e->name_offset;
+  it->size = e->uncompressed_size;
+  return TRUE;
   }
 
 
@@ -476,7 +694,8 @@ int zipfile_get_num_entries (const ZipFile *self)
 
   zipfile_get_entry_details
 
-  Get the size and filename of an entry.
+  Get the size and filename of an entry, copying the filename. 
+    zipfile_get_entry_name() is usually more convenient.
 
   Note that filename may be a path. It may also be a directory, 
     conventionally indicated by a trailing '/' and zero size.
@@ -494,8 +713,8 @@ void zipfile_get_entry_details (const ZipFile *self, int n, char *filename,
            " %d of %d", n, l);
   else
     {
-    ZipHeader *h = list_get (self->contents, n);
-    strncpy (filename, h->filename, max_filename);
+    const ZipEntry *h = &self->entries[n];
+    strncpy (filename, self->names + h->name_offset, max_filename);
     *size = h->uncompressed_size;
     }
 
@@ -515,72 +734,220 @@ void zipfile_get_entry_details (const ZipFile *self, int n, char *filename,
    directory, it will allocate an empty buffer -- this is not an error,
    although it may well be unhelpful.
 
+  This is just a stream read of the whole entry, so the compressed data is
+   inflated straight from the mapping (or a recycled input buffer), and 
+   the only allocation is the output.
+
 *==========================================================================*/
 ZipError zipfile_extract_to_memory (const ZipFile *self, int n, 
     BYTE **out, uint64_t *length)
   {
   LOG_IN
 
+  log_debug ("zip_extract_to_memory, entry %d", n);
+
+  ZipStream *stream = NULL;
+  ZipError ret = zipfile_stream_open (self, n, &stream);
+  if (ret == ZE_OK)
+    {
+    uint64_t size = self->entries[n].uncompressed_size;
+    // No point checking this malloc -- it will always 
+    //   succeed on Linux, even in low memory 
+    *out = malloc (size > 0 ? size : 1);
+    uint64_t got = 0;
+    ret = zipfile_stream_read (stream, *out, size, &got);
+    if (ret == ZE_OK && got != size) ret = ZE_CORRUPT;
+    if (ret != ZE_OK)
+      {
+      free (*out);
+      *out = NULL;
+      }
+    else if (length) 
+      *length = size;
+    zipfile_stream_close (stream);
+    }
+
+  LOG_OUT
+
+  return ret;
+  }
+
+
+/*==========================================================================
+
+  zipfile_stream_free
+
+*==========================================================================*/
+static void zipfile_stream_free (ZipStream *self)
+  {
+  if (self->zs_ready) inflateEnd (&self->zs);
+  if (self->input) free (self->input);
+  free (self);
+  }
+
+
+/*==========================================================================
+
+  zipfile_cache_destroy
+
+  Called when a thread that has used streams exits.
+
+*==========================================================================*/
+static void zipfile_cache_destroy (void *data)
+  {
+  ZipStreamCache *cache = data;
+  for (int i = 0; i < cache->count; i++)
+    zipfile_stream_free (cache->streams[i]);
+  free (cache);
+  }
+
+
+/*==========================================================================
+
+  zipfile_cache_init
+
+*==========================================================================*/
+static void zipfile_cache_init (void)
+  {
+  pthread_key_create (&zipfile_cache_key, zipfile_cache_destroy);
+  }
+
+
+/*==========================================================================
+
+  zipfile_stream_alloc
+
+  Get a ZipStream, preferably one that this thread has used before and 
+    released. A recycled stream keeps its zlib state, which only needs
+    inflateReset(), and its input buffer. So setting up zlib, and 
+    allocating its window and buffers, is a once-per-thread cost.
+ 
+*==========================================================================*/
+static ZipStream *zipfile_stream_alloc (void)
+  {
+  pthread_once (&zipfile_cache_once, zipfile_cache_init);
+  ZipStreamCache *cache = pthread_getspecific (zipfile_cache_key);
+  if (cache && cache->count > 0)
+    {
+    cache->count--;
+    return cache->streams[cache->count];
+    }
+  ZipStream *s = malloc (sizeof (ZipStream));
+  s->input = NULL;
+  s->zs_ready = FALSE;
+  return s;
+  }
+
+
+/*==========================================================================
+
+  zipfile_stream_release
+
+  Give a stream back to this thread's cache, or free it if the cache
+    is full.
+
+*==========================================================================*/
+static void zipfile_stream_release (ZipStream *s)
+  {
+  ZipStreamCache *cache = pthread_getspecific (zipfile_cache_key);
+  if (!cache)
+    {
+    cache = malloc (sizeof (ZipStreamCache));
+    cache->count = 0;
+    pthread_setspecific (zipfile_cache_key, cache);
+    }
+  if (cache->count < ZIP_STREAM_CACHE)
+    cache->streams[cache->count++] = s;
+  else
+    zipfile_stream_free (s);
+  }
+
+
+/*==========================================================================
+
+  zipfile_stream_open
+
+  Start extracting entry n a piece at a time. Use zipfile_stream_read() to 
+    get the decompressed data, in blocks of whatever size suits the
+    caller, and zipfile_stream_close() to clean up. The entry's data is
+    read from the mapping if there is one; otherwise it is read, a block
+    at a time, with pread(). Either way, the memory used does not depend
+    on the size of the entry.
+
+  If this method returns an error, no stream will have been created.
+
+*==========================================================================*/
+ZipError zipfile_stream_open (const ZipFile *self, int n, 
+    ZipStream **stream)
+  {
+  LOG_IN
   ZipError ret = ZE_OK;
 
-  log_debug ("zip_extract_to_memory, entry %d", n);
+  log_debug ("zipfile_stream_open, entry %d", n);
 
   int l = zipfile_get_num_entries (self);
   if (n >= l)
     {
     log_error 
-       ("zip_extract_to_file: attempt to reference non-existent entry:"
+       ("zipfile_stream_open: attempt to reference non-existent entry:"
            " %d of %d", n, l);
-     ret = ZE_INTERNAL;
-     }
+    ret = ZE_INTERNAL;
+    }
   else
     {
-    ZipHeader *h = list_get (self->contents, n);
+    const ZipEntry *h = &self->entries[n];
     int method = h->method;
     if (method == 8 || method == 0)
       {
-      int f = open (self->filename, O_RDONLY);
-      if (f >= 1)
+      uint64_t data_start = 0;
+      uint64_t data_size = method == 0 ? 
+        h->uncompressed_size : h->compressed_size;
+      ret = zipfile_find_data (self, h, &data_start);
+      if (ret == ZE_OK && (data_start > self->size || 
+           self->size - data_start < data_size))
         {
-        uint64_t data_start = h->data_start;
-	lseek (f, data_start, SEEK_SET);
-	if (method == 0) // uncompressed
-	  {
-          log_debug ("zipfile_extract_to_memory: %s: entry is uncompressed",
-             self->filename);
-	  *out = malloc (h->uncompressed_size);
-	  read (f, *out, h->uncompressed_size);
-	  }
-	else // DEFLATE
-	  {
-          log_debug ("zipfile_extract_to_memory: %s: entry is deflated");
-	  // No point checking these mallocs -- they will always 
-	  //   succeed on Linux, even in low memory 
-	  BYTE *in = malloc (h->compressed_size + 2);
-	  *out = malloc (h->uncompressed_size);
-	  read (f, in + 2, h->compressed_size);
-          in[0] = 0x78; // Zlib magic numbers
-          in[1] = 0x9C;
-
-	  uint64_t uncompressed_size = h->uncompressed_size;
-	  uint64_t compressed_size = h->compressed_size + 2;
-	  uncompress2 (*out, &uncompressed_size,
-	      in, &compressed_size);
-          free (in);
-          if (uncompressed_size != h->uncompressed_size)
+        log_warning ("zipfile %s: entry data is outside the file", 
+          self->filename);
+        ret = ZE_CORRUPT;
+        }
+      if (ret == ZE_OK)
+        {
+        ZipStream *s = zipfile_stream_alloc ();
+        s->zipfile = self;
+        s->entry = h;
+        s->offset = data_start;
+        s->remaining = data_size;
+        s->produced = 0;
+        s->finished = FALSE;
+        if (!self->map && !s->input)
+          s->input = malloc (ZIP_STREAM_INPUT);
+        if (method == 8)
+          {
+          if (s->zs_ready)
             {
-            free (*out);
-            ret = ZE_CORRUPT;
+            // inflateReset() leaves the input alone, and a stream that
+            //   was closed early might still have some from its last entry
+            inflateReset (&s->zs);
+            s->zs.next_in = NULL;
+            s->zs.avail_in = 0;
             }
-	  }
-        close (f);
-        if (length) *length = h->uncompressed_size;
-	}
-      else
-        {
-        ret = ZE_OPENREAD;
-        log_warning ("zipfile %s seems to have vanished", self->filename);
-	}
+          else
+            {
+            memset (&s->zs, 0, sizeof (s->zs));
+            // Negative window bits: the data in a zipfile is raw deflate,
+            //   with no zlib header or trailer
+            if (inflateInit2 (&s->zs, -MAX_WBITS) == Z_OK)
+              s->zs_ready = TRUE;
+            else
+              {
+              zipfile_stream_free (s);
+              s = NULL;
+              ret = ZE_INTERNAL;
+              }
+            }
+          }
+        *stream = s;
+        }
       }
     else
       {
@@ -591,9 +958,156 @@ ZipError zipfile_extract_to_memory (const ZipFile *self, int n,
     }
 
   LOG_OUT
+  return ret;
+  }
+
+
+/*==========================================================================
+
+  zipfile_stream_fetch
+
+  Get the next block of the entry's stored (usually compressed) data.
+    From a mapping, this is just all of the remaining data; otherwise it
+    is read into the stream's input buffer.
+
+*==========================================================================*/
+static ZipError zipfile_stream_fetch (ZipStream *self, const BYTE **data,
+    uint64_t *length)
+  {
+  const ZipFile *z = self->zipfile;
+  uint64_t n = self->remaining;
+  if (z->map)
+    {
+    *data = z->map + self->offset;
+    }
+  else
+    {
+    if (n > ZIP_STREAM_INPUT) n = ZIP_STREAM_INPUT;
+    ssize_t r;
+    do
+      r = pread (z->fd, self->input, n, self->offset);
+    while (r < 0 && errno == EINTR);
+    if (r <= 0) return ZE_CORRUPT;
+    n = r;
+    *data = self->input;
+    }
+  *length = n;
+  return ZE_OK;
+  }
+
+
+/*==========================================================================
+
+  zipfile_stream_read
+
+  Decompress up to size bytes of the entry into buff. *got is set to the 
+    number of bytes actually stored. This will only be less than size
+    when the end of the entry has been reached, and will be zero on all 
+    calls after that. 
 
+  As with zipfile_extract_to_memory(), the only integrity check is that
+    the entry decompresses to the size stored in the index. If it does not,
+    the call that reaches the end of the data returns ZE_CORRUPT.
+
+*==========================================================================*/
+ZipError zipfile_stream_read (ZipStream *self, BYTE *buff, uint64_t size, 
+    uint64_t *got)
+  {
+  LOG_IN
+  ZipError ret = ZE_OK;
+  uint64_t done = 0;
+  const ZipEntry *h = self->entry;
+
+  while (ret == ZE_OK && done < size && !self->finished)
+    {
+    if (h->method == 0) // uncompressed
+      {
+      if (self->remaining == 0)
+        {
+        self->finished = TRUE;
+        break;
+        }
+      uint64_t length = self->remaining;
+      if (length > size - done) length = size - done;
+      if (self->zipfile->map)
+        memcpy (buff + done, self->zipfile->map + self->offset, length);
+      else
+        {
+        // No point going through the input buffer -- read straight
+        //   into the caller's
+        ssize_t r;
+        do
+          r = pread (self->zipfile->fd, buff + done, length, self->offset);
+        while (r < 0 && errno == EINTR);
+        if (r <= 0) 
+          {
+          ret = ZE_CORRUPT;
+          break;
+          }
+        length = r;
+        }
+      done += length;
+      self->offset += length;
+      self->remaining -= length;
+      }
+    else // DEFLATE
+      {
+      if (self->zs.avail_in == 0 && self->remaining > 0)
+        {
+        const BYTE *data;
+        uint64_t length;
+        ret = zipfile_stream_fetch (self, &data, &length);
+        if (ret != ZE_OK) break;
+        // zlib counts in uInt, so we may have to feed a huge mapped 
+        //   entry to it in pieces
+        if (length > UINT_MAX) length = UINT_MAX;
+        self->zs.next_in = (Bytef *)data;
+        self->zs.avail_in = length;
+        self->offset += length;
+        self->remaining -= length;
+        }
+      uint64_t want = size - done;
+      if (want > UINT_MAX) want = UINT_MAX;
+      self->zs.next_out = buff + done;
+      self->zs.avail_out = want;
+      int zret = inflate (&self->zs, Z_NO_FLUSH);
+      done += want - self->zs.avail_out;
+      if (zret == Z_STREAM_END)
+        self->finished = TRUE;
+      else if (zret == Z_BUF_ERROR && self->remaining == 0 
+                 && self->zs.avail_in == 0)
+        {
+        // Ran out of data before the end of the deflate stream
+        ret = ZE_CORRUPT;
+        }
+      else if (zret != Z_OK && zret != Z_BUF_ERROR)
+        ret = ZE_CORRUPT;
+      }
+    }
+
+  self->produced += done;
+  if (ret == ZE_OK && self->finished && 
+        self->produced != h->uncompressed_size)
+    ret = ZE_CORRUPT;
+  if (self->produced > h->uncompressed_size)
+    ret = ZE_CORRUPT;
+
+  *got = done;
+  LOG_OUT
   return ret;
+  }
+
 
+/*==========================================================================
+
+  zipfile_stream_close
+
+*==========================================================================*/
+void zipfile_stream_close (ZipStream *self)
+  {
+  LOG_IN
+  if (self) zipfile_stream_release (self);
+  LOG_OUT
   }
 
 
@@ -630,7 +1144,7 @@ ZipError zipfile_extract_to_file (const ZipFile *self, int n,
      }
   else
     {
-    ZipHeader *h = list_get (self->contents, n);
+    const ZipEntry *h = &self->entries[n];
     int method = h->method;
     if (method == 8 || method == 0)
       {
@@ -685,13 +1199,12 @@ int zipfile_extract_all (const ZipFile *self, const char *extract_path,
   int ret = ZE_OK;
 
   log_debug ("zipfile_extract_all, to %s\n", extract_path);
-  List *contents = self->contents;
-  int l = list_length (contents);
+  int l = self->num_entries;
   for (int i = 0; (ret == 0 || carry_on) && i < l; i++)
     {
-    ZipHeader *ze = list_get (contents, i);
+    const ZipEntry *ze = &self->entries[i];
     Path *path = path_create (extract_path);
-    path_append (path, ze->filename);
+    path_append (path, self->names + ze->name_offset);
     // Zip format uses an entry ending in / to indicate a directory
     if (path_ends_with_fwd_slash (path))
       {
@@ -700,7 +1213,6 @@ int zipfile_extract_all (const ZipFile *self, const char *extract_path,
       //   on the zipper creating directory entries -- the program
       //   has to willing to infer them from pathnames
       char *s_path = (char *)path_to_utf8 (path);
-      free (s_path);
       if (path_create_directory (path))
         {
         }
@@ -709,6 +1221,7 @@ int zipfile_extract_all (const ZipFile *self, const char *extract_path,
         log_debug ("zip_extract_all: could not create directory %s\n", 
           s_path); 
         }
+      free (s_path);
       }
     else
       {
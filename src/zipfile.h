@@ -39,12 +39,30 @@ typedef enum
 struct _ZipFile;
 typedef struct _ZipFile ZipFile;
 
+struct _ZipStream;
+typedef struct _ZipStream ZipStream;
+
+// Iterator over the entries in a ZipFile's index -- see
+//   zipfile_iterator_next(). The name points into the ZipFile's own
+//   storage, and is valid until the ZipFile is destroyed.
+typedef struct _ZipIterator
+  {
+  const ZipFile *zipfile;
+  int index;
+  const char *name;
+  uint64_t size;
+  } ZipIterator;
+
 BEGIN_DECLS
 
 ZipFile *zipfile_create (const char *filename);
 void     zipfile_destroy (ZipFile *self);
 ZipError zipfile_read_contents (ZipFile *self);
 int      zipfile_get_num_entries (const ZipFile *self);
+const char *zipfile_get_entry_name (const ZipFile *self, int n);
+uint64_t zipfile_get_entry_size (const ZipFile *self, int n);
+void     zipfile_iterator_init (const ZipFile *self, ZipIterator *it);
+BOOL     zipfile_iterator_next (ZipIterator *it);
 void     zipfile_get_entry_details (const ZipFile *self, 
            int n, char *filename, int max_filename, uint64_t *size);
 ZipError zipfile_extract_to_file (const ZipFile *self, int entry, 
@@ -56,6 +74,11 @@ int      zipfile_extract_all (const ZipFile *self,
 ZipError zipfile_extract_to_buffer (const ZipFile *self, int n, 
             Buffer **buffer);
 const char *zipfile_get_filename (const ZipFile *self);
+ZipError zipfile_stream_open (const ZipFile *self, int n, 
+            ZipStream **stream);
+ZipError zipfile_stream_read (ZipStream *self, BYTE *buff, 
+            uint64_t size, uint64_t *got);
+void     zipfile_stream_close (ZipStream *self);
 
 END_DECLS
 
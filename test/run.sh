@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# kzgrep regression tests
+#
+# Usage: run.sh [-u] [kzgrep]
+#
+# Each line of test/cases is the name of a test, a colon, and the 
+#   arguments to run kzgrep with, in the test/data directory. What
+#   kzgrep writes to stdout, followed by its exit code, must be the same
+#   as test/expected/<name>. With -u, the expected output is written 
+#   instead of checked, for a new test, or a change of behaviour that 
+#   is meant. Blank lines, and lines starting with #, are ignored.
+
+update=0
+if [ "$1" = "-u" ]; then
+  update=1
+  shift
+fi
+
+dir=$(cd "$(dirname "$0")" && pwd)
+kzgrep=$(cd "$(dirname "${1:-kzgrep}")" && pwd)/$(basename "${1:-kzgrep}")
+out=$(mktemp)
+trap 'rm -f "$out"' EXIT
+
+run=0
+failed=0
+while IFS= read -r line; do
+  case "$line" in
+    ''|'#'*) continue ;;
+  esac
+  name=${line%%:*}
+  args=${line#*:}
+  (cd "$dir/data" && eval "\"$kzgrep\" $args" > "$out" 2> /dev/null; 
+    echo "exit $?" >> "$out")
+  run=$((run + 1))
+  if [ $update -eq 1 ]; then
+    cp "$out" "$dir/expected/$name"
+  elif ! cmp -s "$out" "$dir/expected/$name"; then
+    echo "FAIL: $name:$args"
+    diff "$dir/expected/$name" "$out" | sed 's/^/  /'
+    failed=$((failed + 1))
+  fi
+done < "$dir/cases"
+
+if [ $update -eq 1 ]; then
+  echo "$run expected outputs written"
+else
+  echo "$run tests, $failed failed"
+fi
+[ $failed -eq 0 ]